@@ -25,3 +25,8 @@ uint64_t maxu(uint64_t a, uint64_t b)
 {
     return (a > b) ? a : b;
 }
+
+uint64_t ceildivu(uint64_t a, uint64_t b)
+{
+    return (a + b - 1) / b;
+}
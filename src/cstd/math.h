@@ -7,5 +7,6 @@ long ceil(double value);
 long floor(double num);
 uint64_t minu(uint64_t a, uint64_t b);
 uint64_t maxu(uint64_t a, uint64_t b);
+uint64_t ceildivu(uint64_t a, uint64_t b);
 
 #endif
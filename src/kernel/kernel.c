@@ -9,6 +9,7 @@ static int kernel_init_fs(void)
     devfs_init();
     drivefs_init();
     isofs_init();
+    fatfs_init();
     
     devfs = malloc(sizeof(vfs_t));
     if (devfs == NULL)
@@ -50,6 +51,9 @@ static int kernel_init(uint64_t multiboot_struct_addr, bitmap_t* current_bitmap)
 {
     interrupts_disable();
 
+    /* Everything below may look up the current process through GS */
+    gdt_init();
+    percpu_init_bsp();
     scheduler_init_pss();
 
     paging_init();
@@ -59,10 +63,9 @@ static int kernel_init(uint64_t multiboot_struct_addr, bitmap_t* current_bitmap)
     
     mmap_init(multiboot_get_tag_mmap());
     pfa_init();
-    tss_init();
-    gdt_init();
     idt_init();
     isr_init();
+    fpu_init();
     
     crc32_fill_lookup_table();
 
@@ -77,6 +80,12 @@ static int kernel_init(uint64_t multiboot_struct_addr, bitmap_t* current_bitmap)
     if (heap_init(KERNEL_HEAP_START_ADDR, KERNEL_HEAP_CEIL_ADDR, SIZE_4KB))
         return -1;
     
+    if (acpi_init() || tsc_init())
+        return -1;
+    if (lapic_init())
+        info("Falling back to the PIT for scheduling");
+    else if (ioapic_init())
+        info("Falling back to the PIC for legacy IRQs");
     pit_init();
     syscall_init();
 
@@ -86,7 +95,6 @@ static int kernel_init(uint64_t multiboot_struct_addr, bitmap_t* current_bitmap)
     if 
     (
         scheduler_init() ||
-        acpi_init() || 
         pci_init() ||
         ahci_init()
     )
@@ -115,6 +123,9 @@ void kernel_main(uint64_t multiboot_struct_addr, bitmap_t* current_bitmap)
         NULL
     };
     scheduler_queue_process(process_create("/test.elf", argv, envp, scheduler_get_next_pid()));
+    /* Started once init is queued so the APs have something to pick up */
+    if (smp_init())
+        info("Running on the boot CPU only");
     scheduler_run();
     info("Kernel initialized (FREE: %u kB | USED: %u kB)", pfa_get_free_memory() >> 10, pfa_get_used_memory() >> 10);
 }
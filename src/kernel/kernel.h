@@ -11,14 +11,21 @@
 #include "sys/cpu/gdt.h"
 #include "sys/cpu/idt.h"
 #include "sys/cpu/tss.h"
+#include "sys/cpu/percpu.h"
+#include "sys/cpu/smp.h"
+#include "sys/cpu/fpu.h"
 #include "sys/cpu/interrupts.h"
+#include "sys/cpu/tsc.h"
 #include "sys/chips/pit.h"
+#include "sys/chips/lapic.h"
+#include "sys/chips/ioapic.h"
 #include "sys/drivers/power/acpi.h"
 #include "sys/drivers/bus/pci.h"
 #include "sys/drivers/video/framebuffer.h"
 #include "sys/drivers/storage/ahci.h"
 #include "sys/drivers/fs/devfs.h"
 #include "sys/drivers/fs/isofs.h"
+#include "sys/drivers/fs/fatfs.h"
 #include "sys/drivers/fs/drivefs.h"
 #include "proc/scheduler.h"
 #include "proc/syscall.h"
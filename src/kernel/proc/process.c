@@ -4,6 +4,7 @@
 #include "../utils/log.h"
 #include "../sys/mem/pfa.h"
 #include "../sys/cpu/gdt.h"
+#include "../sys/cpu/fpu.h"
 #include "../kernel.h"
 #include <stddef.h>
 #include <string.h>
@@ -12,6 +13,17 @@
 
 #define trace_process(msg, ...) trace("PROC", msg, ##__VA_ARGS__)
 
+/* Executables are read this much at a time */
+#define PROC_ELF_CHUNK_SIZE SIZE_nMB(1)
+
+/* An executable being loaded, only its headers are kept in memory */
+typedef struct
+{
+    vnode_t file;
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr* phdrs;
+} process_elf_t;
+
 static void process_release_all_memory(process_t* ps)
 {
     memory_segments_list_entry_t* entry;
@@ -19,9 +31,25 @@ static void process_release_all_memory(process_t* ps)
         pfa_free_pages(entry->paddr, entry->pages);
 }
 
+static void process_close_all_fds(process_t* ps)
+{
+    uint64_t fd;
+
+    for (fd = 0; fd < ps->fds_capacity; fd++)
+    {
+        if (ps->fds[fd] != NULL)
+            file_unref(ps->fds[fd]);
+    }
+    if (ps->fds != NULL)
+        free(ps->fds);
+    ps->fds = NULL;
+    ps->fds_capacity = 0;
+}
+
 void process_delete_resources(process_t* ps)
 {
     process_release_all_memory(ps);
+    process_close_all_fds(ps);
     if (ps->exec_path != NULL)
         free((void*) ps->exec_path);
     if (ps->pml4 != NULL)
@@ -32,52 +60,108 @@ void process_delete_resources(process_t* ps)
 
 void process_delete_and_free(process_t* ps)
 {
+    thread_t* th;
+    thread_t* next;
+
     process_delete_resources(ps);
+    for (th = ps->threads; th != NULL; th = next)
+    {
+        next = th->next;
+        fpu_release(th);
+        free(th);
+    }
     free(ps);
 }
 
+static void process_append_memory_segment(process_t* ps, memory_segments_list_entry_t* entry)
+{
+    entry->next = NULL;
+    if (ps->mem.tail == NULL)
+        ps->mem.head = entry;
+    else
+        ps->mem.tail->next = entry;
+    ps->mem.tail = entry;
+}
+
+static int process_track_memory(process_t* ps, uint64_t paddr, uint64_t vaddr, uint64_t pages, page_access_type_t access, privilege_level_t privilege)
+{
+    memory_segments_list_entry_t* entry;
+
+    entry = malloc(sizeof(memory_segments_list_entry_t));
+    if (entry == NULL)
+        return -1;
+
+    entry->paddr = paddr;
+    entry->vaddr = vaddr;
+    entry->pages = pages;
+    entry->access = access;
+    entry->pl = privilege;
+    process_append_memory_segment(ps, entry);
+
+    return 0;
+}
+
+/* Frees the segments within [start, end) of the given privilege level */
+static void process_release_memory(process_t* ps, uint64_t start, uint64_t end, privilege_level_t privilege)
+{
+    memory_segments_list_entry_t* entry;
+    memory_segments_list_entry_t* next;
+
+    entry = ps->mem.head;
+    ps->mem.head = NULL;
+    ps->mem.tail = NULL;
+    for (; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        if 
+        (
+            entry->pl != privilege ||
+            entry->vaddr < start ||
+            entry->vaddr >= end
+        )
+        {
+            process_append_memory_segment(ps, entry);
+            continue;
+        }
+        pml4_unmap_memory(ps->pml4, entry->vaddr, entry->pages * SIZE_4KB);
+        pfa_free_pages(entry->paddr, entry->pages);
+        free(entry);
+    }
+}
+
+static void process_release_user_memory(process_t* ps)
+{
+    /* Kernel stacks survive, threads may be running on them */
+    process_release_memory(ps, 0, PROC_CEIL_VADDR, PL3);
+}
+
 static int process_request_memory(process_t* ps, uint64_t size, uint64_t hint, page_access_type_t access, privilege_level_t privilege, uint64_t* vaddr_out, uint64_t* paddr_out)
 {
     uint64_t vaddr, paddr, pages;
-    memory_segments_list_entry_t* entry;
     
     if (size == 0)
         return 0;
 
-    pages = ceil((double) size / SIZE_4KB);
+    pages = ceildivu(size, SIZE_4KB);
     if (pml4_get_next_vaddr(ps->pml4, hint, size, &vaddr) < size)
         return -1;
-
-    entry = malloc(sizeof(memory_segments_list_entry_t));
-    if (entry == NULL)
-        return -1;
     
     paddr = pfa_request_pages(pages);
     if (paddr == 0)
-    {
-        free(entry);
         return -1;
-    }
 
     if (pml4_map_memory(ps->pml4, paddr, vaddr, size, access, privilege) < size)
     {
-        free(entry);
         pfa_free_pages(paddr, pages);
         return -1;
     }
 
-    entry->next = NULL;
-    entry->paddr = paddr;
-    entry->vaddr = vaddr;
-    entry->pages = pages;
-    entry->access = access;
-    entry->pl = privilege;
-
-    if (ps->mem.tail == NULL)
-        ps->mem.head = entry;
-    else
-        ps->mem.tail->next = entry;
-    ps->mem.tail = entry;
+    if (process_track_memory(ps, paddr, vaddr, pages, access, privilege))
+    {
+        pml4_unmap_memory(ps->pml4, vaddr, size);
+        pfa_free_pages(paddr, pages);
+        return -1;
+    }
     
     if (vaddr_out != NULL)
         *vaddr_out = vaddr;
@@ -114,38 +198,43 @@ static int process_load_exec_path(process_t* ps, const char* path)
     return 0;
 }
 
-static int process_load_elf(process_t* ps, const char* path)
+static int process_read_elf_data(vnode_t* file, void* dest, uint64_t size, uint64_t offset)
 {
-    vnode_t file;
-    vattribs_t attr;
-    uint8_t* buffer;
-    char* interp_path;
-    uint64_t phdrs_offset, phdrs_total_size;
-    uint64_t paddr, tmp_vaddr;
-    Elf64_Ehdr* ehdr;
-    Elf64_Phdr* phdr;
+    uint64_t done;
+    int64_t bytes;
 
-    if 
-    (
-        vfs_lookup(path, &file) ||
-        vfs_get_attribs(&file, &attr) ||
-        attr.size == 0
-    )
-        return -1;    
+    /* Bounded chunks, the drive doesn't need a buffer as big as the segment */
+    for (done = 0; done < size; done += bytes)
+    {
+        bytes = vfs_read(file, &((uint8_t*) dest)[done], minu(size - done, PROC_ELF_CHUNK_SIZE), offset + done);
+        if (bytes <= 0)
+            return -1;
+    }
 
-    buffer = malloc(attr.size);
-    if (buffer == NULL)
-        return -1;
+    return 0;
+}
 
-    if (vfs_read(&file, buffer, attr.size))
-    {
-        free(buffer);
+static void process_close_elf(process_elf_t* elf)
+{
+    if (elf->phdrs != NULL)
+        free(elf->phdrs);
+    elf->phdrs = NULL;
+    vfs_put(&elf->file);
+}
+
+static int process_open_elf(const char* path, process_elf_t* elf)
+{
+    Elf64_Ehdr* ehdr;
+    uint64_t phdrs_size;
+
+    ehdr = &elf->ehdr;
+    elf->phdrs = NULL;
+    if (vfs_lookup(path, &elf->file))
         return -1;
-    }
 
-    ehdr = (Elf64_Ehdr*) buffer;
     if 
     (
+        process_read_elf_data(&elf->file, ehdr, sizeof(Elf64_Ehdr), 0) ||
         ehdr->e_ident[EI_MAG0] != ELFMAG0 ||
         ehdr->e_ident[EI_MAG1] != ELFMAG1 ||
         ehdr->e_ident[EI_MAG2] != ELFMAG2 ||
@@ -155,68 +244,103 @@ static int process_load_elf(process_t* ps, const char* path)
         ehdr->e_ident[EI_OSABI] != ELFOSABI_SYSV ||
         ehdr->e_ident[EI_VERSION] != EV_CURRENT ||
         ehdr->e_machine != EM_X86_64 ||
-        ehdr->e_type != ET_EXEC
+        ehdr->e_type != ET_EXEC ||
+        ehdr->e_phentsize < sizeof(Elf64_Phdr)
     )
     {
-        free(buffer);
+        process_close_elf(elf);
         return -1;
     }
 
-    phdrs_offset = (((uint64_t) ehdr) + ehdr->e_phoff);
-    phdrs_total_size = ehdr->e_phentsize * ehdr->e_phnum;
-    interp_path = NULL;
-
-    for 
+    /* Only the program headers are kept around, segments are read straight into place */
+    phdrs_size = ehdr->e_phentsize * ehdr->e_phnum;
+    elf->phdrs = malloc(phdrs_size);
+    if 
     (
-        phdr = (Elf64_Phdr*) phdrs_offset;
-        phdr < (Elf64_Phdr*) (((uint64_t) phdrs_offset) + phdrs_total_size);
-        phdr = (Elf64_Phdr*) (((uint64_t) phdr) + ehdr->e_phentsize)
+        elf->phdrs == NULL ||
+        process_read_elf_data(&elf->file, elf->phdrs, phdrs_size, ehdr->e_phoff)
     )
     {
+        process_close_elf(elf);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int process_load_elf(process_t* ps, thread_t* th, const char* path);
+
+static int process_load_elf_image(process_t* ps, thread_t* th, process_elf_t* elf)
+{
+    char* interp_path;
+    uint64_t paddr, tmp_vaddr;
+    uint16_t i;
+    uint8_t loaded;
+    int err;
+    Elf64_Phdr* phdr;
+
+    loaded = 0;
+
+    for (i = 0; i < elf->ehdr.e_phnum; i++)
+    {
+        phdr = (Elf64_Phdr*) (((uint64_t) elf->phdrs) + i * elf->ehdr.e_phentsize);
         if (phdr->p_vaddr + phdr->p_memsz > ps->brk_vaddr)
             ps->brk_vaddr = phdr->p_vaddr + phdr->p_memsz;
 
         switch (phdr->p_type)
         {
         case PT_INTERP:
-            if 
-            (
-                interp_path != NULL ||
-                ps->mem.head != NULL
-            )
+            if (loaded)
                 return -1;
-            interp_path = malloc(phdr->p_memsz);
-            strcpy(interp_path, (char*) (buffer + phdr->p_offset));
-            free(buffer);
-            process_load_elf(ps, interp_path);
+            interp_path = malloc(phdr->p_filesz + 1);
+            if (interp_path == NULL)
+                return -1;
+            err = process_read_elf_data(&elf->file, interp_path, phdr->p_filesz, phdr->p_offset);
+            interp_path[phdr->p_filesz] = '\0';
+            if (!err)
+                err = process_load_elf(ps, th, interp_path);
             free(interp_path);
-            return 0;
+            return err;
             
         case PT_LOAD:
             if (process_request_memory(ps, phdr->p_memsz, phdr->p_vaddr, PAGE_ACCESS_RW, PL3, NULL, &paddr))
-            {
-                free(buffer);
                 return -1;
-            }
+            if (phdr->p_filesz == 0)
+                break;
             if 
             (
                 kernel_get_next_vaddr(phdr->p_filesz, &tmp_vaddr) < phdr->p_filesz ||
                 paging_map_memory(paddr, tmp_vaddr, phdr->p_filesz, PAGE_ACCESS_RW, PL0) < phdr->p_filesz
             )
                 return -1;
-            memcpy((void*) tmp_vaddr, buffer + phdr->p_offset, phdr->p_filesz);
+            err = process_read_elf_data(&elf->file, (void*) tmp_vaddr, phdr->p_filesz, phdr->p_offset);
             paging_unmap_memory(tmp_vaddr, phdr->p_filesz);
+            if (err)
+                return -1;
+            loaded = 1;
             break;
         }
     }
 
-    ps->cpu.stack.rip = ehdr->e_entry;
-    free(buffer);
+    th->cpu.stack.rip = elf->ehdr.e_entry;
     
     return 0;
 }
 
-static int process_build_user_stack(process_t* ps, const char** argv, const char** envp)
+static int process_load_elf(process_t* ps, thread_t* th, const char* path)
+{
+    process_elf_t elf;
+    int err;
+
+    if (process_open_elf(path, &elf))
+        return -1;
+    err = process_load_elf_image(ps, th, &elf);
+    process_close_elf(&elf);
+
+    return err;
+}
+
+static int process_build_user_stack(process_t* ps, thread_t* th, const char** argv, const char** envp)
 {
     int argc, envc, i;
     uint64_t total_args_size, cpysize;
@@ -238,7 +362,7 @@ static int process_build_user_stack(process_t* ps, const char** argv, const char
         return -1;
     ps->envp = &ps->argv[argc + 1];
     
-    args_pages = ceil((double) total_args_size / SIZE_4KB);
+    args_pages = ceildivu(total_args_size, SIZE_4KB);
     args_paddr = pfa_request_pages(args_pages);
     if 
     (
@@ -251,14 +375,15 @@ static int process_build_user_stack(process_t* ps, const char** argv, const char
     }
     args_vaddr = alignd(PROC_CEIL_VADDR - total_args_size, SIZE_4KB);
 
-    ps->user_stack.size = PROC_MIN_STACK_SIZE;
-    ps->user_stack.floor = args_vaddr;
-    ps->user_stack.ceil = ps->user_stack.floor - ps->user_stack.size;
+    ps->stacks_floor = args_vaddr;
+    th->user_stack.size = PROC_MIN_STACK_SIZE;
+    th->user_stack.floor = args_vaddr;
+    th->user_stack.ceil = th->user_stack.floor - th->user_stack.size;
 
     if 
     (
-        process_request_memory(ps, ps->user_stack.size, ps->user_stack.ceil, PAGE_ACCESS_RW, PL3, &ps->user_stack.ceil, &stack_paddr) ||
-        paging_get_next_vaddr(args_vaddr, total_args_size, &args_vaddr) < total_args_size ||
+        process_request_memory(ps, th->user_stack.size, th->user_stack.ceil, PAGE_ACCESS_RW, PL3, &th->user_stack.ceil, &stack_paddr) ||
+        pml4_get_next_vaddr(ps->pml4, args_vaddr, total_args_size, &args_vaddr) < total_args_size ||
         pml4_map_memory(ps->pml4, args_paddr, args_vaddr, total_args_size, PAGE_ACCESS_RO, PL3) < total_args_size
     )
     {
@@ -266,20 +391,28 @@ static int process_build_user_stack(process_t* ps, const char** argv, const char
         pfa_free_pages(args_paddr, args_pages);
         return -1;
     }
-    
+
+    /* Tracked like any other segment so that fork copies it and exec releases it */
+    if (process_track_memory(ps, args_paddr, args_vaddr, args_pages, PAGE_ACCESS_RO, PL3))
+    {
+        pml4_unmap_memory(ps->pml4, args_vaddr, total_args_size);
+        paging_unmap_memory(args_kvaddr, total_args_size);
+        pfa_free_pages(args_paddr, args_pages);
+        return -1;
+    }
+
     if
     (
-        kernel_get_next_vaddr(ps->user_stack.size, &stack_kvaddr) < ps->user_stack.size ||
-        paging_map_memory(stack_paddr, stack_kvaddr, ps->user_stack.size, PAGE_ACCESS_RW, PL0) < ps->user_stack.size
+        kernel_get_next_vaddr(th->user_stack.size, &stack_kvaddr) < th->user_stack.size ||
+        paging_map_memory(stack_paddr, stack_kvaddr, th->user_stack.size, PAGE_ACCESS_RW, PL0) < th->user_stack.size
     )
     {
         paging_unmap_memory(args_kvaddr, total_args_size);
-        pfa_free_pages(args_paddr, args_pages);
         return -1;
     }
 
     cpyptr = (char*) args_kvaddr;
-    stack_ptr = (const char**) (stack_kvaddr + ps->user_stack.size - sizeof(uint64_t));
+    stack_ptr = (const char**) (stack_kvaddr + th->user_stack.size - sizeof(uint64_t));
 
     stack_ptr = &stack_ptr[-(envc + argc + 1)];
     for (i = 0; argv != NULL && i < argc; i++)
@@ -304,11 +437,11 @@ static int process_build_user_stack(process_t* ps, const char** argv, const char
     paging_unmap_memory(stack_kvaddr, PROC_MIN_STACK_SIZE);
     paging_unmap_memory(args_kvaddr, total_args_size);
 
-    ps->cpu.regs.rbp = ps->user_stack.floor - sizeof(uint64_t);
-    ps->cpu.regs.rdi = argc;
-    ps->cpu.regs.rdx = (uint64_t) &((const char**) ps->cpu.regs.rbp)[-envc];
-    ps->cpu.regs.rsi = (uint64_t) &((const char**) ps->cpu.regs.rdx)[-(argc + 1)];
-    ps->cpu.stack.rsp = ps->cpu.regs.rsi - sizeof(uint64_t);
+    th->cpu.regs.rbp = th->user_stack.floor - sizeof(uint64_t);
+    th->cpu.regs.rdi = argc;
+    th->cpu.regs.rdx = (uint64_t) &((const char**) th->cpu.regs.rbp)[-envc];
+    th->cpu.regs.rsi = (uint64_t) &((const char**) th->cpu.regs.rdx)[-(argc + 1)];
+    th->cpu.stack.rsp = th->cpu.regs.rsi - sizeof(uint64_t);
 
     return 0;
 }
@@ -316,36 +449,261 @@ static int process_build_user_stack(process_t* ps, const char** argv, const char
 int process_grow_stack(process_t* ps, stack_t* stack, uint64_t size)
 {
     uint64_t hint, vaddr;
+    privilege_level_t privilege;
+    int err;
 
+    /* size is what the stack has to span from its floor */
     size = alignu(size, SIZE_4KB);
+    if (size <= stack->size)
+        return 0;
+    size -= stack->size;
     hint = stack->ceil - size;
-    if 
+    privilege = (stack->floor <= PROC_CEIL_VADDR) ? PL3 : PL0;
+
+    /* Threads sharing the address space may fault at the same time */
+    spinlock_acquire(&ps->lock);
+    err = 
     (
-        process_request_memory(ps, size, hint, PAGE_ACCESS_RW, PL3, &vaddr, NULL) ||
+        process_request_memory(ps, size, hint, PAGE_ACCESS_RW, privilege, &vaddr, NULL) ||
         vaddr != hint
-    )
+    );
+    if (!err)
+    {
+        stack->ceil -= size;
+        stack->size += size;
+    }
+    spinlock_release(&ps->lock);
+
+    if (err)
     {
         trace_process("Could not allocate memory for stack expansion (pid: %u)", ps->pid);
         return -1;
     }
 
-    stack->ceil += size;
-    stack->size += size;
+    return 0;
+}
+
+int process_check_user_memory(thread_t* th, uint64_t vaddr, uint64_t size, page_access_type_t access)
+{
+    process_t* ps;
+    memory_segments_list_entry_t* entry;
+    uint64_t end;
+    int err;
+
+    ps = th->process;
+    end = vaddr + size;
+    if (end < vaddr || end > PROC_CEIL_VADDR)
+        return -1;
+
+    /* Not mapped yet maybe, but touching it only grows the stack */
+    if (vaddr > th->user_stack.floor - PROC_MAX_STACK_SIZE && end <= th->user_stack.floor)
+        return 0;
+
+    err = 0;
+    spinlock_acquire(&ps->lock);
+    while (!err && vaddr < end)
+    {
+        for (entry = ps->mem.head; entry != NULL; entry = entry->next)
+        {
+            if
+            (
+                entry->pl == PL3 &&
+                vaddr >= entry->vaddr &&
+                vaddr < entry->vaddr + entry->pages * SIZE_4KB
+            )
+                break;
+        }
+
+        if
+        (
+            entry == NULL ||
+            (access == PAGE_ACCESS_RW && entry->access != PAGE_ACCESS_RW)
+        )
+            err = -1;
+        else
+            vaddr = entry->vaddr + entry->pages * SIZE_4KB;
+    }
+    spinlock_release(&ps->lock);
+
+    return err;
+}
+
+int64_t process_copy_user_string(thread_t* th, const char* src, char* dst, uint64_t size)
+{
+    uint64_t length, end;
+
+    /* Checked a page at a time, the string may end well before the bound */
+    for (length = 0; length < size;)
+    {
+        end = length + minu(SIZE_4KB - (((uint64_t) src + length) & (SIZE_4KB - 1)), size - length);
+        if (process_check_user_memory(th, (uint64_t) src + length, end - length, PAGE_ACCESS_RO))
+            return -1;
+        for (; length < end; length++)
+        {
+            dst[length] = src[length];
+            if (dst[length] == '\0')
+                return (int64_t) length;
+        }
+    }
+
+    return -1;
+}
 
+const char** process_copy_user_strings(thread_t* th, const char** strings)
+{
+    uint64_t count, size, i;
+    uint64_t* offsets;
+    const char* string;
+    const char** copy;
+    char* chars;
+    int64_t length;
+
+    copy = NULL;
+    offsets = malloc(PROC_MAX_ARGS * sizeof(uint64_t));
+    chars = malloc(PROC_MAX_ARGS_SIZE);
+    if (offsets == NULL || chars == NULL)
+        goto END;
+
+    /* Measured while copied, another thread can't make a string longer than what was reserved for it */
+    for (count = 0, size = 0; ; count++)
+    {
+        if
+        (
+            count == PROC_MAX_ARGS ||
+            process_check_user_memory(th, (uint64_t) &strings[count], sizeof(const char*), PAGE_ACCESS_RO)
+        )
+            goto END;
+        string = strings[count];
+        if (string == NULL)
+            break;
+        length = process_copy_user_string(th, string, &chars[size], PROC_MAX_ARGS_SIZE - size);
+        if (length < 0)
+            goto END;
+        offsets[count] = size;
+        size += length + 1;
+    }
+
+    /* Pointers and characters share one allocation */
+    copy = malloc((count + 1) * sizeof(const char*) + size);
+    if (copy == NULL)
+        goto END;
+    memcpy(&copy[count + 1], chars, size);
+    for (i = 0; i < count; i++)
+        copy[i] = ((const char*) &copy[count + 1]) + offsets[i];
+    copy[count] = NULL;
+
+END:
+    if (offsets != NULL)
+        free(offsets);
+    if (chars != NULL)
+        free(chars);
+    return copy;
+}
+
+static int process_build_kernel_stack(process_t* ps, thread_t* th)
+{
+    th->kernel_stack.floor = KERNEL_HEAP_START_ADDR - th->stack_slot * PROC_STACK_SLOT_SIZE;
+    th->kernel_stack.size = PROC_MIN_STACK_SIZE;
+    th->kernel_stack.ceil = th->kernel_stack.floor - th->kernel_stack.size;
+    return process_request_memory(ps, th->kernel_stack.size, th->kernel_stack.ceil, PAGE_ACCESS_RW, PL0, &th->kernel_stack.ceil, NULL);
+}
+
+static int process_build_thread_stack(process_t* ps, thread_t* th)
+{
+    th->user_stack.floor = ps->stacks_floor - th->stack_slot * PROC_STACK_SLOT_SIZE;
+    th->user_stack.size = PROC_MIN_STACK_SIZE;
+    th->user_stack.ceil = th->user_stack.floor - th->user_stack.size;
+    if (process_request_memory(ps, th->user_stack.size, th->user_stack.ceil, PAGE_ACCESS_RW, PL3, &th->user_stack.ceil, NULL))
+        return -1;
+
+    /* Entered as if called, with a null return address on top */
+    th->cpu.stack.rsp = th->user_stack.floor - 2 * sizeof(uint64_t);
     return 0;
 }
 
-static int process_build_kernel_stack(process_t* ps)
+static void process_reset_cpu_state(thread_t* th)
+{
+    memset(&th->cpu, 0, sizeof(cpu_state_t));
+    th->cpu.stack.cs = gdt_get_user_cs() | PL3;
+    th->cpu.stack.ss = gdt_get_user_ds() | PL3;
+    th->cpu.stack.rflags = PROC_DEFAULT_RFLAGS;
+}
+
+static thread_t* process_add_thread(process_t* ps, uint64_t tid)
+{
+    thread_t* th;
+
+    th = calloc(1, sizeof(thread_t));
+    if (th == NULL)
+        return NULL;
+
+    th->tid = tid;
+    th->process = ps;
+    process_reset_cpu_state(th);
+
+    spinlock_acquire(&ps->lock);
+    th->stack_slot = ps->next_stack_slot++;
+    th->next = ps->threads;
+    ps->threads = th;
+    ++ps->live_threads;
+    spinlock_release(&ps->lock);
+
+    return th;
+}
+
+void process_delete_thread(process_t* ps, thread_t* th)
+{
+    thread_t** link;
+
+    spinlock_acquire(&ps->lock);
+    for (link = &ps->threads; *link != NULL && *link != th; link = &(*link)->next);
+    if (*link != NULL)
+        *link = th->next;
+    if (!th->exited)
+        --ps->live_threads;
+    process_release_memory(ps, th->user_stack.floor - PROC_STACK_SLOT_SIZE, th->user_stack.floor, PL3);
+    process_release_memory(ps, th->kernel_stack.floor - PROC_STACK_SLOT_SIZE, th->kernel_stack.floor, PL0);
+    spinlock_release(&ps->lock);
+
+    fpu_release(th);
+    free(th);
+}
+
+thread_t* process_create_thread(process_t* ps, uint64_t entry, uint64_t arg, uint64_t tls, uint64_t tid)
 {
-    ps->kernel_stack.floor = KERNEL_HEAP_START_ADDR;
-    ps->kernel_stack.size = PROC_MIN_STACK_SIZE;
-    ps->kernel_stack.ceil = ps->kernel_stack.floor - ps->kernel_stack.size;
-    return process_request_memory(ps, ps->kernel_stack.size, ps->kernel_stack.ceil, PAGE_ACCESS_RW, PL0, &ps->kernel_stack.ceil, NULL);
+    thread_t* th;
+
+    th = process_add_thread(ps, tid);
+    if (th == NULL)
+    {
+        trace_process("Could not create thread descriptor (pid: %u)", ps->pid);
+        return NULL;
+    }
+
+    if 
+    (
+        process_build_kernel_stack(ps, th) ||
+        process_build_thread_stack(ps, th)
+    )
+    {
+        trace_process("Failed to build thread stacks (pid: %u, tid: %u)", ps->pid, tid);
+        process_delete_thread(ps, th);
+        return NULL;
+    }
+
+    th->cpu.stack.rip = entry;
+    th->cpu.regs.rdi = arg;
+    th->fs_base = tls;
+
+    return th;
 }
 
 process_t* process_create(const char* path, const char** argv, const char** envp, uint64_t pid)
 {
-    process_t* ps = calloc(1, sizeof(process_t));
+    thread_t* th;
+    process_t* ps;
+
+    ps = calloc(1, sizeof(process_t));
     if (ps == NULL)
     {
         trace_process("Could not create process descriptor");
@@ -353,9 +711,16 @@ process_t* process_create(const char* path, const char** argv, const char** envp
     }
 
     ps->pid = pid;
-    ps->cpu.stack.cs = gdt_get_user_cs() | PL3;
-    ps->cpu.stack.ss = gdt_get_user_ds() | PL3;
-    ps->cpu.stack.rflags = PROC_DEFAULT_RFLAGS;
+    spinlock_init(&ps->lock);
+
+    /* The main thread shares its ID with the process */
+    th = process_add_thread(ps, pid);
+    if (th == NULL)
+    {
+        trace_process("Could not create main thread (pid: %u)", pid);
+        process_delete_and_free(ps);
+        return NULL;
+    }
     
     if (process_create_pml4(ps))
     {
@@ -364,7 +729,7 @@ process_t* process_create(const char* path, const char** argv, const char** envp
         return NULL;
     }
 
-    if (process_load_elf(ps, path))
+    if (process_load_elf(ps, th, path))
     {
         trace_process("Failed to load process executable (pid: %u)", pid);
         process_delete_and_free(ps);
@@ -372,14 +737,14 @@ process_t* process_create(const char* path, const char** argv, const char** envp
     }
     ps->brk_vaddr = alignu(ps->brk_vaddr, SIZE_1MB);
 
-    if (process_build_user_stack(ps, argv, envp))
+    if (process_build_user_stack(ps, th, argv, envp))
     {
         trace_process("Failed to build user stack (pid: %u)", pid);
         process_delete_and_free(ps);
         return NULL;
     }
 
-    if (process_build_kernel_stack(ps))
+    if (process_build_kernel_stack(ps, th))
     {
         trace_process("Failed to build kernel stack (pid: %u)", pid);
         process_delete_and_free(ps);
@@ -396,26 +761,175 @@ process_t* process_create(const char* path, const char** argv, const char** envp
     return ps;
 }
 
-static void process_copy_file_descriptors(process_t* dest, process_t* src)
+static int process_grow_fds(process_t* ps, uint64_t capacity)
+{
+    uint64_t new_capacity;
+    file_t** fds;
+
+    if (capacity <= ps->fds_capacity)
+        return 0;
+    if (capacity > PROC_MAX_FDS)
+        return -1;
+
+    for (new_capacity = maxu(ps->fds_capacity, PROC_MIN_FDS); new_capacity < capacity; new_capacity *= 2);
+    new_capacity = minu(new_capacity, PROC_MAX_FDS);
+
+    fds = realloc(ps->fds, new_capacity * sizeof(file_t*));
+    if (fds == NULL)
+        return -1;
+    memset(&fds[ps->fds_capacity], 0, (new_capacity - ps->fds_capacity) * sizeof(file_t*));
+    ps->fds = fds;
+    ps->fds_capacity = new_capacity;
+
+    return 0;
+}
+
+int64_t process_install_file(process_t* ps, file_t* file)
+{
+    int64_t fd;
+
+    spinlock_acquire(&ps->lock);
+    for (fd = 0; (uint64_t) fd < ps->fds_capacity && ps->fds[fd] != NULL; fd++);
+    if (process_grow_fds(ps, fd + 1))
+        fd = -1;
+    else
+        ps->fds[fd] = file;
+    spinlock_release(&ps->lock);
+
+    return fd;
+}
+
+file_t* process_get_file(process_t* ps, int64_t fd)
 {
-    int i;
-    for (i = 0; i < PROC_MAX_FDS; i++)
-        dest->fds[i] = src->fds[i];
+    file_t* file;
+
+    file = NULL;
+    spinlock_acquire(&ps->lock);
+    if (fd >= 0 && (uint64_t) fd < ps->fds_capacity && ps->fds[fd] != NULL)
+        file = file_ref(ps->fds[fd]);
+    spinlock_release(&ps->lock);
+
+    return file;
+}
+
+int process_close_fd(process_t* ps, int64_t fd)
+{
+    file_t* file;
+
+    file = NULL;
+    spinlock_acquire(&ps->lock);
+    if (fd >= 0 && (uint64_t) fd < ps->fds_capacity)
+    {
+        file = ps->fds[fd];
+        ps->fds[fd] = NULL;
+    }
+    spinlock_release(&ps->lock);
+
+    if (file == NULL)
+        return -1;
+    file_unref(file);
+
+    return 0;
 }
 
-process_t* process_create_replacement(process_t* parent, const char* path, const char** argv, const char** envp)
+int64_t process_dup_fd(process_t* ps, int64_t fd, int64_t new_fd)
+{
+    file_t* old;
+
+    old = NULL;
+    spinlock_acquire(&ps->lock);
+    if
+    (
+        fd < 0 ||
+        new_fd < 0 ||
+        (uint64_t) fd >= ps->fds_capacity ||
+        ps->fds[fd] == NULL ||
+        process_grow_fds(ps, new_fd + 1)
+    )
+        new_fd = -1;
+    else if (fd != new_fd)
+    {
+        old = ps->fds[new_fd];
+        ps->fds[new_fd] = file_ref(ps->fds[fd]);
+    }
+    spinlock_release(&ps->lock);
+
+    if (old != NULL)
+        file_unref(old);
+
+    return new_fd;
+}
+
+static int process_copy_file_descriptors(process_t* dest, process_t* src)
+{
+    uint64_t used, fd;
+    int err;
+
+    spinlock_acquire(&src->lock);
+    /* Only as big as it needs to be to hold the highest open fd */
+    for (used = src->fds_capacity; used > 0 && src->fds[used - 1] == NULL; used--);
+    err = process_grow_fds(dest, used);
+    for (fd = 0; !err && fd < used; fd++)
+    {
+        if (src->fds[fd] != NULL)
+            dest->fds[fd] = file_ref(src->fds[fd]);
+    }
+    spinlock_release(&src->lock);
+
+    return err;
+}
+
+static int process_apply_fd_actions(process_t* ps, const process_fd_action_t* actions, uint64_t num_actions)
+{
+    uint64_t i;
+    const process_fd_action_t* action;
+
+    for (i = 0; i < num_actions; i++)
+    {
+        action = &actions[i];
+        switch (action->type)
+        {
+        case PROC_FD_ACTION_CLOSE:
+            if (process_close_fd(ps, action->fd))
+                return -1;
+            break;
+        case PROC_FD_ACTION_DUP2:
+            if (process_dup_fd(ps, action->fd, action->new_fd) < 0)
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+process_t* process_spawn(process_t* parent, const char* path, const char** argv, const char** envp, const process_fd_action_t* actions, uint64_t num_actions, uint64_t pid)
 {
     process_t* child;
 
-    child = process_create(path, argv, envp, parent->pid);
+    /* Built straight from the executable, nothing of the parent's memory is copied */
+    child = process_create(path, argv, envp, pid);
     if (child == NULL)
     {
-        trace_process("Could not create replacement from process with id %u", parent->pid);
+        trace_process("Could not spawn process from %s (pid: %u)", path, pid);
         return NULL;
     }
 
-    child->parent_pid = parent->parent_pid;
-    process_copy_file_descriptors(child, parent);
+    child->parent_pid = parent->pid;
+    if (process_copy_file_descriptors(child, parent))
+    {
+        trace_process("Failed to copy parent's file descriptors (pid: %u)", pid);
+        process_delete_and_free(child);
+        return NULL;
+    }
+    if (process_apply_fd_actions(child, actions, num_actions))
+    {
+        trace_process("Invalid file descriptor action (pid: %u)", pid);
+        process_delete_and_free(child);
+        return NULL;
+    }
 
     return child;
 }
@@ -445,9 +959,10 @@ static int process_copy_memory_mappings(process_t* child, process_t* parent)
     return 0;
 }
 
-process_t* process_clone(process_t* parent, uint64_t pid)
+process_t* process_clone(process_t* parent, thread_t* th, uint64_t pid)
 {
     process_t* child;
+    thread_t* child_th;
     uint64_t argc, envc, args_size;
 
     child = calloc(1, sizeof(process_t));
@@ -459,24 +974,41 @@ process_t* process_clone(process_t* parent, uint64_t pid)
 
     child->pid = pid;
     child->parent_pid = parent->pid;
-    child->cpu = parent->cpu;
     child->brk_vaddr = parent->brk_vaddr;
-    child->user_stack = parent->user_stack;
-    child->kernel_stack = parent->kernel_stack;
+    child->stacks_floor = parent->stacks_floor;
+    child->next_stack_slot = parent->next_stack_slot;
+    spinlock_init(&child->lock);
+
+    /* Only the calling thread carries over, as the child's main thread */
+    child_th = calloc(1, sizeof(thread_t));
+    if (child_th == NULL)
+    {
+        trace_process("Could not create main thread (pid: %u)", pid);
+        process_delete_and_free(child);
+        return NULL;
+    }
+    child_th->tid = pid;
+    child_th->process = child;
+    child_th->cpu = th->cpu;
+    child_th->fs_base = th->fs_base;
+    child_th->stack_slot = th->stack_slot;
+    child_th->user_stack = th->user_stack;
+    child_th->kernel_stack = th->kernel_stack;
+    child->threads = child_th;
+    child->live_threads = 1;
 
     for (envc = 0; parent->envp[envc] != NULL; envc++);
     argc = (((uint64_t) parent->envp) - ((uint64_t) parent->argv)) / sizeof(const char*);
     args_size = (argc + envc + 2) * sizeof(const char*);
     child->argv = calloc(1, args_size);
-    child->envp = &child->argv[argc + 1];
-    memcpy(child->argv, parent->argv, args_size);
-
     if (child->argv == NULL)
     {
         trace_process("Failed to copy argv and envp from parent process (pid: %u)", pid);
         process_delete_and_free(child);
         return NULL;
     }
+    child->envp = &child->argv[argc + 1];
+    memcpy(child->argv, parent->argv, args_size);
 
     if (process_create_pml4(child))
     {
@@ -485,14 +1017,126 @@ process_t* process_clone(process_t* parent, uint64_t pid)
         return NULL;
     }
     
+    spinlock_acquire(&parent->lock);
     if (process_copy_memory_mappings(child, parent))
     {
+        spinlock_release(&parent->lock);
         trace_process("Failed to copy parent's memory mappings (pid: %u)", pid);
         process_delete_and_free(child);
         return NULL;
     }
+    spinlock_release(&parent->lock);
 
-    process_copy_file_descriptors(child, parent);
+    if (fpu_copy_state(child_th, th))
+    {
+        trace_process("Failed to copy parent's FPU state (pid: %u)", pid);
+        process_delete_and_free(child);
+        return NULL;
+    }
+
+    if (process_copy_file_descriptors(child, parent))
+    {
+        trace_process("Failed to copy parent's file descriptors (pid: %u)", pid);
+        process_delete_and_free(child);
+        return NULL;
+    }
 
     return child;
 }
+
+int process_exec(process_t* ps, thread_t* th, const char* path, const char** argv, const char** envp)
+{
+    process_elf_t elf;
+    uint8_t opened;
+    char* exec_path;
+    const char** kargv;
+    const char** kenvp;
+    thread_t* other;
+    thread_t* next;
+    int err;
+
+    /* Every other thread must be gone, their stacks are about to be torn down */
+    for (other = ps->threads; other != NULL; other = other->next)
+    {
+        if (other != th && !other->exited)
+        {
+            trace_process("Cannot exec with other threads running (pid: %u)", ps->pid);
+            return -1;
+        }
+    }
+
+    /* The path and the arguments live in the image that's about to go away */
+    exec_path = malloc(PROC_MAX_PATH);
+    opened =
+    (
+        exec_path != NULL &&
+        process_copy_user_string(th, path, exec_path, PROC_MAX_PATH) >= 0 &&
+        !process_open_elf(exec_path, &elf)
+    );
+    kargv = (argv != NULL) ? process_copy_user_strings(th, argv) : NULL;
+    kenvp = (envp != NULL) ? process_copy_user_strings(th, envp) : NULL;
+    if
+    (
+        !opened ||
+        (argv != NULL && kargv == NULL) ||
+        (envp != NULL && kenvp == NULL)
+    )
+    {
+        trace_process("Could not load the new image (pid: %u)", ps->pid);
+        err = -1;
+        goto END;
+    }
+
+    /* Same descriptor, PID, fds and thread, only the user half is rebuilt */
+    for (other = ps->threads; other != NULL; other = next)
+    {
+        next = other->next;
+        if (other == th)
+            continue;
+        while (other->on_cpu)
+            __asm__ volatile ("pause");
+        process_delete_thread(ps, other);
+    }
+    process_release_user_memory(ps);
+    fpu_release(th);
+    if (ps->exec_path != NULL)
+        free((void*) ps->exec_path);
+    if (ps->argv != NULL)
+        free(ps->argv);
+    ps->exec_path = exec_path;
+    exec_path = NULL;
+    ps->argv = NULL;
+    ps->envp = NULL;
+    ps->brk_vaddr = 0;
+    th->frame = NULL;
+    th->fs_base = 0;
+    th->user_stack.size = 0;
+    process_reset_cpu_state(th);
+
+    err = PROC_EXEC_FATAL;
+    if (process_load_elf_image(ps, th, &elf))
+    {
+        trace_process("Failed to load process executable (pid: %u)", ps->pid);
+        goto END;
+    }
+    ps->brk_vaddr = alignu(ps->brk_vaddr, SIZE_1MB);
+
+    if (process_build_user_stack(ps, th, kargv, kenvp))
+    {
+        trace_process("Failed to build user stack (pid: %u)", ps->pid);
+        goto END;
+    }
+    err = 0;
+
+END:
+    if (opened)
+        process_close_elf(&elf);
+    if (exec_path != NULL)
+        free(exec_path);
+    if (kargv != NULL)
+        free(kargv);
+    if (kenvp != NULL)
+        free(kenvp);
+
+    return err;
+}
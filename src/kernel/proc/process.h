@@ -1,16 +1,29 @@
 #ifndef __PROCESS_H__
 #define __PROCESS_H__
 
-#include "vfs/vfs.h"
+#include "vfs/file.h"
 #include "../sys/mem/paging.h"
 #include "../sys/cpu/isr.h"
 #include "../utils/macros.h"
+#include "../utils/spinlock.h"
 
-#define PROC_MAX_FDS 64
+#define PROC_MAX_FDS 1024
+/* Size of the fd table the first time it grows */
+#define PROC_MIN_FDS 16
 #define PROC_DEFAULT_RFLAGS 0x202
 #define PROC_CEIL_VADDR 0x800000000000
 #define PROC_MIN_STACK_SIZE SIZE_nKB(8)
 #define PROC_MAX_STACK_SIZE SIZE_nMB(2)
+/* Room for one fully grown stack plus a guard page */
+#define PROC_STACK_SLOT_SIZE (PROC_MAX_STACK_SIZE + SIZE_4KB)
+#define PROC_EXIT_STATUS_FAULT -1
+/* process_exec failed after the old image was torn down */
+#define PROC_EXEC_FATAL -2
+/* Longest path taken from a process, terminator included */
+#define PROC_MAX_PATH SIZE_4KB
+/* Most arguments and environment variables, and characters between them, taken by spawn and execve */
+#define PROC_MAX_ARGS 1024
+#define PROC_MAX_ARGS_SIZE SIZE_nKB(128)
 
 typedef struct memory_segments_list_entry
 {
@@ -32,7 +45,6 @@ struct cpu_state
 {
     registers_state_t regs;
     stack_state_t stack;
-    fpu_state_t fpu;
 } __attribute__((packed));
 typedef struct cpu_state cpu_state_t;
 
@@ -43,9 +55,51 @@ typedef struct
     uint64_t size;
 } stack_t;
 
-typedef vnode_t file_descriptor_t;
+/**
+ * File descriptor changes applied to a spawned child, in order
+ */
+typedef enum
+{
+    PROC_FD_ACTION_CLOSE = 0,
+    PROC_FD_ACTION_DUP2 = 1
+} process_fd_action_type_t;
 
 typedef struct
+{
+    uint32_t type;
+    int32_t fd;
+    int32_t new_fd;
+} __attribute__((packed)) process_fd_action_t;
+
+typedef struct thread
+{
+    uint64_t tid;
+    struct process* process;
+    /* Next thread of the same process */
+    struct thread* next;
+    uint64_t sleep_deadline;
+    /* What the thread is blocked on, see scheduler_block_thread */
+    uint64_t wait_channel;
+    uint64_t cpu_id;
+    uint64_t last_ran;
+    uint64_t fs_base;
+    uint64_t exit_value;
+    /* Picks where its stacks go, see PROC_STACK_SLOT_SIZE */
+    uint64_t stack_slot;
+    void* fpu_state;
+    /* Where the thread was interrupted, on its own kernel stack */
+    interrupt_frame_t* frame;
+    volatile uint8_t on_cpu;
+    /* Done running, kept until it's joined or its process goes away */
+    uint8_t exited;
+    /* Freed as soon as it's switched out */
+    uint8_t detached;
+    stack_t user_stack;
+    stack_t kernel_stack;
+    cpu_state_t cpu;
+} thread_t;
+
+typedef struct process
 {
     uint64_t pid;
     uint64_t parent_pid;
@@ -55,18 +109,62 @@ typedef struct
     const char** argv;
     const char** envp;
     uint64_t brk_vaddr;
-    stack_t user_stack;
-    stack_t kernel_stack;
-    cpu_state_t cpu;
+    /* The main thread's user stack starts here, every other thread's goes below it */
+    uint64_t stacks_floor;
+    uint64_t next_stack_slot;
+    int exit_status;
+    /* Set by exit, every thread still alive is killed the next time it's scheduled */
+    volatile uint8_t exiting;
+    uint64_t live_threads;
+    thread_t* threads;
+    /* Guards the thread list, the memory segments and the fd table */
+    spinlock_t lock;
     memory_segments_list_t mem;
-    file_descriptor_t fds[PROC_MAX_FDS];
+    /* Indexed by fd, grows on demand up to PROC_MAX_FDS entries, closed ones are NULL */
+    file_t** fds;
+    uint64_t fds_capacity;
 } process_t;
 
-process_t* process_create_replacement(process_t* parent, const char* path, const char** argv, const char** envp);
+/**
+ * Replace the image of a process in place, keeping its descriptor, PID, fds and
+ * the calling thread. path, argv and envp are user pointers read through th.
+ * Returns -1 if the old image is untouched, PROC_EXEC_FATAL otherwise
+ */
+int process_exec(process_t* ps, thread_t* th, const char* path, const char** argv, const char** envp);
 process_t* process_create(const char* path, const char** argv, const char** envp, uint64_t pid);
-process_t* process_clone(process_t* parent, uint64_t pid);
+process_t* process_clone(process_t* parent, thread_t* th, uint64_t pid);
+process_t* process_spawn(process_t* parent, const char* path, const char** argv, const char** envp, const process_fd_action_t* actions, uint64_t num_actions, uint64_t pid);
+/**
+ * Add a thread to a process, it starts at entry with arg in RDI
+ * on a fresh user stack and with tls as its FS base
+ */
+thread_t* process_create_thread(process_t* ps, uint64_t entry, uint64_t arg, uint64_t tls, uint64_t tid);
+/* Give back a thread's stacks and descriptor, it must not be on any CPU */
+void process_delete_thread(process_t* ps, thread_t* th);
 void process_delete_resources(process_t* ps);
 void process_delete_and_free(process_t* ps);
 int process_grow_stack(process_t* ps, stack_t* stack, uint64_t size);
+/**
+ * Check that the kernel can touch the user range without faulting, with
+ * access PAGE_ACCESS_RW it must also be writable. Returns 0 if it can
+ */
+int process_check_user_memory(thread_t* th, uint64_t vaddr, uint64_t size, page_access_type_t access);
+/**
+ * Copy a user string into dst, reading each character once. Returns its length,
+ * or -1 if it isn't readable or doesn't fit in size bytes with its terminator
+ */
+int64_t process_copy_user_string(thread_t* th, const char* src, char* dst, uint64_t size);
+/**
+ * Copy a NULL terminated user array of strings into one kernel allocation (freed with free),
+ * every pointer and character is read once. Returns NULL if it isn't readable or is too big
+ */
+const char** process_copy_user_strings(thread_t* th, const char** strings);
+/* Give the file the lowest free fd, the reference passed in is kept on success */
+int64_t process_install_file(process_t* ps, file_t* file);
+/* The file behind fd with a new reference, or NULL */
+file_t* process_get_file(process_t* ps, int64_t fd);
+int process_close_fd(process_t* ps, int64_t fd);
+/* Make new_fd refer to the same open file as fd, closing whatever it referred to */
+int64_t process_dup_fd(process_t* ps, int64_t fd, int64_t new_fd);
 
 #endif
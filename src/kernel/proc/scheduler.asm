@@ -1,31 +1,27 @@
 [section .text]
 [bits 64]
 
-[extern alignu]
+[extern isr_exit]
 
+; scheduler_switch_pml4_and_stack -> Move to a thread's address space and kernel stack
+; args -> RDI the thread (returned as is)
+;         RSI the new stack pointer
+;         RDX the PML4 physical address
 [global scheduler_switch_pml4_and_stack]
 scheduler_switch_pml4_and_stack:
     pop rcx
     mov rsp, rsi
     mov rbp, rsp
-    mov rdx, [rdi+8*2]
     mov cr3, rdx
     push rcx
     mov rax, rdi
     ret
 
-[global scheduler_run_process]
+[global scheduler_run_thread]
 align 8
-scheduler_run_process:
+scheduler_run_thread:
     cli
 
-    push rdi
-    add rdi, 8*20
-    mov rsi, 16
-    call alignu
-    fxrstor [rax]
-    pop rdi
-
     mov rax, rdi
     
     mov rbx, [rax + 8*1]
@@ -49,14 +45,29 @@ scheduler_run_process:
     push qword [rax + 8*16]
     push qword [rax + 8*15]
 
+    ; FS is left alone, loading it would wipe the thread's FS base
     push rcx
     mov cx, [rax + 8*19]
     mov ds, cx
     mov es, cx
-    mov fs, cx
-    mov gs, cx
     pop rcx
 
     mov rax, [rax + 8*0]
 
+    ; Threads always run in user mode, hand them back their GS base
+    swapgs
     iretq
+
+; scheduler_resume_frame -> Switch to a process and return from its interrupt frame
+; args -> RDI the process' PML4 physical address
+;         RSI the interrupt frame on the process' kernel stack
+[global scheduler_resume_frame]
+scheduler_resume_frame:
+    cli
+    mov cr3, rdi
+    mov rsp, rsi
+    ; Load the user data segment from the saved SS
+    mov rax, [rsp + 8*21]
+    mov ds, ax
+    mov es, ax
+    jmp isr_exit
@@ -1,19 +1,44 @@
 #include "scheduler.h"
 #include "../utils/alloc.h"
 #include "../utils/log.h"
-#include "../sys/chips/pic.h"
+#include "../sys/cpu/isr.h"
 #include "../sys/chips/pit.h"
+#include "../sys/chips/lapic.h"
+#include "../sys/cpu/tsc.h"
 #include "../sys/cpu/tss.h"
 #include "../sys/cpu/interrupts.h"
+#include "../sys/cpu/percpu.h"
+#include "../sys/cpu/cpu.h"
+#include "../sys/cpu/fpu.h"
+#include "../sys/drivers/fs/drivefs.h"
+#include "../utils/spinlock.h"
 #include <stddef.h>
 #include <math.h>
 #include <mem.h>
 
-#define SCHEDULER_PIT_INTERVAL 2
-#define SCHEDULER_TIME_PER_PROC (5 * SCHEDULER_PIT_INTERVAL)
+#define SCHEDULER_TIME_SLICE_NS 10000000
+/* Threads that ran more recently than this are considered cache-hot */
+#define SCHEDULER_MIGRATION_COST_NS 500000
+/* Queue length at which even cache-hot threads get stolen */
+#define SCHEDULER_IMBALANCE_THRESHOLD 3
+/* Blocked threads are spread over 1 << SHIFT wait queues by channel */
+#define SCHEDULER_WAIT_QUEUES_SHIFT 6
+#define SCHEDULER_WAIT_QUEUES (1 << SCHEDULER_WAIT_QUEUES_SHIFT)
 
 #define trace_scheduler(msg, ...) trace("SCHD", msg, ##__VA_ARGS__)
 
+typedef struct thread_list_entry
+{
+    struct thread_list_entry* next;
+    thread_t* th;
+} thread_list_entry_t;
+
+typedef struct
+{
+    thread_list_entry_t* head;
+    thread_list_entry_t* tail;
+} thread_list_t;
+
 typedef struct process_list_entry
 {
     struct process_list_entry* next;
@@ -26,100 +51,164 @@ typedef struct
     process_list_entry_t* tail;
 } process_list_t;
 
+/* Each CPU runs the head of its own queue */
+typedef struct
+{
+    spinlock_t lock;
+    thread_list_t running;
+    uint64_t load;
+    uint64_t slice_deadline;
+    uint8_t idling;
+} scheduler_queue_t;
+
+/* Threads waiting on one of the channels hashed to it, see scheduler_block_thread */
+typedef struct
+{
+    spinlock_t lock;
+    thread_list_t threads;
+} scheduler_wait_queue_t;
+
+static scheduler_queue_t queues[PERCPU_MAX_CPUS];
+static scheduler_wait_queue_t wait_queues[SCHEDULER_WAIT_QUEUES];
+static thread_list_t sleeping;
+/* Processes with live threads, and exited ones nobody has waited for yet */
+static process_list_t processes;
 static process_list_t zombie;
-static process_list_t running;
-static uint64_t ms;
+static spinlock_t sleeping_lock;
+static spinlock_t processes_lock;
+static uint64_t next_pid;
 
-extern process_t* scheduler_switch_pml4_and_stack(process_t* ps, uint64_t rsp);
-extern void scheduler_run_process(cpu_state_t* cpu);
+extern thread_t* scheduler_switch_pml4_and_stack(thread_t* th, uint64_t rsp, uint64_t pml4_paddr);
+extern void scheduler_run_thread(cpu_state_t* cpu);
+extern void scheduler_resume_frame(uint64_t pml4_paddr, interrupt_frame_t* frame);
 
-static uint64_t scheduler_get_max_pid_in_process_list(process_list_t* pss)
+uint64_t scheduler_get_next_pid(void)
 {
-    uint64_t pid;
-    process_list_entry_t* entry;
-    for (entry = pss->head, pid = 0; entry != NULL; entry = entry->next)
-    {
-        if (pid < entry->ps->pid)
-            pid = entry->ps->pid;
-    }
-    return pid;
+    /* IDs are never reused, nothing has to be scanned to find a free one */
+    return __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
 }
 
-uint64_t scheduler_get_next_pid(void)
+thread_t* scheduler_get_current_thread(void)
 {
-    uint64_t pid_running, pid_zombie;
-    pid_running = scheduler_get_max_pid_in_process_list(&running);
-    pid_zombie = scheduler_get_max_pid_in_process_list(&zombie);
-    return (maxu(pid_running, pid_zombie) + 1);
+    return percpu_get()->current;
 }
 
 process_t* scheduler_get_current_process(void)
 {
-    return (running.head == NULL) ? NULL : running.head->ps;
+    thread_t* th;
+    th = percpu_get()->current;
+    return (th == NULL) ? NULL : th->process;
 }
 
-static void scheduler_update_registers(cpu_state_t* cpu, const registers_state_t* regs, const stack_state_t* stack)
+static scheduler_queue_t* scheduler_get_queue(void)
 {
-    cpu->regs.rax = regs->rax;
-    cpu->regs.rbx = regs->rbx;
-    cpu->regs.rcx = regs->rcx;
-    cpu->regs.rdx = regs->rdx;
-    cpu->regs.r8 = regs->r8;
-    cpu->regs.r9 = regs->r9;
-    cpu->regs.r10 = regs->r10;
-    cpu->regs.r11 = regs->r11;
-    cpu->regs.r12 = regs->r12;
-    cpu->regs.r13 = regs->r13;
-    cpu->regs.r14 = regs->r14;
-    cpu->regs.r15 = regs->r15;
-    cpu->regs.rbp = regs->rbp;
-    cpu->regs.rsi = regs->rsi;
-    cpu->regs.rdi = regs->rdi;
-    cpu->stack.rip = stack->rip;
-    cpu->stack.rflags = stack->rflags;
-    cpu->stack.cs = stack->cs;
+    return &queues[percpu_get()->id];
 }
 
 static void scheduler_handle_interrupt(const interrupt_frame_t* int_frame)
 {
-    process_t* ps;
-    uint64_t ps_fpu, frame_fpu;
+    thread_t* th;
     interrupts_disable();
-    ps = scheduler_get_current_process();
-    ps_fpu = alignu((uint64_t) ps->cpu.fpu, 16);
-    frame_fpu = alignu((uint64_t) int_frame->fpu_state, 16);
-    memcpy((void*) ps_fpu, (void*) frame_fpu, 512);
-    scheduler_update_registers(&ps->cpu, &int_frame->registers_state, &int_frame->stack_state);
-    pic_acknowledge(int_frame->interrupt_info.interrupt_number);
+    th = scheduler_get_current_thread();
+    /**
+     * The frame stays on the thread's kernel stack, it's resumed from there.
+     * The FPU state stays in the registers until someone else needs them (see fpu.c).
+     */
+    th->frame = (interrupt_frame_t*) int_frame;
+    isr_acknowledge(int_frame->interrupt_info.interrupt_number);
     scheduler_run();
 }
 
-static void scheduler_pit_handler(const interrupt_frame_t* int_frame)
+static int scheduler_queue_thread_in_list(thread_list_t* ths, thread_t* th)
 {
-    ms += SCHEDULER_PIT_INTERVAL;
-    if (ms >= SCHEDULER_TIME_PER_PROC)
+    thread_list_entry_t* entry;
+
+    entry = malloc(sizeof(thread_list_entry_t));
+    if (entry == NULL)
     {
-        ms = 0;
-        scheduler_handle_interrupt(int_frame);
+        trace_scheduler("Could not allocate space for thread list entry");
+        return -1;
     }
+
+    entry->th = th;
+    entry->next = NULL;
+
+    if (ths->tail == NULL)
+        ths->head = entry;
     else
-        pic_acknowledge((uint8_t) int_frame->interrupt_info.interrupt_number);
+        ths->tail->next = entry;
+    ths->tail = entry;
+
+    return 0;
 }
 
-void scheduler_init_pss(void)
+static int scheduler_queue_thread_in_list_by_deadline(thread_list_t* ths, thread_t* th)
 {
-    memset(&running, 0, sizeof(process_list_t));
-    memset(&zombie, 0, sizeof(process_list_t));
+    thread_list_entry_t* entry;
+    thread_list_entry_t* prev;
+    thread_list_entry_t* current;
+
+    entry = malloc(sizeof(thread_list_entry_t));
+    if (entry == NULL)
+    {
+        trace_scheduler("Could not allocate space for thread list entry");
+        return -1;
+    }
+
+    entry->th = th;
+    for
+    (
+        prev = NULL, current = ths->head;
+        current != NULL && current->th->sleep_deadline <= th->sleep_deadline;
+        prev = current, current = current->next
+    );
+
+    entry->next = current;
+    if (prev == NULL)
+        ths->head = entry;
+    else
+        prev->next = entry;
+    if (current == NULL)
+        ths->tail = entry;
+
+    return 0;
 }
 
-int scheduler_init(void)
+static int scheduler_remove_thread_from_list(thread_list_t* ths, thread_t* th)
 {
-    ms = 0;
-    pit_set_interval(SCHEDULER_PIT_INTERVAL);
-    return pit_register_callback(&scheduler_pit_handler);
+    thread_list_entry_t* current;
+    thread_list_entry_t* prev;
+
+    current = ths->head;
+    prev = NULL;
+
+    while (current != NULL)
+    {
+        if (current->th == th)
+        {
+            if (prev == NULL)
+                ths->head = current->next;
+            else
+                prev->next = current->next;
+
+            if (current == ths->tail)
+            {
+                ths->tail = prev;
+                if (prev != NULL)
+                    prev->next = NULL;
+            }
+
+            free(current);
+            return 0;
+        }
+        prev = current;
+        current = current->next;
+    }
+
+    return -1;
 }
 
-static int scheduler_queue_process_in_list(process_list_t* pss, process_t *ps)
+static int scheduler_queue_process_in_list(process_list_t* pss, process_t* ps)
 {
     process_list_entry_t* entry;
 
@@ -129,7 +218,7 @@ static int scheduler_queue_process_in_list(process_list_t* pss, process_t *ps)
         trace_scheduler("Could not allocate space for process list entry");
         return -1;
     }
-    
+
     entry->ps = ps;
     entry->next = NULL;
 
@@ -147,103 +236,881 @@ static int scheduler_remove_process_from_list(process_list_t* pss, process_t* ps
     process_list_entry_t* current;
     process_list_entry_t* prev;
 
-    current = pss->head;
-    prev = NULL;
-
-    while (current != NULL)
+    for (current = pss->head, prev = NULL; current != NULL; prev = current, current = current->next)
     {
-        if (current->ps != NULL && current->ps->pid == ps->pid)
-        {
-            if (prev == NULL)
-                pss->head = current->next;
-            else
-                prev->next = current->next;
+        if (current->ps != ps)
+            continue;
 
-            if (current == pss->tail)
-            {
-                pss->tail = prev;
-                if (prev != NULL)
-                    prev->next = NULL;
-            }
+        if (prev == NULL)
+            pss->head = current->next;
+        else
+            prev->next = current->next;
+        if (current == pss->tail)
+            pss->tail = prev;
 
-            free(current);
-            return 0;
-        }
-        prev = current;
-        current = current->next;
+        free(current);
+        return 0;
     }
 
     return -1;
 }
 
-int scheduler_replace_process(process_t* old, process_t* new)
+static void scheduler_set_timer(uint64_t ns)
+{
+    if (lapic_is_initialized())
+        lapic_set_oneshot(ns);
+    else
+        pit_set_oneshot(ns);
+}
+
+static void scheduler_stop_timer(void)
 {
-    if 
+    if (lapic_is_initialized())
+        lapic_stop();
+    else
+        pit_stop();
+}
+
+static void scheduler_arm_timer(void)
+{
+    uint64_t deadline, now, flush_deadline;
+    uint8_t has_deadline;
+    scheduler_queue_t* queue;
+
+    queue = scheduler_get_queue();
+    has_deadline = 0;
+    deadline = 0;
+
+    /* Only slice the CPU if there's someone to hand it to */
+    spinlock_acquire(&queue->lock);
+    if (!queue->idling && queue->load > 1)
+    {
+        deadline = queue->slice_deadline;
+        has_deadline = 1;
+    }
+    spinlock_release(&queue->lock);
+
+    /* Every CPU keeps an eye on the earliest sleeper, the first one to see it due wakes it up */
+    spinlock_acquire(&sleeping_lock);
+    if
     (
-        scheduler_remove_process_from_list(&running, old) ||
-        scheduler_queue_process_in_list(&running, new)
+        sleeping.head != NULL &&
+        (!has_deadline || sleeping.head->th->sleep_deadline < deadline)
     )
     {
-        trace_scheduler("Failed to replace process");
+        deadline = sleeping.head->th->sleep_deadline;
+        has_deadline = 1;
+    }
+    spinlock_release(&sleeping_lock);
+
+    /* Dirty blocks reach the drive on time even if nothing touches it again */
+    flush_deadline = drivefs_get_flush_deadline();
+    if (flush_deadline != 0 && (!has_deadline || flush_deadline < deadline))
+    {
+        deadline = flush_deadline;
+        has_deadline = 1;
+    }
+
+    if (!has_deadline)
+        scheduler_stop_timer();
+    else
+    {
+        now = tsc_get_ns();
+        scheduler_set_timer((deadline > now) ? (deadline - now) : 0);
+    }
+}
+
+void scheduler_update_timer(void)
+{
+    scheduler_arm_timer();
+}
+
+static void scheduler_kick_idle_cpu(void)
+{
+    uint64_t i;
+
+    /* Wake up one idle CPU, it'll steal the extra work for itself */
+    for (i = 0; i < percpu_get_count(); i++)
+    {
+        if
+        (
+            i != percpu_get()->id &&
+            percpu_get_by_id(i)->online &&
+            queues[i].idling &&
+            queues[i].load == 0
+        )
+        {
+            lapic_send_ipi(percpu_get_by_id(i)->lapic_id, LAPIC_IPI_VECTOR);
+            return;
+        }
+    }
+}
+
+static int scheduler_enqueue_thread(thread_t* th)
+{
+    scheduler_queue_t* queue;
+    uint8_t was_alone, was_idling;
+
+    /* Go back to the CPU the thread last ran on, its cache might still be warm */
+    queue = &queues[th->cpu_id];
+
+    spinlock_acquire(&queue->lock);
+    if (scheduler_queue_thread_in_list(&queue->running, th))
+    {
+        spinlock_release(&queue->lock);
         return -1;
     }
+    was_alone = (queue->load == 1);
+    was_idling = queue->idling;
+    ++queue->load;
+    spinlock_release(&queue->lock);
+
+    if (th->cpu_id != percpu_get()->id)
+    {
+        /* Kick the other CPU out of HLT or make it slice its running thread */
+        if (was_alone || was_idling)
+            lapic_send_ipi(percpu_get_by_id(th->cpu_id)->lapic_id, LAPIC_IPI_VECTOR);
+    }
+    else if (was_alone)
+    {
+        /* The running thread might not have a time slice armed */
+        scheduler_arm_timer();
+    }
+
+    if (!was_idling && queue->load > 1)
+        scheduler_kick_idle_cpu();
+
     return 0;
 }
 
+static void scheduler_wake_sleeping_threads(uint64_t now)
+{
+    thread_list_entry_t* entry;
+    thread_t* th;
+
+    while (1)
+    {
+        spinlock_acquire(&sleeping_lock);
+        entry = sleeping.head;
+        if (entry == NULL || entry->th->sleep_deadline > now)
+        {
+            spinlock_release(&sleeping_lock);
+            break;
+        }
+        sleeping.head = entry->next;
+        if (sleeping.head == NULL)
+            sleeping.tail = NULL;
+        spinlock_release(&sleeping_lock);
+
+        th = entry->th;
+        free(entry);
+        if (scheduler_enqueue_thread(th))
+            trace_scheduler("Failed to wake up thread (tid: %u)", th->tid);
+    }
+}
+
+static void scheduler_timer_handler(const interrupt_frame_t* int_frame)
+{
+    uint64_t now;
+    scheduler_queue_t* queue;
+    uint8_t expired;
+
+    queue = scheduler_get_queue();
+    now = tsc_get_ns();
+    scheduler_wake_sleeping_threads(now);
+    drivefs_flush_expired();
+
+    /* The idle loop picks up woken threads by itself */
+    if (queue->idling)
+        return;
+
+    spinlock_acquire(&queue->lock);
+    expired = (now >= queue->slice_deadline && queue->load > 1);
+    spinlock_release(&queue->lock);
+    if (expired)
+        scheduler_handle_interrupt(int_frame);
+
+    scheduler_arm_timer();
+}
+
+static void scheduler_ipi_handler(const interrupt_frame_t* int_frame)
+{
+    thread_t* th;
+
+    /* Another thread of the process called exit, the scheduler finishes this one off */
+    th = scheduler_get_current_thread();
+    if (th != NULL && th->process->exiting)
+        scheduler_handle_interrupt(int_frame);
+
+    /* Someone was queued here, the idle loop or the time slice takes it from there */
+    if (!scheduler_get_queue()->idling)
+        scheduler_arm_timer();
+}
+
+void scheduler_init_pss(void)
+{
+    memset(queues, 0, sizeof(queues));
+    memset(&sleeping, 0, sizeof(thread_list_t));
+    memset(wait_queues, 0, sizeof(wait_queues));
+    memset(&processes, 0, sizeof(process_list_t));
+    memset(&zombie, 0, sizeof(process_list_t));
+    spinlock_init(&sleeping_lock);
+    spinlock_init(&processes_lock);
+    next_pid = 1;
+}
+
+int scheduler_init(void)
+{
+    isr_register_handler(LAPIC_IPI_VECTOR, &scheduler_ipi_handler);
+    if (lapic_is_initialized())
+        return lapic_register_callback(&scheduler_timer_handler);
+    return pit_register_callback(&scheduler_timer_handler);
+}
+
+int scheduler_queue_thread(thread_t* th)
+{
+    th->cpu_id = percpu_get()->id;
+    return scheduler_enqueue_thread(th);
+}
+
 int scheduler_queue_process(process_t* ps)
 {
-    return scheduler_queue_process_in_list(&running, ps);
+    thread_t* th;
+    int err;
+
+    spinlock_acquire(&processes_lock);
+    err = scheduler_queue_process_in_list(&processes, ps);
+    spinlock_release(&processes_lock);
+    if (err)
+        return -1;
+
+    for (th = ps->threads; th != NULL; th = th->next)
+    {
+        if (scheduler_queue_thread(th))
+            return -1;
+    }
+
+    return 0;
 }
 
-int scheduler_terminate_process(process_t* ps)
+static int scheduler_dequeue_thread(thread_t* th)
 {
-    if 
+    scheduler_queue_t* queue;
+    int err;
+
+    queue = &queues[th->cpu_id];
+    spinlock_acquire(&queue->lock);
+    err = scheduler_remove_thread_from_list(&queue->running, th);
+    if (!err)
+        --queue->load;
+    spinlock_release(&queue->lock);
+
+    return err;
+}
+
+int scheduler_sleep_thread(thread_t* th, uint64_t ns)
+{
+    int err;
+
+    if
     (
-        ps == NULL ||
-        scheduler_remove_process_from_list(&running, ps)
+        th == NULL ||
+        scheduler_dequeue_thread(th)
     )
         return -1;
-    process_delete_resources(ps);
-    return scheduler_queue_process_in_list(&zombie, ps);
+    th->sleep_deadline = tsc_get_ns() + ns;
+
+    spinlock_acquire(&sleeping_lock);
+    err = scheduler_queue_thread_in_list_by_deadline(&sleeping, th);
+    spinlock_release(&sleeping_lock);
+
+    return err;
+}
+
+static scheduler_wait_queue_t* scheduler_get_wait_queue(uint64_t channel)
+{
+    /* Channels are mostly aligned addresses, the multiplication spreads them over the top bits */
+    return &wait_queues[(channel * 0x9E3779B97F4A7C15) >> (64 - SCHEDULER_WAIT_QUEUES_SHIFT)];
+}
+
+static int scheduler_park_thread(scheduler_wait_queue_t* wq, thread_t* th, uint64_t channel)
+{
+    if (scheduler_dequeue_thread(th))
+        return -1;
+    th->wait_channel = channel;
+    return scheduler_queue_thread_in_list(&wq->threads, th);
+}
+
+int scheduler_block_thread(thread_t* th, uint64_t channel)
+{
+    scheduler_wait_queue_t* wq;
+    int err;
+
+    wq = scheduler_get_wait_queue(channel);
+    spinlock_acquire(&wq->lock);
+    err = scheduler_park_thread(wq, th, channel);
+    spinlock_release(&wq->lock);
+
+    return err;
+}
+
+int scheduler_block_thread_if_equal(thread_t* th, uint64_t channel, const volatile uint32_t* word, uint32_t value)
+{
+    scheduler_wait_queue_t* wq;
+    int err;
+
+    wq = scheduler_get_wait_queue(channel);
+    spinlock_acquire(&wq->lock);
+    /* Anyone changing the word wakes the channel afterwards, which needs this lock */
+    if (*word != value)
+        err = 1;
+    else
+        err = scheduler_park_thread(wq, th, channel);
+    spinlock_release(&wq->lock);
+
+    return err;
+}
+
+uint64_t scheduler_wake_channel(uint64_t channel, uint64_t max)
+{
+    scheduler_wait_queue_t* wq;
+    thread_list_entry_t* entry;
+    thread_list_entry_t* next;
+    thread_list_entry_t* prev;
+    thread_list_t woken;
+    uint64_t count;
+
+    memset(&woken, 0, sizeof(thread_list_t));
+    count = 0;
+    wq = scheduler_get_wait_queue(channel);
+
+    spinlock_acquire(&wq->lock);
+    for (entry = wq->threads.head, prev = NULL; entry != NULL && count < max; entry = next)
+    {
+        next = entry->next;
+        if (entry->th->wait_channel != channel)
+        {
+            prev = entry;
+            continue;
+        }
+
+        if (prev == NULL)
+            wq->threads.head = next;
+        else
+            prev->next = next;
+        if (wq->threads.tail == entry)
+            wq->threads.tail = prev;
+
+        entry->next = NULL;
+        if (woken.tail == NULL)
+            woken.head = entry;
+        else
+            woken.tail->next = entry;
+        woken.tail = entry;
+        ++count;
+    }
+    spinlock_release(&wq->lock);
+
+    /* Woken up in the order they blocked */
+    for (entry = woken.head; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        if (scheduler_enqueue_thread(entry->th))
+            trace_scheduler("Failed to wake up thread (tid: %u)", entry->th->tid);
+        free(entry);
+    }
+
+    return count;
+}
+
+static void scheduler_unblock_thread(thread_t* th)
+{
+    scheduler_wait_queue_t* wq;
+    int err;
+
+    wq = scheduler_get_wait_queue(th->wait_channel);
+    spinlock_acquire(&wq->lock);
+    err = scheduler_remove_thread_from_list(&wq->threads, th);
+    spinlock_release(&wq->lock);
+    if (err)
+    {
+        spinlock_acquire(&sleeping_lock);
+        err = scheduler_remove_thread_from_list(&sleeping, th);
+        spinlock_release(&sleeping_lock);
+    }
+
+    if (!err && scheduler_enqueue_thread(th))
+        trace_scheduler("Failed to wake up thread (tid: %u)", th->tid);
+}
+
+uint64_t scheduler_get_time(void)
+{
+    return tsc_get_ns();
+}
+
+static process_t* scheduler_find_child_in_list(process_list_t* pss, process_t* parent, int64_t pid)
+{
+    process_list_entry_t* entry;
+    for (entry = pss->head; entry != NULL; entry = entry->next)
+    {
+        if
+        (
+            entry->ps->parent_pid == parent->pid &&
+            (pid < 0 || entry->ps->pid == (uint64_t) pid)
+        )
+            return entry->ps;
+    }
+    return NULL;
 }
 
-static process_t* scheduler_fetch_next_running_process(void)
+static process_t* scheduler_find_process_in_list(process_list_t* pss, uint64_t pid)
 {
     process_list_entry_t* entry;
+    for (entry = pss->head; entry != NULL && entry->ps->pid != pid; entry = entry->next);
+    return (entry == NULL) ? NULL : entry->ps;
+}
+
+/* Must be called with processes_lock held */
+static void scheduler_orphan_children(process_t* parent)
+{
+    process_list_entry_t* entry;
+    process_t* child;
+
+    /* Nobody is going to wait for these anymore */
+    while ((child = scheduler_find_child_in_list(&zombie, parent, -1)) != NULL)
+    {
+        scheduler_remove_process_from_list(&zombie, child);
+        free(child);
+    }
+
+    /* The living ones are freed as soon as they exit */
+    for (entry = processes.head; entry != NULL; entry = entry->next)
+    {
+        if (entry->ps->parent_pid == parent->pid)
+            entry->ps->parent_pid = 0;
+    }
+}
+
+static void scheduler_finish_process(process_t* ps, thread_t* last)
+{
+    thread_t* th;
+    thread_t* next;
+    process_t* parent;
+
+    /* The address space is about to go away, get off it */
+    pml4_load(kernel_get_pml4_paddr());
+
+    for (th = ps->threads; th != NULL; th = next)
+    {
+        next = th->next;
+        fpu_release(th);
+        /* Still running its last syscall, the scheduler frees it once it's off the CPU */
+        if (th == last && th->on_cpu)
+        {
+            th->detached = 1;
+            continue;
+        }
+        while (th->on_cpu)
+            __asm__ volatile ("pause");
+        free(th);
+    }
+    ps->threads = NULL;
+    process_delete_resources(ps);
+
+    /* Only published once it's torn down, the parent frees it right away */
+    spinlock_acquire(&processes_lock);
+    scheduler_remove_process_from_list(&processes, ps);
+    scheduler_orphan_children(ps);
+    parent = (ps->parent_pid == 0) ? NULL : scheduler_find_process_in_list(&processes, ps->parent_pid);
+    if (parent == NULL || scheduler_queue_process_in_list(&zombie, ps))
+        free(ps);
+    else
+    {
+        /* The parent goes through waitpid again and finds this process */
+        scheduler_wake_channel((uint64_t) parent, (uint64_t) -1);
+    }
+    spinlock_release(&processes_lock);
+}
+
+int scheduler_terminate_thread(thread_t* th)
+{
+    process_t* ps;
+    uint8_t last;
+
+    if
+    (
+        th == NULL ||
+        scheduler_dequeue_thread(th)
+    )
+        return -1;
+    ps = th->process;
+
+    spinlock_acquire(&ps->lock);
+    th->exited = 1;
+    last = (--ps->live_threads == 0);
+    /* Joiners check exited under the same lock before they block */
+    if (!last)
+        scheduler_wake_channel((uint64_t) th, (uint64_t) -1);
+    spinlock_release(&ps->lock);
+
+    if (last)
+        scheduler_finish_process(ps, th);
+    else
+        fpu_release(th);
+
+    return 0;
+}
+
+int scheduler_terminate_process(process_t* ps, int status)
+{
+    thread_t* th;
+    thread_t* self;
+
+    self = scheduler_get_current_thread();
+    ps->exit_status = status;
+    ps->exiting = 1;
+
+    /* Everyone else is killed the next time they're picked to run */
+    spinlock_acquire(&ps->lock);
+    for (th = ps->threads; th != NULL; th = th->next)
+    {
+        if (th == self || th->exited)
+            continue;
+        scheduler_unblock_thread(th);
+        if (th->on_cpu && th->cpu_id != percpu_get()->id)
+            lapic_send_ipi(percpu_get_by_id(th->cpu_id)->lapic_id, LAPIC_IPI_VECTOR);
+    }
+    spinlock_release(&ps->lock);
+
+    return scheduler_terminate_thread(self);
+}
+
+int scheduler_wait_child(process_t* parent, thread_t* th, int64_t pid, uint8_t block, process_t** zombie_out)
+{
+    process_t* child;
+    int err;
+
+    err = 0;
+
+    spinlock_acquire(&processes_lock);
+    child = scheduler_find_child_in_list(&zombie, parent, pid);
+    if (child != NULL)
+        scheduler_remove_process_from_list(&zombie, child);
+    else if (scheduler_find_child_in_list(&processes, parent, pid) == NULL)
+        err = -1;
+    else if (block)
+    {
+        /* Parked under processes_lock so that an exiting child can't miss it */
+        err = scheduler_block_thread(th, (uint64_t) parent);
+    }
+    spinlock_release(&processes_lock);
+
+    *zombie_out = child;
+    return err;
+}
+
+int scheduler_join_thread(thread_t* th, uint64_t tid, uint8_t block, thread_t** exited_out)
+{
+    process_t* ps;
+    thread_t* target;
+    thread_t** link;
+    int err;
+
+    ps = th->process;
+    *exited_out = NULL;
+    err = 0;
+
+    spinlock_acquire(&ps->lock);
+    for (link = &ps->threads; *link != NULL && (*link)->tid != tid; link = &(*link)->next);
+    target = *link;
+    if (target == NULL || target == th)
+        err = -1;
+    else if (target->exited)
+    {
+        /* Taken off the list right away so that only one joiner gets it */
+        *link = target->next;
+        *exited_out = target;
+    }
+    else if (block)
+        err = scheduler_block_thread(th, (uint64_t) target);
+    spinlock_release(&ps->lock);
+
+    if (*exited_out != NULL)
+    {
+        /* The CPU it exited on might still be getting off its stack */
+        while (target->on_cpu)
+            __asm__ volatile ("pause");
+    }
+
+    return err;
+}
+
+static thread_t* scheduler_fetch_next_running_thread(scheduler_queue_t* queue)
+{
+    thread_list_entry_t* entry;
+    thread_t* th;
 
-    if (running.head == NULL || running.head->ps == NULL)
+    spinlock_acquire(&queue->lock);
+    if (queue->running.head == NULL || queue->running.head->th == NULL)
+    {
+        spinlock_release(&queue->lock);
         return NULL;
-    
-    entry = running.head;
+    }
+
+    entry = queue->running.head;
     if (entry->next != NULL)
     {
-        running.head = entry->next;
+        queue->running.head = entry->next;
         entry->next = NULL;
-        running.tail->next = entry;
-        running.tail = entry;
+        queue->running.tail->next = entry;
+        queue->running.tail = entry;
     }
+    th = queue->running.head->th;
+    spinlock_release(&queue->lock);
 
-    return running.head->ps;
+    return th;
 }
 
-void scheduler_run(void)
+static scheduler_queue_t* scheduler_find_busiest_queue(scheduler_queue_t* self)
 {
-    process_t* ps;
+    uint64_t i;
+    scheduler_queue_t* busiest;
+
+    /* The head of a queue is what its CPU is running, only the rest is up for grabs */
+    for (i = 0, busiest = NULL; i < percpu_get_count(); i++)
+    {
+        if
+        (
+            &queues[i] != self &&
+            percpu_get_by_id(i)->online &&
+            queues[i].load > 1 &&
+            (busiest == NULL || queues[i].load > busiest->load)
+        )
+            busiest = &queues[i];
+    }
+
+    return busiest;
+}
+
+static void scheduler_lock_queues(scheduler_queue_t* a, scheduler_queue_t* b)
+{
+    /* Always lock in the same order so two thieves can't deadlock */
+    if (a < b)
+    {
+        spinlock_acquire(&a->lock);
+        spinlock_acquire(&b->lock);
+    }
+    else
+    {
+        spinlock_acquire(&b->lock);
+        spinlock_acquire(&a->lock);
+    }
+}
+
+static thread_list_entry_t* scheduler_pick_steal_candidate(scheduler_queue_t* victim, thread_list_entry_t** prev_out, uint64_t now)
+{
+    thread_list_entry_t* entry;
+    thread_list_entry_t* prev;
+    thread_list_entry_t* coldest;
+    thread_list_entry_t* coldest_prev;
+
+    /* Take whoever has been waiting the longest, skipping the running head */
+    for
+    (
+        prev = victim->running.head, entry = prev->next, coldest = NULL, coldest_prev = NULL;
+        entry != NULL;
+        prev = entry, entry = entry->next
+    )
+    {
+        /* Its FPU state is still in the victim's registers */
+        if
+        (
+            entry->th->on_cpu ||
+            percpu_get_by_id(victim - queues)->fpu_owner == entry->th
+        )
+            continue;
+        if (coldest == NULL || entry->th->last_ran < coldest->th->last_ran)
+        {
+            coldest = entry;
+            coldest_prev = prev;
+        }
+    }
+
+    if (coldest == NULL)
+        return NULL;
+
+    /**
+     * Leave cache-hot threads alone unless the victim
+     * is overloaded enough for the migration to pay off
+     */
+    if
+    (
+        now - coldest->th->last_ran < SCHEDULER_MIGRATION_COST_NS &&
+        victim->load < SCHEDULER_IMBALANCE_THRESHOLD
+    )
+        return NULL;
+
+    *prev_out = coldest_prev;
+    return coldest;
+}
+
+static uint8_t scheduler_steal_thread(scheduler_queue_t* self)
+{
+    scheduler_queue_t* victim;
+    thread_list_entry_t* entry;
+    thread_list_entry_t* prev;
+
+    victim = scheduler_find_busiest_queue(self);
+    if (victim == NULL)
+        return 0;
+
+    scheduler_lock_queues(self, victim);
+
+    entry = NULL;
+    /* Things might have changed while we weren't holding the lock */
+    if (victim->load > 1 && victim->running.head != NULL)
+        entry = scheduler_pick_steal_candidate(victim, &prev, tsc_get_ns());
+
+    if (entry != NULL)
+    {
+        prev->next = entry->next;
+        if (victim->running.tail == entry)
+            victim->running.tail = prev;
+        --victim->load;
+
+        entry->next = NULL;
+        if (self->running.tail == NULL)
+            self->running.head = entry;
+        else
+            self->running.tail->next = entry;
+        self->running.tail = entry;
+        ++self->load;
+        entry->th->cpu_id = percpu_get()->id;
+    }
+
+    spinlock_release(&victim->lock);
+    spinlock_release(&self->lock);
+
+    return (entry != NULL);
+}
+
+static uint8_t scheduler_has_work(void)
+{
+    uint64_t i;
+    uint8_t found;
+
+    spinlock_acquire(&sleeping_lock);
+    found = (sleeping.head != NULL);
+    spinlock_release(&sleeping_lock);
+
+    for (i = 0; i < percpu_get_count() && !found; i++)
+        found = (queues[i].load != 0 || percpu_get_by_id(i)->current != NULL);
+
+    return found;
+}
+
+static void scheduler_idle(scheduler_queue_t* queue)
+{
+    queue->idling = 1;
+    scheduler_arm_timer();
+    /* Sleep until the next deadline or IPI, the timer stays off if nothing is due */
+    __asm__ ("sti; hlt; cli");
+    queue->idling = 0;
+}
+
+static void scheduler_schedule(void)
+{
+    thread_t* th;
+    interrupt_frame_t* frame;
+    percpu_t* cpu;
+    scheduler_queue_t* queue;
+
+    cpu = percpu_get();
+    queue = &queues[cpu->id];
+
+    /* We're off the previous thread's kernel stack, another CPU may pick it up now */
+    if (cpu->current != NULL)
+    {
+        th = cpu->current;
+        th->last_ran = tsc_get_ns();
+        th->on_cpu = 0;
+        cpu->current = NULL;
+        /* Its process is gone, nothing else refers to it */
+        if (th->detached)
+            free(th);
+    }
 
 START_SCHEDULING:
-    ps = scheduler_fetch_next_running_process();
-    if (ps == NULL)
+    th = scheduler_fetch_next_running_thread(queue);
+    if (th == NULL && scheduler_steal_thread(queue))
+        th = scheduler_fetch_next_running_thread(queue);
+    if (th == NULL)
     {
-        trace_scheduler("No process to execute. Halting...");
-        HALT();
+        /* Only the BSP stops for good, APs keep idling until an IPI or a deadline */
+        if (cpu->id == 0 && !scheduler_has_work())
+        {
+            trace_scheduler("No thread to execute. Halting...");
+            scheduler_stop_timer();
+            /* Nothing is left to flush the block cache later */
+            drivefs_sync();
+            HALT();
+        }
+        pml4_load(kernel_get_pml4_paddr());
+        scheduler_idle(queue);
+        goto START_SCHEDULING;
+    }
+
+    /* Wait for the CPU that ran it last to get off its kernel stack */
+    while (th->on_cpu)
+        __asm__ volatile ("pause");
+
+    if (th->process->exiting)
+    {
+        if (scheduler_terminate_thread(th))
+            trace_scheduler("Failed to terminate thread (tid: %u)", th->tid);
+        goto START_SCHEDULING;
     }
 
-    if (paging_inject_kernel_pml4(ps->pml4))
+    if (paging_inject_kernel_pml4(th->process->pml4))
     {
-        trace_scheduler("Failed to inject kernel PML4 (pid %u). Continuing...", ps->pid);
+        trace_scheduler("Failed to inject kernel PML4 (pid %u). Continuing...", th->process->pid);
         goto START_SCHEDULING;
     }
-    tss_set_kernel_stack(ps->kernel_stack.floor - sizeof(uint64_t));
-    ps = scheduler_switch_pml4_and_stack(ps, tss_get()->rsp0);
-    scheduler_run_process(&ps->cpu);
+
+    th->on_cpu = 1;
+    cpu->current = th;
+
+    queue->slice_deadline = tsc_get_ns() + SCHEDULER_TIME_SLICE_NS;
+    scheduler_arm_timer();
+
+    fpu_switch(th);
+    tss_set_kernel_stack(th->kernel_stack.floor - sizeof(uint64_t));
+    cpu_write_msr(MSR_FS_BASE, th->fs_base);
+
+    /* Preempted threads pick up right where their interrupt frame left them */
+    if (th->frame != NULL)
+    {
+        frame = th->frame;
+        th->frame = NULL;
+        scheduler_resume_frame(th->process->pml4_paddr, frame);
+    }
+
+    th = scheduler_switch_pml4_and_stack(th, tss_get()->rsp0, th->process->pml4_paddr);
+    scheduler_run_thread(&th->cpu);
+}
+
+void scheduler_run(void)
+{
+    /* Leave whatever stack we're on, it may belong to a thread that's about to move */
+    cpu_run_on_stack(percpu_get()->kernel_stack, &scheduler_schedule);
+}
+
+void scheduler_restart_current_thread(void)
+{
+    thread_t* th;
+
+    th = percpu_get()->current;
+    fpu_switch(th);
+    cpu_write_msr(MSR_FS_BASE, th->fs_base);
+    scheduler_run_thread(&th->cpu);
 }
@@ -6,10 +6,43 @@
 void scheduler_init_pss(void);
 int scheduler_init(void);
 uint64_t scheduler_get_next_pid(void);
+/* Makes the process known to the scheduler and queues all of its threads */
 int scheduler_queue_process(process_t* ps);
-int scheduler_replace_process(process_t* old, process_t* new);
-int scheduler_terminate_process(process_t* ps);
+int scheduler_queue_thread(thread_t* th);
+/* The process finishes once its last thread is gone */
+int scheduler_terminate_thread(thread_t* th);
+/* Called by one of the process' threads, the others are killed the next time they're scheduled */
+int scheduler_terminate_process(process_t* ps, int status);
+/**
+ * Take an exited child of parent (any child if pid is negative) off the zombie list.
+ * Returns -1 if there's no such child, otherwise 0 with zombie_out set to the
+ * exited child or to NULL if none exited yet, in which case block parks the
+ * calling thread th until one of the parent's children exits
+ */
+int scheduler_wait_child(process_t* parent, thread_t* th, int64_t pid, uint8_t block, process_t** zombie_out);
+/* Like scheduler_wait_child, for the thread tid of th's own process */
+int scheduler_join_thread(thread_t* th, uint64_t tid, uint8_t block, thread_t** exited_out);
+int scheduler_sleep_thread(thread_t* th, uint64_t ns);
+/**
+ * Take the thread off its run queue until someone wakes up the channel,
+ * any value unique to what's being waited for works (e.g. an address)
+ */
+int scheduler_block_thread(thread_t* th, uint64_t channel);
+/**
+ * Like scheduler_block_thread but only if the word still holds value,
+ * returns 1 without blocking otherwise. Whoever changes the word and
+ * wakes the channel can't slip in between the check and the block
+ */
+int scheduler_block_thread_if_equal(thread_t* th, uint64_t channel, const volatile uint32_t* word, uint32_t value);
+/* Wake up to max threads blocked on the channel, returns how many were woken */
+uint64_t scheduler_wake_channel(uint64_t channel, uint64_t max);
+uint64_t scheduler_get_time(void);
+/* Arm this CPU's timer again, for when a deadline outside the scheduler (the block cache flush) shows up */
+void scheduler_update_timer(void);
+thread_t* scheduler_get_current_thread(void);
 process_t* scheduler_get_current_process(void);
 void scheduler_run(void);
+/* Restart the current thread from its saved CPU state, keeping its slice */
+void scheduler_restart_current_thread(void);
 
 #endif
@@ -1,41 +1,27 @@
+%include "sys/cpu/percpu.inc"
+
 [section .text]
 [bits 64]
 
-[extern kernel_stack_bottom]
-
 [extern gdt_get_kernel_cs]
 [extern gdt_get_kernel_ds]
 
-[extern memcpy]
-[extern tss_get]
-
 [extern syscall_handler]
 
 
+; syscall_switch_to_kernel_stack -> Leave the process' kernel stack for this CPU's and call a hook that never returns
+; args -> RDI the hook
+;         RSI the hook's first argument
+;         RDX the hook's second argument
 [global syscall_switch_to_kernel_stack]
 syscall_switch_to_kernel_stack:
-    ; Save return return function address to RBX
-    mov rbx, rdi
-    ; Load kernel stack
-    mov rbp, (kernel_stack_bottom - 8)
-    mov rsp, rbp
-    ; Move the stack pointer to make space for memcpy copy
-    sub rsp, 8*4
-    ; Set memcpy's dest address to the current stack pointer
-    mov rdi, rsp
-    ; Move the syscall stack pointer to the last parameter
-    ; NOTE: RSI is memcpy's src address
-    sub rsi, 8*4
-    ; Set memcpy size to (5 * sizeof(uint64_t))
-    mov rdx, 8*5
-    ; Start copy!
-    call memcpy
-    ; Load the new syscall stack pointer as parameter
-    mov rdi, rbp
-    ; Push return address to the stack
-    push rbx
-    ; Return to hook
-    ret
+    mov rax, rdi
+    mov rsp, [gs:PERCPU_KERNEL_STACK]
+    mov rbp, rsp
+    mov rdi, rsi
+    mov rsi, rdx
+    call rax
+    jmp $
 
 [global syscall_init]
 syscall_init:
@@ -69,32 +55,51 @@ syscall_init:
 
     ret
 
+; syscall_hook -> SYSCALL entry point
+; args -> RDI the syscall number
+;         RSI, RDX, R10, R8, R9 the arguments
+; Returns the result in RAX, the callee saved registers are preserved
+; and the other caller saved ones are zeroed
 syscall_hook:
-    ; Save return address and FLAGS
+    ; Switch to the kernel GS base and the process' kernel stack
+    swapgs
+    mov [gs:PERCPU_USER_STACK], rsp
+    mov rsp, [gs:PERCPU_SYSCALL_STACK]
+    ; Build the syscall frame (see syscall_frame_t)
+    push qword [gs:PERCPU_USER_STACK]
     push rcx
     push r11
-    mov rcx, rdx
-    ; Save user RBP to the user stack and the user RSP to RBX
     push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    ; RBX (callee saved) keeps the frame pointer across the call
     mov rbx, rsp
-    ; Load the kernel stack
-    call tss_get ; STOP FUCKING WITH RDX WHEN YOU'RE NOT SUPPOSED TO PIECE OF SHIT FUNCTION
-    mov rbp, [rax + 4]
-    mov rsp, rbp
-    ; Store syscall arguments on the stack
-    mov [rsp], rsi
-    push rcx
-    push r10
-    push r8
-    push r9
-    ; Set second argument to be the pointer to the stack
-    mov rsi, rbp
-    ; Call syscall handler
+    and rsp, ~0xF
+    sub rsp, 8
+    ; syscall_handler(num, arg0, arg1, arg2, arg3, arg4, frame)
+    push rbx
+    mov rcx, r10
     call syscall_handler
-    ; Restore user stack RSP and RBP
     mov rsp, rbx
+    ; Don't hand back whatever the kernel left in the caller saved registers
+    xor edi, edi
+    xor esi, esi
+    xor edx, edx
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    ; Restore the user's callee saved registers, return address, FLAGS and stack
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
     pop rbp
-    ; Restore return address and FLAGS
     pop r11
     pop rcx
+    pop rsp
+    swapgs
     o64 sysret
@@ -1,16 +1,124 @@
 #include "syscall.h"
+#include "../utils/spinlock.h"
+#include "../utils/alloc.h"
+#include <mem.h>
 
-static syscall_t syscalls[] = {
-    &SYSCALL(exit),
-    &SYSCALL(execve),
-    &SYSCALL(fork)
+static const syscall_t syscalls[] = {
+#define SYSCALL_ENTRY(num, name) [num] = &SYSCALL(name),
+    SYSCALL_LIST(SYSCALL_ENTRY)
+#undef SYSCALL_ENTRY
 };
 
-#define NUM_SYSCALLS (sizeof(syscalls) / sizeof(uint64_t))
+#define NUM_SYSCALLS (sizeof(syscalls) / sizeof(syscalls[0]))
 
-int syscall_handler(uint64_t num, uint64_t* stack)
+/* Process and VFS state isn't fine-grained locked yet, one CPU in a syscall at a time */
+static spinlock_t syscall_lock = SPINLOCK_INIT;
+
+void syscall_unlock(void)
+{
+    spinlock_release(&syscall_lock);
+}
+
+void syscall_set_return_state(thread_t* th, const syscall_frame_t* frame, uint64_t ret)
+{
+    th->cpu.regs.rax = ret;
+    th->cpu.regs.rbx = frame->rbx;
+    th->cpu.regs.rbp = frame->rbp;
+    th->cpu.regs.r12 = frame->r12;
+    th->cpu.regs.r13 = frame->r13;
+    th->cpu.regs.r14 = frame->r14;
+    th->cpu.regs.r15 = frame->r15;
+    th->cpu.stack.rip = frame->rip;
+    th->cpu.stack.rflags = frame->rflags;
+    th->cpu.stack.rsp = frame->rsp;
+}
+
+int64_t syscall_transfer(int64_t fd, const syscall_iovec_t* iov, uint64_t count, int64_t offset, uint8_t write)
+{
+    thread_t* th;
+    file_t* file;
+    uint64_t i, position;
+    int64_t done, n;
+
+    th = scheduler_get_current_thread();
+    file = process_get_file(th->process, fd);
+    if (file == NULL)
+        return -1;
+    if (!(file->flags & (write ? FILE_FLAG_WRITE : FILE_FLAG_READ)))
+    {
+        file_unref(file);
+        return -1;
+    }
+
+    /* Held throughout so that transfers sharing the file offset don't overlap */
+    spinlock_acquire(&file->lock);
+    if (offset < 0 && write && (file->flags & FILE_FLAG_APPEND))
+        file_seek(file, 0, FILE_SEEK_END);
+    position = (offset < 0) ? file->offset : (uint64_t) offset;
+
+    for (i = 0, done = 0; i < count; i++)
+    {
+        if (process_check_user_memory(th, (uint64_t) iov[i].base, iov[i].length, write ? PAGE_ACCESS_RO : PAGE_ACCESS_RW))
+            n = -1;
+        else if (write)
+            n = file_write(file, iov[i].base, iov[i].length, position);
+        else
+            n = file_read(file, iov[i].base, iov[i].length, position);
+
+        /* Whatever made it through is reported, the error only if nothing did */
+        if (n < 0)
+        {
+            if (done == 0)
+                done = -1;
+            break;
+        }
+        done += n;
+        position += n;
+        if ((uint64_t) n < iov[i].length)
+            break;
+    }
+
+    if (offset < 0 && done > 0)
+        file->offset = position;
+    spinlock_release(&file->lock);
+    file_unref(file);
+
+    return done;
+}
+
+int64_t syscall_transfer_user_iovecs(int64_t fd, const syscall_iovec_t* user_iov, uint64_t count, uint8_t write)
+{
+    syscall_iovec_t* iov;
+    int64_t done;
+
+    if
+    (
+        count > SYSCALL_MAX_IOVECS ||
+        process_check_user_memory(scheduler_get_current_thread(), (uint64_t) user_iov, count * sizeof(syscall_iovec_t), PAGE_ACCESS_RO)
+    )
+        return -1;
+    if (count == 0)
+        return syscall_transfer(fd, NULL, 0, -1, write);
+
+    /* Copied so that another thread can't swap the buffers once they are checked */
+    iov = malloc(count * sizeof(syscall_iovec_t));
+    if (iov == NULL)
+        return -1;
+    memcpy(iov, user_iov, count * sizeof(syscall_iovec_t));
+
+    done = syscall_transfer(fd, iov, count, -1, write);
+    free(iov);
+
+    return done;
+}
+
+int64_t syscall_handler(uint64_t num, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, syscall_frame_t* frame)
 {
-    if (num > NUM_SYSCALLS)
+    int64_t ret;
+    if (num >= NUM_SYSCALLS || syscalls[num] == NULL)
         return -1;
-    return syscalls[num](stack);
+    spinlock_acquire(&syscall_lock);
+    ret = syscalls[num](arg0, arg1, arg2, arg3, arg4, frame);
+    spinlock_release(&syscall_lock);
+    return ret;
 }
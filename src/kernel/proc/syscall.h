@@ -7,19 +7,99 @@
 #include "../sys/mem/paging.h"
 #include <stddef.h>
 
+/**
+ * Every syscall as (number, name), the table and the
+ * prototypes below are generated from this list
+ */
+#define SYSCALL_LIST(X) \
+    X(0, exit) \
+    X(1, execve) \
+    X(2, fork) \
+    X(3, spawn) \
+    X(4, waitpid) \
+    X(5, wait) \
+    X(6, thread_create) \
+    X(7, thread_exit) \
+    X(8, thread_join) \
+    X(9, set_tls) \
+    X(10, futex) \
+    X(11, open) \
+    X(12, close) \
+    X(13, dup2) \
+    X(14, read) \
+    X(15, write) \
+    X(16, lseek) \
+    X(17, pread) \
+    X(18, pwrite) \
+    X(19, readv) \
+    X(20, writev) \
+    X(21, sync) \
+    X(22, sleep)
+
+/**
+ * User state saved by syscall_hook on the kernel stack, lowest address first
+ */
+struct syscall_frame
+{
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t rbx;
+    uint64_t rbp;
+    uint64_t rflags;
+    uint64_t rip;
+    uint64_t rsp;
+} __attribute__((packed));
+typedef struct syscall_frame syscall_frame_t;
+
+/**
+ * One buffer of a vectored transfer, as laid out by user space
+ */
+typedef struct
+{
+    void* base;
+    uint64_t length;
+} __attribute__((packed)) syscall_iovec_t;
+
+/* Most buffers readv and writev take at once */
+#define SYSCALL_MAX_IOVECS 1024
+
+/* Length of the SYSCALL instruction, stepping back by it issues the syscall again */
+#define SYSCALL_INSTRUCTION_SIZE 2
+
 #define SYSCALL(name) sys_##name
-#define DEFSYSCALL(name) int SYSCALL(name)(uint64_t* stack)
+#define SYSCALL_ARGS uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, syscall_frame_t* frame
+#define DEFSYSCALL(name) int64_t SYSCALL(name)(SYSCALL_ARGS)
+
+#define get_arg(n, T) ((T) arg##n)
 
-#define get_arg(n, T) (*((T*) (stack - n)))
-#define set_arg(n, v) stack[-n] = (uint64_t) (v)
+typedef int64_t (*syscall_t)(SYSCALL_ARGS);
 
-typedef int (*syscall_t)(uint64_t* stack_ptr);
+typedef enum
+{
+#define SYSCALL_NUMBER(num, name) SYSCALL_NUM_##name = num,
+    SYSCALL_LIST(SYSCALL_NUMBER)
+#undef SYSCALL_NUMBER
+} syscall_number_t;
 
 extern void syscall_init(void);
-extern void syscall_switch_to_kernel_stack(void* ret, uint64_t* stack);
+extern void syscall_switch_to_kernel_stack(void* hook, uint64_t arg0, uint64_t arg1);
+/* Must be called by syscalls that never return before giving up the CPU */
+void syscall_unlock(void);
+/* Make the thread resume in user mode as if the syscall had returned ret */
+void syscall_set_return_state(thread_t* th, const syscall_frame_t* frame, uint64_t ret);
+/**
+ * Move data between fd and the user buffers listed in iov (a kernel copy of the list),
+ * at offset or, if it's negative, at the file offset which is then advanced.
+ * Returns how many bytes were transferred
+ */
+int64_t syscall_transfer(int64_t fd, const syscall_iovec_t* iov, uint64_t count, int64_t offset, uint8_t write);
+/* Copy a user list of count buffers into the kernel and transfer through it at the file offset */
+int64_t syscall_transfer_user_iovecs(int64_t fd, const syscall_iovec_t* user_iov, uint64_t count, uint8_t write);
 
-DEFSYSCALL(exit);
-DEFSYSCALL(execve);
-DEFSYSCALL(fork);
+#define SYSCALL_DECLARE(num, name) DEFSYSCALL(name);
+SYSCALL_LIST(SYSCALL_DECLARE)
+#undef SYSCALL_DECLARE
 
 #endif
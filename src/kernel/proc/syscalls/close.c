@@ -0,0 +1,12 @@
+#include "../syscall.h"
+
+DEFSYSCALL(close)
+{
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    return process_close_fd(scheduler_get_current_process(), get_arg(0, int64_t));
+}
@@ -0,0 +1,11 @@
+#include "../syscall.h"
+
+DEFSYSCALL(dup2)
+{
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    return process_dup_fd(scheduler_get_current_process(), get_arg(0, int64_t), get_arg(1, int64_t));
+}
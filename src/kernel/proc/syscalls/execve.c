@@ -2,34 +2,43 @@
 
 #define trace_exec(msg, ...) trace("EXEC", msg, ##__VA_ARGS__)
 
-static void execve_hook(uint64_t* stack)
+static void execve_abort_hook(uint64_t arg0, uint64_t arg1)
 {
-    process_t* new;
-    process_t* old;
+    process_t* ps;
+
+    UNUSED(arg0);
+    UNUSED(arg1);
 
-    new = get_arg(0, process_t*);
-    old = get_arg(1, process_t*);
+    ps = scheduler_get_current_process();
+    pml4_load(kernel_get_pml4_paddr());
+    if (scheduler_terminate_process(ps, PROC_EXIT_STATUS_FAULT))
+    {
+        trace_exec("Failed to terminate process");
+        HALT();
+    }
 
-    scheduler_replace_process(old, new);
+    syscall_unlock();
     scheduler_run();
 }
 
 DEFSYSCALL(execve)
 {
-    process_t* current;
     process_t* ps;
+    int err;
 
-    current = scheduler_get_current_process();
-    ps = process_create_replacement(current, get_arg(0, const char*), get_arg(1, const char**), get_arg(2, const char**));
-    if (ps == NULL)
+    ps = scheduler_get_current_process();
+    err = process_exec(ps, scheduler_get_current_thread(), get_arg(0, const char*), get_arg(1, const char**), get_arg(2, const char**));
+    if (err == PROC_EXEC_FATAL)
     {
-        trace_exec("Failed to create replacement process");
-        return -1;
+        trace_exec("Process %u lost its image while executing %s", ps->pid, ps->exec_path);
+        syscall_switch_to_kernel_stack(&execve_abort_hook, 0, 0);
     }
-    set_arg(0, ps);
-    set_arg(1, current);
+    if (err)
+        return -1;
 
-    syscall_switch_to_kernel_stack(&execve_hook, stack);
+    /* Nothing of the old image is left to return to */
+    syscall_unlock();
+    scheduler_restart_current_thread();
 
     return -1;
 }
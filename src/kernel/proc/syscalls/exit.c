@@ -3,15 +3,15 @@
 #define trace_exit(msg, ...) trace("EXIT", msg, ##__VA_ARGS__)
 #define EXIT_STATUS_OK 0
 
-static void exit_hook(uint64_t* stack)
+static void exit_hook(uint64_t arg0, uint64_t arg1)
 {
     int status;
     process_t* ps;
 
-    status = get_arg(0, int);
+    status = (int) arg0;
     ps = scheduler_get_current_process();
     pml4_load(kernel_get_pml4_paddr());
-    if (scheduler_terminate_process(ps))
+    if (scheduler_terminate_process(ps, status))
     {
         trace_exit("Failed to terminate process");
         HALT();
@@ -19,11 +19,12 @@ static void exit_hook(uint64_t* stack)
     if (status != EXIT_STATUS_OK)
         trace_exit("Process %u terminated with exit error code: %d", ps->pid, (long) status);
     
+    syscall_unlock();
     scheduler_run();
 }
 
 DEFSYSCALL(exit)
 {
-    syscall_switch_to_kernel_stack(&exit_hook, stack);
+    syscall_switch_to_kernel_stack(&exit_hook, arg0, 0);
     return -1;
 }
@@ -6,20 +6,23 @@ DEFSYSCALL(fork)
 {
     process_t* parent;
     process_t* new;
+    thread_t* th;
     uint64_t* new_pid;
 
     new_pid = get_arg(0, uint64_t*);
     *new_pid = scheduler_get_next_pid();
 
-    parent = scheduler_get_current_process();
-    new = process_clone(parent, *new_pid);
+    th = scheduler_get_current_thread();
+    parent = th->process;
+    new = process_clone(parent, th, *new_pid);
     if (new == NULL)
     {
         trace_fork("Failed to fork process (pid: %u)", parent->pid);
         return -1;
     }
 
-    new->cpu.regs.rax = 0;
+    /* The child returns from the same syscall with 0 */
+    syscall_set_return_state(new->threads, frame, 0);
     scheduler_queue_process(new);
 
     return 0;
@@ -0,0 +1,56 @@
+#include "../syscall.h"
+
+/**
+ *  Operation 0 (WAIT): Block until woken if the word still holds value.
+ *  Operation 1 (WAKE): Wake up to value threads waiting on the word.
+ */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+DEFSYSCALL(futex)
+{
+    thread_t* th;
+    uint64_t vaddr, paddr;
+    uint64_t value;
+    int err;
+
+    UNUSED(arg3);
+    UNUSED(arg4);
+
+    vaddr = get_arg(0, uint64_t);
+    value = get_arg(2, uint64_t);
+    th = scheduler_get_current_thread();
+
+    if
+    (
+        (vaddr & (sizeof(uint32_t) - 1)) ||
+        process_check_user_memory(th, vaddr, sizeof(uint32_t), PAGE_ACCESS_RO)
+    )
+        return -1;
+
+    /**
+     * Keyed by physical address so that processes sharing the page
+     * meet on the same channel, it can't clash with the kernel
+     * pointers other waiters use as channels
+     */
+    paddr = pml4_get_paddr(th->process->pml4, vaddr);
+    if (paddr == 0)
+        return -1;
+
+    switch (get_arg(1, uint64_t))
+    {
+    case FUTEX_WAIT:
+        err = scheduler_block_thread_if_equal(th, paddr, (const volatile uint32_t*) vaddr, (uint32_t) value);
+        if (err)
+            return -1;
+        /* Returns 0 once woken, the caller checks the word again */
+        syscall_set_return_state(th, frame, 0);
+        syscall_unlock();
+        scheduler_run();
+        return -1;
+    case FUTEX_WAKE:
+        return (int64_t) scheduler_wake_channel(paddr, value);
+    default:
+        return -1;
+    }
+}
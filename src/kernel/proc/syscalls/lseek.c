@@ -0,0 +1,22 @@
+#include "../syscall.h"
+
+DEFSYSCALL(lseek)
+{
+    file_t* file;
+    int64_t offset;
+
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    file = process_get_file(scheduler_get_current_process(), get_arg(0, int64_t));
+    if (file == NULL)
+        return -1;
+
+    spinlock_acquire(&file->lock);
+    offset = file_seek(file, get_arg(1, int64_t), get_arg(2, uint64_t));
+    spinlock_release(&file->lock);
+    file_unref(file);
+
+    return offset;
+}
@@ -0,0 +1,40 @@
+#include "../syscall.h"
+#include "../../utils/alloc.h"
+
+#define trace_open(msg, ...) trace("OPEN", msg, ##__VA_ARGS__)
+
+DEFSYSCALL(open)
+{
+    process_t* ps;
+    file_t* file;
+    char* path;
+    int64_t fd;
+
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    ps = scheduler_get_current_process();
+    path = malloc(PROC_MAX_PATH);
+    if (path == NULL)
+        return -1;
+    if (process_copy_user_string(scheduler_get_current_thread(), get_arg(0, const char*), path, PROC_MAX_PATH) < 0)
+    {
+        free(path);
+        return -1;
+    }
+    file = file_open(path, get_arg(1, uint32_t));
+    free(path);
+    if (file == NULL)
+        return -1;
+
+    fd = process_install_file(ps, file);
+    if (fd < 0)
+    {
+        trace_open("No free file descriptor left (pid: %u)", ps->pid);
+        file_unref(file);
+    }
+
+    return fd;
+}
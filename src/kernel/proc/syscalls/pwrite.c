@@ -0,0 +1,19 @@
+#include "../syscall.h"
+
+DEFSYSCALL(pwrite)
+{
+    syscall_iovec_t iov;
+    int64_t offset;
+
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    iov.base = (void*) get_arg(1, const void*);
+    iov.length = get_arg(2, uint64_t);
+    offset = get_arg(3, int64_t);
+    if (offset < 0)
+        return -1;
+
+    /* The file offset stays where it is */
+    return syscall_transfer(get_arg(0, int64_t), &iov, 1, offset, 1);
+}
@@ -0,0 +1,10 @@
+#include "../syscall.h"
+
+DEFSYSCALL(readv)
+{
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    return syscall_transfer_user_iovecs(get_arg(0, int64_t), get_arg(1, const syscall_iovec_t*), get_arg(2, uint64_t), 0);
+}
@@ -0,0 +1,20 @@
+#include "../syscall.h"
+#include "../../sys/cpu/cpu.h"
+
+DEFSYSCALL(set_tls)
+{
+    thread_t* th;
+
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    /* Saved so that it's loaded again every time the thread is switched in */
+    th = scheduler_get_current_thread();
+    th->fs_base = get_arg(0, uint64_t);
+    cpu_write_msr(MSR_FS_BASE, th->fs_base);
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include "../syscall.h"
+
+DEFSYSCALL(sleep)
+{
+    thread_t* th;
+    uint64_t ns;
+
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+
+    ns = get_arg(0, uint64_t);
+    if (ns == 0)
+        return 0;
+
+    th = scheduler_get_current_thread();
+    if (scheduler_sleep_thread(th, ns))
+        return -1;
+
+    /* Returns 0 once the deadline passes and the thread is queued again */
+    syscall_set_return_state(th, frame, 0);
+    syscall_unlock();
+    scheduler_run();
+
+    return -1;
+}
@@ -0,0 +1,72 @@
+#include "../syscall.h"
+#include "../../utils/alloc.h"
+#include <mem.h>
+
+#define trace_spawn(msg, ...) trace("SPWN", msg, ##__VA_ARGS__)
+
+DEFSYSCALL(spawn)
+{
+    process_t* parent;
+    process_t* child;
+    thread_t* th;
+    const char** argv;
+    const char** envp;
+    const process_fd_action_t* user_actions;
+    process_fd_action_t* actions;
+    char* path;
+    uint64_t pid, num_actions;
+    int64_t ret;
+
+    UNUSED(frame);
+
+    th = scheduler_get_current_thread();
+    parent = th->process;
+    user_actions = get_arg(3, const process_fd_action_t*);
+    num_actions = get_arg(4, uint64_t);
+
+    /* Taken into the kernel in one go, nothing is read from the parent after it's checked */
+    path = malloc(PROC_MAX_PATH);
+    argv = (get_arg(1, const char**) != NULL) ? process_copy_user_strings(th, get_arg(1, const char**)) : NULL;
+    envp = (get_arg(2, const char**) != NULL) ? process_copy_user_strings(th, get_arg(2, const char**)) : NULL;
+    actions = (num_actions > 0 && num_actions <= PROC_MAX_FDS) ? malloc(num_actions * sizeof(process_fd_action_t)) : NULL;
+    ret = -1;
+    if
+    (
+        path == NULL ||
+        process_copy_user_string(th, get_arg(0, const char*), path, PROC_MAX_PATH) < 0 ||
+        (get_arg(1, const char**) != NULL && argv == NULL) ||
+        (get_arg(2, const char**) != NULL && envp == NULL) ||
+        (num_actions > 0 && actions == NULL) ||
+        process_check_user_memory(th, (uint64_t) user_actions, num_actions * sizeof(process_fd_action_t), PAGE_ACCESS_RO)
+    )
+        goto END;
+    if (actions != NULL)
+        memcpy(actions, user_actions, num_actions * sizeof(process_fd_action_t));
+
+    pid = scheduler_get_next_pid();
+    child = process_spawn(parent, path, argv, envp, actions, num_actions, pid);
+    if (child == NULL)
+    {
+        trace_spawn("Failed to spawn process (parent pid: %u)", parent->pid);
+        goto END;
+    }
+
+    if (scheduler_queue_process(child))
+    {
+        process_delete_and_free(child);
+        goto END;
+    }
+    ret = (int64_t) pid;
+
+END:
+    if (path != NULL)
+        free(path);
+    if (argv != NULL)
+        free(argv);
+    if (envp != NULL)
+        free(envp);
+    if (actions != NULL)
+        free(actions);
+
+    return ret;
+}
@@ -0,0 +1,16 @@
+#include "../syscall.h"
+#include "../../sys/drivers/fs/drivefs.h"
+
+DEFSYSCALL(sync)
+{
+    UNUSED(arg0);
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    drivefs_sync();
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include "../syscall.h"
+
+#define trace_thread(msg, ...) trace("THRD", msg, ##__VA_ARGS__)
+
+DEFSYSCALL(thread_create)
+{
+    process_t* ps;
+    thread_t* th;
+    uint64_t tid;
+
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    ps = scheduler_get_current_process();
+    if (ps->exiting)
+        return -1;
+
+    /* Thread IDs share the PID counter, a thread can be told apart from any process */
+    tid = scheduler_get_next_pid();
+    th = process_create_thread(ps, get_arg(0, uint64_t), get_arg(1, uint64_t), get_arg(2, uint64_t), tid);
+    if (th == NULL)
+    {
+        trace_thread("Failed to create thread (pid: %u)", ps->pid);
+        return -1;
+    }
+
+    if (scheduler_queue_thread(th))
+    {
+        process_delete_thread(ps, th);
+        return -1;
+    }
+
+    return (int64_t) tid;
+}
@@ -0,0 +1,34 @@
+#include "../syscall.h"
+
+#define trace_thread(msg, ...) trace("THRD", msg, ##__VA_ARGS__)
+
+static void thread_exit_hook(uint64_t arg0, uint64_t arg1)
+{
+    UNUSED(arg0);
+    UNUSED(arg1);
+
+    /* The last thread to exit takes the whole process with it */
+    if (scheduler_terminate_thread(scheduler_get_current_thread()))
+    {
+        trace_thread("Failed to terminate thread");
+        HALT();
+    }
+
+    syscall_unlock();
+    scheduler_run();
+}
+
+DEFSYSCALL(thread_exit)
+{
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    scheduler_get_current_thread()->exit_value = get_arg(0, uint64_t);
+    /* The thread's own stacks may be released as soon as it's joined */
+    syscall_switch_to_kernel_stack(&thread_exit_hook, 0, 0);
+
+    return -1;
+}
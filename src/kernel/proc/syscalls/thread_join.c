@@ -0,0 +1,41 @@
+#include "../syscall.h"
+
+DEFSYSCALL(thread_join)
+{
+    thread_t* th;
+    thread_t* target;
+    uint64_t* value;
+
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+
+    value = get_arg(1, uint64_t*);
+    th = scheduler_get_current_thread();
+
+    /* Checked before joining, the exit value would be lost if the write failed afterwards */
+    if
+    (
+        (value != NULL && process_check_user_memory(th, (uint64_t) value, sizeof(uint64_t), PAGE_ACCESS_RW)) ||
+        scheduler_join_thread(th, get_arg(0, uint64_t), 1, &target)
+    )
+        return -1;
+
+    if (target == NULL)
+    {
+        /* Parked until the thread exits, then the same join runs again and collects it */
+        syscall_set_return_state(th, frame, 0);
+        th->cpu.stack.rip -= SYSCALL_INSTRUCTION_SIZE;
+        th->cpu.regs.rdi = SYSCALL_NUM_thread_join;
+        th->cpu.regs.rsi = arg0;
+        th->cpu.regs.rdx = arg1;
+        syscall_unlock();
+        scheduler_run();
+    }
+
+    if (value != NULL)
+        *value = target->exit_value;
+    process_delete_thread(th->process, target);
+
+    return 0;
+}
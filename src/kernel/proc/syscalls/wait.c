@@ -0,0 +1,11 @@
+#include "../syscall.h"
+
+DEFSYSCALL(wait)
+{
+    /* Any child, blocking */
+    UNUSED(arg1);
+    UNUSED(arg2);
+    UNUSED(arg3);
+    UNUSED(arg4);
+    return SYSCALL(waitpid)((uint64_t) -1, arg0, 0, 0, 0, frame);
+}
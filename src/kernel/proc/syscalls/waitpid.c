@@ -0,0 +1,57 @@
+#include "../syscall.h"
+#include "../../utils/alloc.h"
+
+#define trace_wait(msg, ...) trace("WAIT", msg, ##__VA_ARGS__)
+
+/**
+ * Options bit 0: Return 0 instead of blocking when no child has exited yet.
+ */
+#define WAIT_NOHANG (1 << 0)
+
+DEFSYSCALL(waitpid)
+{
+    process_t* ps;
+    process_t* zombie;
+    thread_t* th;
+    int* status;
+    int64_t pid;
+    uint64_t options;
+
+    pid = get_arg(0, int64_t);
+    status = get_arg(1, int*);
+    options = get_arg(2, uint64_t);
+    th = scheduler_get_current_thread();
+    ps = th->process;
+
+    /* Checked before reaping, the child would be lost if the write failed afterwards */
+    if
+    (
+        (status != NULL && process_check_user_memory(th, (uint64_t) status, sizeof(int), PAGE_ACCESS_RW)) ||
+        scheduler_wait_child(ps, th, pid, !(options & WAIT_NOHANG), &zombie)
+    )
+        return -1;
+
+    if (zombie == NULL)
+    {
+        if (options & WAIT_NOHANG)
+            return 0;
+
+        /* Parked until a child exits, then the same waitpid runs again and reaps it */
+        syscall_set_return_state(th, frame, 0);
+        th->cpu.stack.rip -= SYSCALL_INSTRUCTION_SIZE;
+        th->cpu.regs.rdi = SYSCALL_NUM_waitpid;
+        th->cpu.regs.rsi = arg0;
+        th->cpu.regs.rdx = arg1;
+        th->cpu.regs.r10 = arg2;
+        syscall_unlock();
+        scheduler_run();
+    }
+
+    if (status != NULL)
+        *status = zombie->exit_status;
+    pid = (int64_t) zombie->pid;
+    /* Its resources went away when it exited, only the descriptor is left */
+    free(zombie);
+
+    return pid;
+}
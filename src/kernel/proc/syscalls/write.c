@@ -0,0 +1,15 @@
+#include "../syscall.h"
+
+DEFSYSCALL(write)
+{
+    syscall_iovec_t iov;
+
+    UNUSED(arg3);
+    UNUSED(arg4);
+    UNUSED(frame);
+
+    iov.base = (void*) get_arg(1, const void*);
+    iov.length = get_arg(2, uint64_t);
+
+    return syscall_transfer(get_arg(0, int64_t), &iov, 1, -1, 1);
+}
@@ -0,0 +1,221 @@
+#include "dcache.h"
+#include "vfs.h"
+#include "../../utils/alloc.h"
+#include "../../utils/spinlock.h"
+#include <stddef.h>
+#include <string.h>
+#include <mem.h>
+
+#define DCACHE_MAX_ENTRIES 512
+/* Entries are hashed into 1 << SHIFT buckets by (directory, name) */
+#define DCACHE_BUCKETS_SHIFT 8
+#define DCACHE_BUCKETS (1 << DCACHE_BUCKETS_SHIFT)
+
+typedef struct dcache_entry
+{
+    struct dcache_entry* hash_next;
+    /* Most recently used first */
+    struct dcache_entry* lru_prev;
+    struct dcache_entry* lru_next;
+    uint64_t hash;
+    vnode_t dir;
+    vnode_t node;
+    uint8_t negative;
+    char name[];
+} dcache_entry_t;
+
+static dcache_entry_t* buckets[DCACHE_BUCKETS];
+static dcache_entry_t* lru_head;
+static dcache_entry_t* lru_tail;
+static uint64_t num_entries;
+static spinlock_t dcache_lock;
+
+void dcache_init(void)
+{
+    memset(buckets, 0, sizeof(buckets));
+    lru_head = NULL;
+    lru_tail = NULL;
+    num_entries = 0;
+    spinlock_init(&dcache_lock);
+}
+
+static uint64_t dcache_hash(const vnode_t* dir, const char* name)
+{
+    uint64_t hash;
+
+    /* FNV-1a over the name, seeded with the directory */
+    hash = 0xCBF29CE484222325 ^ (uint64_t) dir->data ^ (((uint64_t) dir->ops) << 1);
+    while (*name != '\0')
+    {
+        hash ^= (uint8_t) *name++;
+        hash *= 0x100000001B3;
+    }
+
+    return hash;
+}
+
+static dcache_entry_t** dcache_get_bucket(uint64_t hash)
+{
+    return &buckets[(hash * 0x9E3779B97F4A7C15) >> (64 - DCACHE_BUCKETS_SHIFT)];
+}
+
+static void dcache_lru_remove(dcache_entry_t* entry)
+{
+    if (entry->lru_prev == NULL)
+        lru_head = entry->lru_next;
+    else
+        entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next == NULL)
+        lru_tail = entry->lru_prev;
+    else
+        entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void dcache_lru_push(dcache_entry_t* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head == NULL)
+        lru_tail = entry;
+    else
+        lru_head->lru_prev = entry;
+    lru_head = entry;
+}
+
+static dcache_entry_t* dcache_find(uint64_t hash, const vnode_t* dir, const char* name)
+{
+    dcache_entry_t* entry;
+
+    for (entry = *dcache_get_bucket(hash); entry != NULL; entry = entry->hash_next)
+    {
+        if
+        (
+            entry->hash == hash &&
+            entry->dir.ops == dir->ops &&
+            entry->dir.data == dir->data &&
+            strcmp(entry->name, name) == 0
+        )
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void dcache_remove(dcache_entry_t* entry)
+{
+    dcache_entry_t** link;
+
+    dcache_lru_remove(entry);
+    for (link = dcache_get_bucket(entry->hash); *link != entry; link = &(*link)->hash_next);
+    *link = entry->hash_next;
+    if (!entry->negative)
+        vfs_put(&entry->node);
+    vfs_put(&entry->dir);
+    free(entry);
+    --num_entries;
+}
+
+static void dcache_evict(void)
+{
+    dcache_remove(lru_tail);
+}
+
+int dcache_lookup(const vnode_t* dir, const char* name, vnode_t* out)
+{
+    dcache_entry_t* entry;
+    int result;
+
+    spinlock_acquire(&dcache_lock);
+    entry = dcache_find(dcache_hash(dir, name), dir, name);
+    if (entry == NULL)
+        result = DCACHE_MISS;
+    else
+    {
+        dcache_lru_remove(entry);
+        dcache_lru_push(entry);
+        if (entry->negative)
+            result = DCACHE_NEGATIVE;
+        else
+        {
+            *out = entry->node;
+            result = DCACHE_HIT;
+        }
+    }
+    spinlock_release(&dcache_lock);
+
+    return result;
+}
+
+void dcache_insert(const vnode_t* dir, const char* name, const vnode_t* node)
+{
+    dcache_entry_t* entry;
+    dcache_entry_t** bucket;
+    uint64_t hash;
+
+    hash = dcache_hash(dir, name);
+
+    spinlock_acquire(&dcache_lock);
+    entry = dcache_find(hash, dir, name);
+    if (entry == NULL)
+    {
+        if (num_entries >= DCACHE_MAX_ENTRIES)
+            dcache_evict();
+
+        entry = malloc(sizeof(dcache_entry_t) + strlen(name) + 1);
+        if (entry == NULL)
+        {
+            spinlock_release(&dcache_lock);
+            return;
+        }
+        strcpy(entry->name, name);
+        entry->hash = hash;
+        /* The directory is part of the key, it has to stay around as long as the entry */
+        entry->dir = *dir;
+        vfs_get(&entry->dir);
+        bucket = dcache_get_bucket(hash);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        ++num_entries;
+    }
+    else
+    {
+        dcache_lru_remove(entry);
+        if (!entry->negative)
+            vfs_put(&entry->node);
+    }
+
+    entry->negative = (node == NULL);
+    if (node != NULL)
+    {
+        entry->node = *node;
+        vfs_get(&entry->node);
+    }
+    dcache_lru_push(entry);
+    spinlock_release(&dcache_lock);
+}
+
+void dcache_invalidate(const vnode_t* dir, const char* name)
+{
+    dcache_entry_t* entry;
+
+    spinlock_acquire(&dcache_lock);
+    entry = dcache_find(dcache_hash(dir, name), dir, name);
+    if (entry != NULL)
+        dcache_remove(entry);
+    spinlock_release(&dcache_lock);
+}
+
+void dcache_purge_directory(const vnode_t* dir)
+{
+    dcache_entry_t* entry;
+    dcache_entry_t* next;
+
+    spinlock_acquire(&dcache_lock);
+    for (entry = lru_head; entry != NULL; entry = next)
+    {
+        next = entry->lru_next;
+        if (entry->dir.ops == dir->ops && entry->dir.data == dir->data)
+            dcache_remove(entry);
+    }
+    spinlock_release(&dcache_lock);
+}
@@ -0,0 +1,21 @@
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include "vnode.h"
+
+/* Results of dcache_lookup */
+#define DCACHE_MISS 0
+#define DCACHE_HIT 1
+/* The name is known not to exist in the directory */
+#define DCACHE_NEGATIVE 2
+
+void dcache_init(void);
+int dcache_lookup(const vnode_t* dir, const char* name, vnode_t* out);
+/* Remember what name resolved to in dir (both are referenced), a NULL node records that it doesn't exist */
+void dcache_insert(const vnode_t* dir, const char* name, const vnode_t* node);
+/* Forget what name resolved to in dir, call when it appears or goes away */
+void dcache_invalidate(const vnode_t* dir, const char* name);
+/* Forget every name cached in dir */
+void dcache_purge_directory(const vnode_t* dir);
+
+#endif
@@ -0,0 +1,129 @@
+#include "file.h"
+#include "../../utils/alloc.h"
+#include "../../utils/log.h"
+#include "../../utils/macros.h"
+#include <stddef.h>
+#include <math.h>
+#include <mem.h>
+
+#define trace_file(msg, ...) trace("FILE", msg, ##__VA_ARGS__)
+
+/* Data written goes through a kernel buffer this big at a time */
+#define FILE_CHUNK_SIZE SIZE_nKB(64)
+
+file_t* file_open(const char* path, uint32_t flags)
+{
+    file_t* file;
+
+    if
+    (
+        (flags & ~FILE_FLAGS_MASK) ||
+        !(flags & (FILE_FLAG_READ | FILE_FLAG_WRITE))
+    )
+        return NULL;
+
+    file = calloc(1, sizeof(file_t));
+    if (file == NULL)
+    {
+        trace_file("Could not allocate space for open file (%s)", path);
+        return NULL;
+    }
+
+    if (vfs_lookup(path, &file->node))
+    {
+        free(file);
+        return NULL;
+    }
+    if (vfs_open(&file->node))
+    {
+        vfs_put(&file->node);
+        free(file);
+        return NULL;
+    }
+
+    file->flags = flags;
+    file->refs = 1;
+    spinlock_init(&file->lock);
+
+    return file;
+}
+
+file_t* file_ref(file_t* file)
+{
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+    return file;
+}
+
+void file_unref(file_t* file)
+{
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        vfs_put(&file->node);
+        free(file);
+    }
+}
+
+int64_t file_read(file_t* file, void* buffer, uint64_t bytes, uint64_t offset)
+{
+    return vfs_read(&file->node, buffer, bytes, offset);
+}
+
+int64_t file_write(file_t* file, const void* data, uint64_t bytes, uint64_t offset)
+{
+    uint8_t* chunk;
+    uint64_t done;
+    int64_t size;
+
+    if (bytes == 0)
+        return 0;
+
+    /* Drivers get a stable copy the user can't change halfway through */
+    chunk = malloc(minu(bytes, FILE_CHUNK_SIZE));
+    if (chunk == NULL)
+    {
+        trace_file("Could not allocate space for write buffer");
+        return -1;
+    }
+
+    for (done = 0; done < bytes; done += size)
+    {
+        memcpy(chunk, &((const uint8_t*) data)[done], minu(bytes - done, FILE_CHUNK_SIZE));
+        size = vfs_write(&file->node, chunk, minu(bytes - done, FILE_CHUNK_SIZE), offset + done);
+        if (size <= 0)
+            break;
+    }
+    free(chunk);
+
+    if (done == 0)
+        return -1;
+    return (int64_t) done;
+}
+
+int64_t file_seek(file_t* file, int64_t offset, uint64_t whence)
+{
+    vattribs_t attr;
+    int64_t base;
+
+    switch (whence)
+    {
+    case FILE_SEEK_SET:
+        base = 0;
+        break;
+    case FILE_SEEK_CUR:
+        base = (int64_t) file->offset;
+        break;
+    case FILE_SEEK_END:
+        if (vfs_get_attribs(&file->node, &attr))
+            return -1;
+        base = (int64_t) attr.size;
+        break;
+    default:
+        return -1;
+    }
+
+    if (base + offset < 0)
+        return -1;
+    file->offset = (uint64_t) (base + offset);
+
+    return (int64_t) file->offset;
+}
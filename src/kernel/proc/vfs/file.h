@@ -0,0 +1,50 @@
+#ifndef __FILE_H__
+#define __FILE_H__
+
+#include "vfs.h"
+#include "../../utils/spinlock.h"
+
+/**
+ *  Bit 0: The file can be read from.
+ *  Bit 1: The file can be written to.
+ *  Bit 2: Every write goes to the end of the file.
+ */
+#define FILE_FLAG_READ (1 << 0)
+#define FILE_FLAG_WRITE (1 << 1)
+#define FILE_FLAG_APPEND (1 << 2)
+#define FILE_FLAGS_MASK (FILE_FLAG_READ | FILE_FLAG_WRITE | FILE_FLAG_APPEND)
+
+/**
+ *  Whence 0 (SET): Offsets count from the start of the file.
+ *  Whence 1 (CUR): Offsets count from the current file offset.
+ *  Whence 2 (END): Offsets count from the end of the file.
+ */
+#define FILE_SEEK_SET 0
+#define FILE_SEEK_CUR 1
+#define FILE_SEEK_END 2
+
+/**
+ * An open file, shared by every descriptor duplicated
+ * from the one open returned (also across fork)
+ */
+typedef struct
+{
+    vnode_t node;
+    uint64_t offset;
+    uint32_t flags;
+    uint64_t refs;
+    /* Guards the offset */
+    spinlock_t lock;
+} file_t;
+
+file_t* file_open(const char* path, uint32_t flags);
+file_t* file_ref(file_t* file);
+/* Drops a reference, the file is freed with the last one */
+void file_unref(file_t* file);
+/* Both return how many bytes were transferred, buffers may be in user memory */
+int64_t file_read(file_t* file, void* buffer, uint64_t bytes, uint64_t offset);
+int64_t file_write(file_t* file, const void* data, uint64_t bytes, uint64_t offset);
+/* Move the file offset, returns the new one */
+int64_t file_seek(file_t* file, int64_t offset, uint64_t whence);
+
+#endif
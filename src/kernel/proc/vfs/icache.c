@@ -0,0 +1,178 @@
+#include "icache.h"
+#include "../../utils/spinlock.h"
+#include "../../utils/alloc.h"
+#include <stddef.h>
+#include <mem.h>
+
+/* Beyond this many inodes the unreferenced ones start being evicted */
+#define ICACHE_MAX_INODES 1024
+/* Inodes are hashed into 1 << SHIFT buckets by (fs, number) */
+#define ICACHE_BUCKETS_SHIFT 8
+#define ICACHE_BUCKETS (1 << ICACHE_BUCKETS_SHIFT)
+
+static icache_inode_t* buckets[ICACHE_BUCKETS];
+static icache_inode_t* lru_head;
+static icache_inode_t* lru_tail;
+static uint64_t num_inodes;
+static spinlock_t icache_lock;
+
+void icache_init(void)
+{
+    memset(buckets, 0, sizeof(buckets));
+    lru_head = NULL;
+    lru_tail = NULL;
+    num_inodes = 0;
+    spinlock_init(&icache_lock);
+}
+
+static icache_inode_t** icache_get_bucket(const void* fs, uint64_t number)
+{
+    return &buckets[((number ^ (((uint64_t) fs) >> 4)) * 0x9E3779B97F4A7C15) >> (64 - ICACHE_BUCKETS_SHIFT)];
+}
+
+static void icache_lru_remove(icache_inode_t* inode)
+{
+    if (inode->lru_prev == NULL)
+        lru_head = inode->lru_next;
+    else
+        inode->lru_prev->lru_next = inode->lru_next;
+    if (inode->lru_next == NULL)
+        lru_tail = inode->lru_prev;
+    else
+        inode->lru_next->lru_prev = inode->lru_prev;
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+}
+
+static void icache_lru_push(icache_inode_t* inode)
+{
+    inode->lru_prev = NULL;
+    inode->lru_next = lru_head;
+    if (lru_head == NULL)
+        lru_tail = inode;
+    else
+        lru_head->lru_prev = inode;
+    lru_head = inode;
+}
+
+static void icache_unhash(icache_inode_t* inode)
+{
+    icache_inode_t** link;
+
+    for (link = icache_get_bucket(inode->fs, inode->number); *link != NULL && *link != inode; link = &(*link)->hash_next);
+    if (*link != NULL)
+        *link = inode->hash_next;
+    --num_inodes;
+}
+
+/* Must be called with the lock held */
+static icache_inode_t* icache_find_and_ref(const void* fs, uint64_t number)
+{
+    icache_inode_t* inode;
+
+    for (inode = *icache_get_bucket(fs, number); inode != NULL; inode = inode->hash_next)
+    {
+        if (inode->fs == fs && inode->number == number)
+        {
+            if (inode->refs++ == 0)
+                icache_lru_remove(inode);
+            break;
+        }
+    }
+
+    return inode;
+}
+
+/* Must be called with the lock held */
+static void icache_hash(icache_inode_t* inode)
+{
+    icache_inode_t** bucket;
+
+    inode->refs = 1;
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+    bucket = icache_get_bucket(inode->fs, inode->number);
+    inode->hash_next = *bucket;
+    *bucket = inode;
+    ++num_inodes;
+}
+
+icache_inode_t* icache_get(const void* fs, uint64_t number)
+{
+    icache_inode_t* inode;
+
+    spinlock_acquire(&icache_lock);
+    inode = icache_find_and_ref(fs, number);
+    spinlock_release(&icache_lock);
+
+    return inode;
+}
+
+void icache_insert(icache_inode_t* inode)
+{
+    spinlock_acquire(&icache_lock);
+    icache_hash(inode);
+    spinlock_release(&icache_lock);
+}
+
+icache_inode_t* icache_share(const icache_inode_t* template, uint64_t size)
+{
+    icache_inode_t* inode;
+    icache_inode_t* copy;
+
+    /* Allocated up front so that the lookup and the insertion happen under one hold of the lock */
+    copy = malloc(size);
+
+    spinlock_acquire(&icache_lock);
+    inode = icache_find_and_ref(template->fs, template->number);
+    if (inode == NULL && copy != NULL)
+    {
+        memcpy(copy, template, size);
+        icache_hash(copy);
+        inode = copy;
+        copy = NULL;
+    }
+    spinlock_release(&icache_lock);
+
+    if (copy != NULL)
+        free(copy);
+
+    return inode;
+}
+
+void icache_ref(icache_inode_t* inode)
+{
+    spinlock_acquire(&icache_lock);
+    if (inode->refs++ == 0)
+        icache_lru_remove(inode);
+    spinlock_release(&icache_lock);
+}
+
+void icache_put(icache_inode_t* inode)
+{
+    icache_inode_t* victim;
+    icache_inode_t* evicted;
+
+    evicted = NULL;
+
+    spinlock_acquire(&icache_lock);
+    if (--inode->refs == 0)
+        icache_lru_push(inode);
+    while (num_inodes > ICACHE_MAX_INODES && lru_tail != NULL)
+    {
+        victim = lru_tail;
+        icache_lru_remove(victim);
+        icache_unhash(victim);
+        /* Destroyed once the lock is dropped, chained through the now unused hash link */
+        victim->hash_next = evicted;
+        evicted = victim;
+    }
+    spinlock_release(&icache_lock);
+
+    while (evicted != NULL)
+    {
+        victim = evicted;
+        evicted = victim->hash_next;
+        victim->destroy(victim);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef __ICACHE_H__
+#define __ICACHE_H__
+
+#include <stdint.h>
+
+/**
+ * Embedded at the start of a filesystem's in-memory inode,
+ * it's shared by every vnode referring to the same file
+ */
+typedef struct icache_inode
+{
+    struct icache_inode* hash_next;
+    /* Only inodes nobody references are on the LRU list */
+    struct icache_inode* lru_prev;
+    struct icache_inode* lru_next;
+    /* Anything telling filesystem instances apart, with the number it identifies the file */
+    const void* fs;
+    uint64_t number;
+    uint64_t refs;
+    /* Frees the inode once it's evicted */
+    void (*destroy)(struct icache_inode* inode);
+} icache_inode_t;
+
+void icache_init(void);
+/* The cached inode with a new reference, or NULL */
+icache_inode_t* icache_get(const void* fs, uint64_t number);
+/* Start caching an inode with fs, number and destroy set, the caller holds its only reference */
+void icache_insert(icache_inode_t* inode);
+/**
+ * The cached inode for template's fs and number with a new reference, if there's none
+ * a copy of the size bytes at template (the whole filesystem inode) is cached instead.
+ * Returns NULL if the copy couldn't be allocated
+ */
+icache_inode_t* icache_share(const icache_inode_t* template, uint64_t size);
+void icache_ref(icache_inode_t* inode);
+/* Unreferenced inodes stay cached until they're the least recently used over the limit */
+void icache_put(icache_inode_t* inode);
+
+#endif
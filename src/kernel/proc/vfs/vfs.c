@@ -1,4 +1,6 @@
 #include "vfs.h"
+#include "dcache.h"
+#include "icache.h"
 #include "../../utils/log.h"
 #include "../../utils/alloc.h"
 #include <stddef.h>
@@ -7,89 +9,175 @@
 
 #define trace_vfs(msg, ...) trace("VIFS", msg, ##__VA_ARGS__) 
 
-typedef struct vfs_list_entry
+/* One path component of a mount point, mounts are found by walking down from "/" */
+typedef struct vfs_mount_node
 {
-    struct vfs_list_entry* next;
+    struct vfs_mount_node* children;
+    struct vfs_mount_node* next_sibling;
+    /* Mounted here, NULL if it's only on the way to a deeper mount point */
     vfs_t* vfs;
-} vfs_list_entry_t;
+    char name[];
+} vfs_mount_node_t;
 
-typedef struct
+static vfs_mount_node_t mounts_root;
+
+void vfs_init(void)
 {
-    vfs_list_entry_t* head;
-    vfs_list_entry_t* tail;
-} vfs_list_t;
+    memset(&mounts_root, 0, sizeof(vfs_mount_node_t));
+    dcache_init();
+    icache_init();
+}
 
-static vfs_list_t vfs_list;
+/* Length of the component path starts with once its leading slashes are skipped */
+static uint64_t vfs_next_component(const char** path)
+{
+    while (**path == '/')
+        ++(*path);
+    return strcspn(*path, "/");
+}
 
-void vfs_init(void)
+static vfs_mount_node_t* vfs_find_mount_child(vfs_mount_node_t* parent, const char* name, uint64_t length)
 {
-    vfs_list.head = NULL;    
-    vfs_list.tail = NULL;
+    vfs_mount_node_t* child;
+
+    for (child = parent->children; child != NULL; child = child->next_sibling)
+    {
+        if (strlen(child->name) == length && strncmp(child->name, name, length) == 0)
+            return child;
+    }
+
+    return NULL;
 }
 
 int vfs_mount(const char* path, vfs_t* vfs)
 {
-    vfs_list_entry_t* entry;
-    uint64_t path_bytes;
+    vfs_mount_node_t* node;
+    vfs_mount_node_t* child;
+    const char* component;
+    uint64_t length, path_bytes;
+
+    for (node = &mounts_root, component = path; (length = vfs_next_component(&component)) > 0; node = child, component += length)
+    {
+        child = vfs_find_mount_child(node, component, length);
+        if (child != NULL)
+            continue;
+
+        child = calloc(1, sizeof(vfs_mount_node_t) + length + 1);
+        if (child == NULL)
+        {
+            trace_vfs("Could not allocate space for mount point %s", path);
+            return -1;
+        }
+        memcpy(child->name, component, length);
+        child->next_sibling = node->children;
+        node->children = child;
+    }
 
-    entry = calloc(1, sizeof(vfs_list_entry_t));
-    if (entry == NULL)
+    if (node->vfs != NULL)
     {
-        trace_vfs("Could not allocate space for new entry");
+        trace_vfs("Something is already mounted at %s", path);
         return -1;
     }
-    entry->vfs = vfs;
-    
-    if (vfs_list.tail == NULL)
-        vfs_list.head = entry;
-    else
-        vfs_list.tail->next = entry;
-    vfs_list.tail = entry;
 
     path_bytes = strlen(path) + 1;
     vfs->mount_path = malloc(path_bytes);
+    if (vfs->mount_path == NULL)
+        return -1;
     memcpy((void*) vfs->mount_path, path, path_bytes);
+    node->vfs = vfs;
+    /* Names cached for an earlier instance with the same root would be taken for this one's */
+    dcache_purge_directory(&vfs->root);
 
     return 0;
 }
 
 static uint64_t find_longest_mount_path(const char* path, vfs_t** vfs_root)
 {
-    uint64_t path_len, max_path_len;
-    char* path_ptr;
-    char* mount_path_ptr;
-    vfs_list_entry_t* entry;
-
-    for
-    (
-        entry = vfs_list.head, max_path_len = 0, *vfs_root = NULL;
-        entry != NULL;
-        entry = entry->next
-    )
+    vfs_mount_node_t* node;
+    const char* component;
+    uint64_t length, mount_length;
+
+    /* One step down the trie per component, the deepest mount point on the way wins */
+    *vfs_root = mounts_root.vfs;
+    mount_length = 0;
+    for (node = &mounts_root, component = path; (length = vfs_next_component(&component)) > 0; component += length)
     {
-        for
-        (
-            path_len = 0, mount_path_ptr = (char*) entry->vfs->mount_path, path_ptr = (char*) path;
-            *path_ptr != '\0' && *mount_path_ptr != '\0' && *path_ptr++ == *mount_path_ptr++;
-            path_len++
-        );
-
-        if (path_len > max_path_len && *mount_path_ptr == '\0')
+        node = vfs_find_mount_child(node, component, length);
+        if (node == NULL)
+            break;
+        if (node->vfs != NULL)
         {
-            *vfs_root = entry->vfs;
-            max_path_len = path_len;
+            *vfs_root = node->vfs;
+            mount_length = (uint64_t) (component + length - path);
         }
     }
 
-    return max_path_len;
+    return mount_length;
+}
+
+static int vfs_lookup_component(vnode_t* dir, const char* name, vnode_t* out)
+{
+    vnode_t child;
+
+    switch (dcache_lookup(dir, name, &child))
+    {
+    case DCACHE_HIT:
+        vfs_get(&child);
+        *out = child;
+        return 0;
+    case DCACHE_NEGATIVE:
+        return -1;
+    }
+
+    switch (dir->ops->lookup(dir, name, &child))
+    {
+    case 0:
+        break;
+    case VNODE_LOOKUP_NOT_FOUND:
+        dcache_insert(dir, name, NULL);
+        return -1;
+    default:
+        return -1;
+    }
+    dcache_insert(dir, name, &child);
+    *out = child;
+
+    return 0;
+}
+
+void vfs_get(vnode_t* target)
+{
+    if (target->ops->get != NULL)
+        target->ops->get(target);
+}
+
+void vfs_put(vnode_t* target)
+{
+    if (target->ops->put != NULL)
+        target->ops->put(target);
+}
+
+char vfs_fold_case(char c)
+{
+    return (c >= 'a' && c <= 'z') ? (char) (c - 'a' + 'A') : c;
+}
+
+int vfs_names_equal_nocase(const char* a, const char* b, uint64_t length)
+{
+    for (; length > 0; length--)
+    {
+        if (vfs_fold_case(*a++) != vfs_fold_case(*b++))
+            return 0;
+    }
+    return 1;
 }
 
 int vfs_instance_lookup(vfs_t* vfs, const char* path, vnode_t* out)
 {
-    uint64_t path_length, slash_offset;
+    char name[VFS_NAME_MAX + 1];
+    uint64_t length;
     vnode_t node;
-    char* new_path;
-    char* new_path_ptr;
+    vnode_t child;
     int exit_code;
 
     if (vfs == NULL)
@@ -98,48 +186,47 @@ int vfs_instance_lookup(vfs_t* vfs, const char* path, vnode_t* out)
         return -1;
     }
 
-    if (vfs->ops->root(vfs, &node))
-    {
-        trace_vfs("Failed to retrieve root node for path: %s", path);
-        return -1;
-    }
-    
-    path_length = strlen(path) + 1;
-    if (path_length == 0)
+    node = vfs->root;
+    vfs_get(&node);
+
+    for (exit_code = 0; exit_code == 0 && *path != '\0'; path += length)
     {
-        if (out != NULL)
+        /* Empty components (leading, trailing or repeated slashes) resolve to the directory itself */
+        if (*path == '/')
         {
-            out->ops = node.ops;
-            out->data = node.data;
+            length = 1;
+            continue;
         }
-        return 0;
-    }
-    
-    new_path = malloc(path_length);
-    new_path_ptr = new_path;
-    exit_code = 0;
 
-    memcpy(new_path, path, path_length);
-
-    while (strlen(new_path_ptr) > 0 && exit_code == 0)
-    {
-        slash_offset = strcspn(new_path_ptr + 1, "/") + 1;
-        if (slash_offset != strlen(new_path_ptr))
-            new_path_ptr[slash_offset++] = '\0';
-        exit_code = node.ops->lookup(&node, new_path_ptr, &node);
-        new_path_ptr += slash_offset;
+        length = strcspn(path, "/");
+        if (length > VFS_NAME_MAX)
+        {
+            exit_code = -1;
+            break;
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        exit_code = vfs_lookup_component(&node, name, &child);
+        if (exit_code == 0)
+        {
+            vfs_put(&node);
+            node = child;
+        }
     }
 
     if (exit_code != 0)
+    {
         trace_vfs("Lookup error: %d", (long) exit_code);
-
-    free(new_path);
-    
-    if (out != NULL)
+        vfs_put(&node);
+    }
+    else if (out != NULL)
     {
+        /* The reference is handed over to the caller */
         out->data = node.data;
         out->ops = node.ops;
     }
+    else
+        vfs_put(&node);
 
     return exit_code;
 }
@@ -156,14 +243,14 @@ int vfs_open(vnode_t* target)
     return target->ops->open(target);
 }
 
-int vfs_read(vnode_t* target, void* buffer, uint64_t bytes)
+int64_t vfs_read(vnode_t* target, void* buffer, uint64_t bytes, uint64_t offset)
 {
-    return target->ops->read(target, buffer, bytes);
+    return target->ops->read(target, buffer, bytes, offset);
 }
 
-int vfs_write(vnode_t* target, void* data, uint64_t bytes)
+int64_t vfs_write(vnode_t* target, const void* data, uint64_t bytes, uint64_t offset)
 {
-    return target->ops->write(target, data, bytes);
+    return target->ops->write(target, (const char*) data, bytes, offset);
 }
 
 int vfs_get_attribs(vnode_t* target, vattribs_t* out)
@@ -3,28 +3,32 @@
 
 #include "vnode.h"
 
-struct vfs_ops;
+/* Longest name a single path component can have */
+#define VFS_NAME_MAX 255
 
 typedef struct vfs
 {
-    uint64_t index;
-    struct vfs_ops* ops;
+    /* Set up by the filesystem, the instance holds a reference to it */
+    vnode_t root;
     const char* mount_path;
 } vfs_t;
 
-typedef struct vfs_ops
-{
-    int (*root)(vfs_t* vfs, vnode_t* root);
-} vfs_ops_t;
-
 void vfs_init(void);
 
 int vfs_mount(const char* path, vfs_t* vfs);
+/* Components are resolved through the directory entry cache, out holds a reference to put */
 int vfs_instance_lookup(vfs_t* vfs, const char* path, vnode_t* out);
 int vfs_lookup(const char* path, vnode_t* out);
 int vfs_open(vnode_t* target);
-int vfs_read(vnode_t* target, void* buffer, uint64_t bytes);
-int vfs_write(vnode_t* target, void* data, uint64_t bytes);
+int64_t vfs_read(vnode_t* target, void* buffer, uint64_t bytes, uint64_t offset);
+int64_t vfs_write(vnode_t* target, const void* data, uint64_t bytes, uint64_t offset);
 int vfs_get_attribs(vnode_t* target, vattribs_t* out);
+/* Take another reference to a vnode, or drop one */
+void vfs_get(vnode_t* target);
+void vfs_put(vnode_t* target);
+/* ASCII upper case, for filesystems matching names regardless of case */
+char vfs_fold_case(char c);
+/* Compare length characters of two names regardless of case, 1 if they match */
+int vfs_names_equal_nocase(const char* a, const char* b, uint64_t length);
 
 #endif
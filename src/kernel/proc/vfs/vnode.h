@@ -5,6 +5,9 @@
 
 struct vnode_ops;
 
+/* Returned by lookup when the name doesn't exist, any other failure is -1 and isn't remembered */
+#define VNODE_LOOKUP_NOT_FOUND 1
+
 typedef struct
 {
     struct vnode_ops* ops;
@@ -15,9 +18,13 @@ typedef struct vnode_ops
 {
     int (*open)(vnode_t* this_node);
     int (*lookup)(vnode_t* this_node, const char* path, vnode_t* out);
-    int (*read)(vnode_t* this_node, void* buffer, uint64_t bytes);
-    int (*write)(vnode_t* this_node, const char* data, uint64_t bytes);
+    /* Both return how many bytes were transferred, fewer than asked for past the end of the file */
+    int64_t (*read)(vnode_t* this_node, void* buffer, uint64_t bytes, uint64_t offset);
+    int64_t (*write)(vnode_t* this_node, const char* data, uint64_t bytes, uint64_t offset);
     int (*get_attribs)(vnode_t* this_node, vattribs_t* out);
+    /* Optional, every vnode handed out by lookup or root holds a reference */
+    void (*get)(vnode_t* this_node);
+    void (*put)(vnode_t* this_node);
 } vnode_ops_t;
 
 void vnode_copy(vnode_t* src, vnode_t* dest);
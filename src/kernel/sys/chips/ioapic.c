@@ -0,0 +1,287 @@
+#include "ioapic.h"
+#include "pic.h"
+#include "lapic.h"
+#include "../cpu/isr.h"
+#include "../mem/paging.h"
+#include "../drivers/power/acpi.h"
+#include "../../utils/alloc.h"
+#include "../../utils/log.h"
+#include <stddef.h>
+#include <mem.h>
+
+#define trace_ioapic(msg, ...) trace("IOAP", msg, ##__VA_ARGS__)
+
+#define IOAPIC_MMIO_SIZE SIZE_4KB
+#define IOAPIC_GSI_NONE 0xFFFFFFFF
+
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+
+#define IOAPIC_REG_ID 0x00
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDIRECTION(n) (0x10 + ((n) * 2))
+
+/**
+ *  Bit 16-23 of the version register: Index of the last redirection entry.
+ */
+#define IOAPIC_VERSION_MAX_REDIRECTION(v) (((v) >> 16) & 0xFF)
+
+/**
+ *  Redirection entry (low dword).
+ *  Bit 0-7: Vector.
+ *  Bit 8-10: Delivery mode (000 = Fixed).
+ *  Bit 11: Destination mode (0 = Physical).
+ *  Bit 13: Pin polarity (1 = Active low).
+ *  Bit 15: Trigger mode (1 = Level).
+ *  Bit 16: If 1, the interrupt is masked.
+ *  The high dword holds the destination APIC ID in bits 24-31.
+ */
+#define IOAPIC_REDIRECTION_ACTIVE_LOW (1 << 13)
+#define IOAPIC_REDIRECTION_LEVEL (1 << 15)
+#define IOAPIC_REDIRECTION_MASKED (1 << 16)
+#define IOAPIC_REDIRECTION_DESTINATION(id) (((uint32_t) (id)) << 24)
+
+typedef struct ioapic_list_entry
+{
+    struct ioapic_list_entry* next;
+    uint64_t vaddr;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+    uint8_t id;
+} ioapic_list_entry_t;
+
+typedef struct
+{
+    ioapic_list_entry_t* head;
+    ioapic_list_entry_t* tail;
+} ioapic_list_t;
+
+typedef struct
+{
+    uint32_t gsi;
+    uint16_t flags;
+} ioapic_isa_route_t;
+
+static ioapic_list_t ioapics;
+static ioapic_isa_route_t isa_routes[IRQ_COUNT];
+static uint8_t initialized;
+
+static uint32_t ioapic_read(ioapic_list_entry_t* ioapic, uint8_t reg)
+{
+    *((volatile uint32_t*) (ioapic->vaddr + IOAPIC_REGSEL)) = reg;
+    return *((volatile uint32_t*) (ioapic->vaddr + IOAPIC_WINDOW));
+}
+
+static void ioapic_write(ioapic_list_entry_t* ioapic, uint8_t reg, uint32_t value)
+{
+    *((volatile uint32_t*) (ioapic->vaddr + IOAPIC_REGSEL)) = reg;
+    *((volatile uint32_t*) (ioapic->vaddr + IOAPIC_WINDOW)) = value;
+}
+
+static ioapic_list_entry_t* ioapic_find_by_gsi(uint32_t gsi)
+{
+    ioapic_list_entry_t* entry;
+    if (gsi == IOAPIC_GSI_NONE)
+        return NULL;
+    for (entry = ioapics.head; entry != NULL; entry = entry->next)
+    {
+        if (gsi >= entry->gsi_base && gsi < entry->gsi_base + entry->gsi_count)
+            return entry;
+    }
+    return NULL;
+}
+
+static int ioapic_add(madt_entry_ioapic_t* madt_entry)
+{
+    ioapic_list_entry_t* entry;
+    uint64_t vaddr;
+
+    if (kernel_get_next_vaddr(IOAPIC_MMIO_SIZE, &vaddr) < IOAPIC_MMIO_SIZE)
+        return -1;
+    if 
+    (
+        paging_map_memory(madt_entry->ioapic_address, vaddr, IOAPIC_MMIO_SIZE, PAGE_ACCESS_RW, PL0) < IOAPIC_MMIO_SIZE ||
+        paging_flag_memory_area(vaddr, IOAPIC_MMIO_SIZE, PAGE_FLAG_UNCACHABLE)
+    )
+    {
+        paging_unmap_memory(vaddr, IOAPIC_MMIO_SIZE);
+        return -1;
+    }
+
+    entry = malloc(sizeof(ioapic_list_entry_t));
+    if (entry == NULL)
+    {
+        paging_unmap_memory(vaddr, IOAPIC_MMIO_SIZE);
+        return -1;
+    }
+
+    entry->next = NULL;
+    entry->vaddr = vaddr;
+    entry->id = madt_entry->ioapic_id;
+    entry->gsi_base = madt_entry->gsi_base;
+    entry->gsi_count = IOAPIC_VERSION_MAX_REDIRECTION(ioapic_read(entry, IOAPIC_REG_VERSION)) + 1;
+
+    if (ioapics.tail == NULL)
+        ioapics.head = entry;
+    else
+        ioapics.tail->next = entry;
+    ioapics.tail = entry;
+
+    info("I/O APIC %u mapped at %p handles GSIs %u-%u", entry->id, entry->vaddr, entry->gsi_base, entry->gsi_base + entry->gsi_count - 1);
+
+    return 0;
+}
+
+static int ioapic_parse_madt(madt_t* madt)
+{
+    madt_entry_header_t* header;
+    madt_entry_interrupt_source_override_t* iso;
+    uint64_t offset, length;
+
+    length = madt->sdt_header.length - sizeof(madt_t);
+    for (offset = 0; offset + sizeof(madt_entry_header_t) <= length; offset += header->length)
+    {
+        header = (madt_entry_header_t*) &madt->entries[offset];
+        if (header->length == 0)
+            break;
+
+        switch (header->type)
+        {
+        case MADT_ENTRY_IOAPIC:
+            if (ioapic_add((madt_entry_ioapic_t*) header))
+                trace_ioapic("Could not map I/O APIC %u", ((madt_entry_ioapic_t*) header)->ioapic_id);
+            break;
+        case MADT_ENTRY_INTERRUPT_SOURCE_OVERRIDE:
+            iso = (madt_entry_interrupt_source_override_t*) header;
+            if (iso->irq_source < IRQ_COUNT)
+            {
+                isa_routes[iso->irq_source].gsi = iso->gsi;
+                isa_routes[iso->irq_source].flags = iso->flags;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return (ioapics.head == NULL) ? -1 : 0;
+}
+
+static void ioapic_route_gsi(uint32_t gsi, uint8_t vector, uint16_t flags, uint8_t destination)
+{
+    ioapic_list_entry_t* ioapic;
+    uint32_t low, index;
+
+    ioapic = ioapic_find_by_gsi(gsi);
+    if (ioapic == NULL)
+        return;
+    index = gsi - ioapic->gsi_base;
+
+    /* ISA interrupts are active high and edge triggered unless overridden */
+    low = IOAPIC_REDIRECTION_MASKED | vector;
+    if ((flags & MADT_ISO_POLARITY_MASK) == MADT_ISO_POLARITY_LOW)
+        low |= IOAPIC_REDIRECTION_ACTIVE_LOW;
+    if ((flags & MADT_ISO_TRIGGER_MASK) == MADT_ISO_TRIGGER_LEVEL)
+        low |= IOAPIC_REDIRECTION_LEVEL;
+
+    ioapic_write(ioapic, IOAPIC_REG_REDIRECTION(index), low);
+    ioapic_write(ioapic, IOAPIC_REG_REDIRECTION(index) + 1, IOAPIC_REDIRECTION_DESTINATION(destination));
+}
+
+static void ioapic_set_irq_mask(uint8_t index, uint8_t masked)
+{
+    ioapic_list_entry_t* ioapic;
+    uint32_t low, reg;
+
+    /* Check if the index is absolute or relative to IRQ0 */
+    if (index >= IRQ_COUNT)
+        index -= IRQ(0);
+    if (index >= IRQ_COUNT)
+        return;
+
+    ioapic = ioapic_find_by_gsi(isa_routes[index].gsi);
+    if (ioapic == NULL)
+        return;
+
+    reg = IOAPIC_REG_REDIRECTION(isa_routes[index].gsi - ioapic->gsi_base);
+    low = ioapic_read(ioapic, reg);
+    if (masked)
+        low |= IOAPIC_REDIRECTION_MASKED;
+    else
+        low &= ~IOAPIC_REDIRECTION_MASKED;
+    ioapic_write(ioapic, reg, low);
+}
+
+void ioapic_mask_irq(uint8_t index)
+{
+    ioapic_set_irq_mask(index, 1);
+}
+
+void ioapic_unmask_irq(uint8_t index)
+{
+    ioapic_set_irq_mask(index, 0);
+}
+
+int ioapic_is_initialized(void)
+{
+    return initialized;
+}
+
+int ioapic_init(void)
+{
+    madt_t* madt;
+    uint32_t gsi;
+    uint8_t irq;
+
+    memset(&ioapics, 0, sizeof(ioapic_list_t));
+    initialized = 0;
+
+    if (!lapic_is_initialized())
+    {
+        trace_ioapic("Local APIC not initialized");
+        return -1;
+    }
+
+    madt = (madt_t*) acpi_find_table(MADT_SIG);
+    if (madt == NULL)
+    {
+        trace_ioapic("MADT table not found");
+        return -1;
+    }
+
+    /* Identity map ISA IRQs to GSIs until an override says otherwise */
+    for (irq = 0; irq < IRQ_COUNT; irq++)
+    {
+        isa_routes[irq].gsi = irq;
+        isa_routes[irq].flags = 0;
+    }
+
+    if (ioapic_parse_madt(madt))
+    {
+        trace_ioapic("No usable I/O APIC found");
+        return -1;
+    }
+
+    /* An IRQ redirected onto another ISA line's GSI takes that GSI over (usually IRQ0 -> GSI2) */
+    for (irq = 0; irq < IRQ_COUNT; irq++)
+    {
+        gsi = isa_routes[irq].gsi;
+        if 
+        (
+            gsi != irq && 
+            gsi < IRQ_COUNT && 
+            isa_routes[gsi].gsi == gsi
+        )
+            isa_routes[gsi].gsi = IOAPIC_GSI_NONE;
+    }
+
+    pic_disable();
+    for (irq = 0; irq < IRQ_COUNT; irq++)
+    {
+        if (isa_routes[irq].gsi != IOAPIC_GSI_NONE)
+            ioapic_route_gsi(isa_routes[irq].gsi, IRQ(irq), isa_routes[irq].flags, lapic_get_id());
+    }
+    initialized = 1;
+
+    return 0;
+}
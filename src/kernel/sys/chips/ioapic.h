@@ -0,0 +1,19 @@
+#ifndef __IOAPIC_H__
+#define __IOAPIC_H__
+
+#include <stdint.h>
+
+/**
+ * Find the I/O APICs listed in the MADT, route the ISA IRQs
+ * to vectors IRQ(0)-IRQ(15) (masked) and disable the PIC
+ */
+int ioapic_init(void);
+int ioapic_is_initialized(void);
+
+/**
+ * Mask / unmask an ISA IRQ (index is absolute or relative to IRQ0, like the PIC functions)
+ */
+void ioapic_mask_irq(uint8_t index);
+void ioapic_unmask_irq(uint8_t index);
+
+#endif
@@ -0,0 +1,305 @@
+#include "lapic.h"
+#include "pit.h"
+#include "../cpu/cpu.h"
+#include "../cpu/tsc.h"
+#include "../mem/paging.h"
+#include "../../utils/alloc.h"
+#include "../../utils/log.h"
+#include <stddef.h>
+#include <mem.h>
+
+#define trace_lapic(msg, ...) trace("LAPC", msg, ##__VA_ARGS__)
+
+#define LAPIC_BASE_MASK 0xFFFFFFFFFF000
+#define LAPIC_BASE_ENABLE (1 << 11)
+#define LAPIC_MMIO_SIZE SIZE_4KB
+
+#define LAPIC_REG_ID 0x020
+#define LAPIC_REG_EOI 0x0B0
+#define LAPIC_REG_SPURIOUS 0x0F0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3E0
+
+/**
+ *  Spurious interrupt vector register.
+ *  Bit 0-7: Vector delivered for spurious interrupts.
+ *  Bit 8: If 1, the local APIC is software enabled.
+ */
+#define LAPIC_SPURIOUS_ENABLE (1 << 8)
+
+/**
+ *  LVT timer register.
+ *  Bit 0-7: Vector delivered when the timer fires.
+ *  Bit 16: If 1, the interrupt is masked.
+ *  Bit 17-18: Timer mode (00 = One-shot, 01 = Periodic, 10 = TSC-deadline).
+ */
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_TIMER_ONESHOT (0b00 << 17)
+#define LAPIC_LVT_TIMER_TSC_DEADLINE (0b10 << 17)
+
+/**
+ *  Divide configuration register.
+ *  Bit 0-1, 3: Divide value (0011 = Divide by 16).
+ */
+#define LAPIC_TIMER_DIVIDE_16 0b0011
+
+/**
+ *  Interrupt command register (low dword).
+ *  Bit 0-7: Vector (page number for startup IPIs).
+ *  Bit 8-10: Delivery mode (000 = Fixed, 101 = INIT, 110 = Startup).
+ *  Bit 12: Delivery status, 1 while the IPI is pending.
+ *  Bit 14: Level (1 = Assert).
+ *  The high dword holds the destination APIC ID in bits 24-31.
+ */
+#define LAPIC_ICR_FIXED (0b000 << 8)
+#define LAPIC_ICR_INIT (0b101 << 8)
+#define LAPIC_ICR_STARTUP (0b110 << 8)
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+#define LAPIC_ICR_DESTINATION(id) (((uint32_t) (id)) << 24)
+
+#define LAPIC_CALIBRATION_NS 10000000
+#define LAPIC_MAX_COUNT 0xFFFFFFFF
+#define LAPIC_SCALE_SHIFT 24
+
+typedef struct lapic_callback
+{
+    struct lapic_callback* next;
+    isr_handler_t handler;
+} lapic_callback_list_entry_t;
+
+typedef struct
+{
+    lapic_callback_list_entry_t* head;
+    lapic_callback_list_entry_t* tail;
+} lapic_callback_list_t;
+
+static lapic_callback_list_t callbacks;
+static uint64_t lapic_vaddr;
+static uint64_t ticks_per_ns_scaled;
+static uint8_t tsc_deadline;
+
+static inline uint32_t lapic_read(uint64_t reg)
+{
+    return *((volatile uint32_t*) (lapic_vaddr + reg));
+}
+
+static inline void lapic_write(uint64_t reg, uint32_t value)
+{
+    *((volatile uint32_t*) (lapic_vaddr + reg)) = value;
+}
+
+static void lapic_timer_handler(const interrupt_frame_t* frame)
+{
+    lapic_callback_list_entry_t* callback;
+    callback = callbacks.head;
+    while (callback != NULL)
+    {
+        if (callback->handler != NULL)
+            callback->handler(frame);
+        callback = callback->next;
+    }
+}
+
+static void lapic_spurious_handler(const interrupt_frame_t* frame)
+{
+    /* Spurious interrupts must not be acknowledged */
+}
+
+int lapic_register_callback(isr_handler_t handler)
+{
+    lapic_callback_list_entry_t* callback;
+
+    callback = malloc(sizeof(lapic_callback_list_entry_t));
+    if (callback == NULL)
+    {
+        trace_lapic("Could not register callback");
+        return -1;
+    }
+
+    callback->handler = handler;
+    callback->next = NULL;
+
+    if (callbacks.tail == NULL)
+        callbacks.head = callback;
+    else
+        callbacks.tail->next = callback;
+    callbacks.tail = callback;
+
+    return 0;
+}
+
+void lapic_set_oneshot(uint64_t ns)
+{
+    unsigned __int128 ticks;
+
+    if (tsc_deadline)
+    {
+        ticks = tsc_ns_to_ticks(ns);
+        cpu_write_msr(MSR_TSC_DEADLINE, cpu_read_tsc() + ((ticks == 0) ? 1 : (uint64_t) ticks));
+        return;
+    }
+
+    ticks = (((unsigned __int128) ns) * ticks_per_ns_scaled) >> LAPIC_SCALE_SHIFT;
+    if (ticks == 0)
+        ticks = 1;
+    else if (ticks > LAPIC_MAX_COUNT)
+        ticks = LAPIC_MAX_COUNT;
+    lapic_write(LAPIC_REG_TIMER_INITIAL, (uint32_t) ticks);
+}
+
+void lapic_stop(void)
+{
+    if (tsc_deadline)
+        cpu_write_msr(MSR_TSC_DEADLINE, 0);
+    else
+        lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+}
+
+void lapic_acknowledge(void)
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+uint8_t lapic_get_id(void)
+{
+    return (uint8_t) (lapic_read(LAPIC_REG_ID) >> 24);
+}
+
+int lapic_is_initialized(void)
+{
+    return (lapic_vaddr != 0);
+}
+
+static int lapic_map(uint64_t lapic_paddr)
+{
+    uint64_t vaddr;
+
+    if (kernel_get_next_vaddr(LAPIC_MMIO_SIZE, &vaddr) < LAPIC_MMIO_SIZE)
+        return -1;
+    if 
+    (
+        paging_map_memory(lapic_paddr, vaddr, LAPIC_MMIO_SIZE, PAGE_ACCESS_RW, PL0) < LAPIC_MMIO_SIZE ||
+        paging_flag_memory_area(vaddr, LAPIC_MMIO_SIZE, PAGE_FLAG_UNCACHABLE)
+    )
+    {
+        paging_unmap_memory(vaddr, LAPIC_MMIO_SIZE);
+        return -1;
+    }
+
+    lapic_vaddr = vaddr;
+    return 0;
+}
+
+static void lapic_send_command(uint8_t apic_id, uint32_t command)
+{
+    lapic_write(LAPIC_REG_ICR_HIGH, LAPIC_ICR_DESTINATION(apic_id));
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        __asm__ volatile ("pause");
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+    lapic_send_command(apic_id, LAPIC_ICR_FIXED | LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_send_init(uint8_t apic_id)
+{
+    lapic_send_command(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint8_t apic_id, uint64_t entry_paddr)
+{
+    lapic_send_command(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | ((entry_paddr >> 12) & 0xFF));
+}
+
+static void lapic_enable(void)
+{
+    cpu_write_msr(MSR_APIC_BASE, cpu_read_msr(MSR_APIC_BASE) | LAPIC_BASE_ENABLE);
+    lapic_write(LAPIC_REG_SPURIOUS, LAPIC_SPURIOUS_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+}
+
+static void lapic_enable_timer(void)
+{
+    if (tsc_deadline)
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+    else
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+}
+
+void lapic_init_ap(void)
+{
+    lapic_enable();
+    lapic_enable_timer();
+}
+
+static void lapic_calibrate(void)
+{
+    uint64_t ticks_per_second;
+    uint32_t remaining;
+
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, LAPIC_MAX_COUNT);
+    pit_wait(LAPIC_CALIBRATION_NS);
+    remaining = lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+
+    ticks_per_second = ((uint64_t) (LAPIC_MAX_COUNT - remaining) * NS_PER_SECOND) / LAPIC_CALIBRATION_NS;
+    ticks_per_ns_scaled = (ticks_per_second << LAPIC_SCALE_SHIFT) / NS_PER_SECOND;
+}
+
+int lapic_init(void)
+{
+    cpuid_regs_t regs;
+    uint64_t base;
+
+    memset(&callbacks, 0, sizeof(lapic_callback_list_t));
+    lapic_vaddr = 0;
+
+    cpu_cpuid(CPUID_LEAF_FEATURES, 0, &regs);
+    if (!(regs.edx & CPUID_FEATURES_EDX_APIC) || !(regs.edx & CPUID_FEATURES_EDX_MSR))
+    {
+        trace_lapic("Local APIC not supported");
+        return -1;
+    }
+    tsc_deadline = ((regs.ecx & CPUID_FEATURES_ECX_TSC_DEADLINE) && tsc_get_frequency() != 0);
+
+    base = cpu_read_msr(MSR_APIC_BASE);
+    if (lapic_map(base & LAPIC_BASE_MASK))
+    {
+        trace_lapic("Could not map local APIC registers");
+        return -1;
+    }
+
+    lapic_enable();
+    isr_register_handler(LAPIC_SPURIOUS_VECTOR, &lapic_spurious_handler);
+
+    if (!tsc_deadline)
+    {
+        lapic_calibrate();
+        if (ticks_per_ns_scaled == 0)
+        {
+            trace_lapic("Could not calibrate local APIC timer");
+            paging_unmap_memory(lapic_vaddr, LAPIC_MMIO_SIZE);
+            lapic_vaddr = 0;
+            return -1;
+        }
+    }
+    lapic_enable_timer();
+    isr_register_handler(LAPIC_TIMER_VECTOR, &lapic_timer_handler);
+
+    info
+    (
+        "Local APIC %u timer running in %s mode",
+        lapic_get_id(),
+        (tsc_deadline) ? "TSC-deadline" : "one-shot"
+    );
+
+    return 0;
+}
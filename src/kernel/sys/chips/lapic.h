@@ -0,0 +1,44 @@
+#ifndef __LAPIC_H__
+#define __LAPIC_H__
+
+#include "../cpu/isr.h"
+#include <stdint.h>
+
+#define LAPIC_TIMER_VECTOR IRQ(16)
+#define LAPIC_IPI_VECTOR IRQ(30)
+#define LAPIC_SPURIOUS_VECTOR IRQ(31)
+
+/**
+ * Enable the local APIC of this CPU and calibrate its timer
+ */
+int lapic_init(void);
+
+/**
+ * Enable the local APIC of an application processor, reusing the boot CPU's calibration
+ */
+void lapic_init_ap(void);
+int lapic_is_initialized(void);
+uint8_t lapic_get_id(void);
+int lapic_register_callback(isr_handler_t handler);
+
+/**
+ * Arm the local APIC timer to fire a single interrupt after the given amount of nanoseconds
+ * (uses TSC-deadline mode when the CPU supports it)
+ */
+void lapic_set_oneshot(uint64_t ns);
+
+/**
+ * Disarm the local APIC timer
+ */
+void lapic_stop(void);
+
+/**
+ * Signal end of interrupt to the local APIC
+ */
+void lapic_acknowledge(void);
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uint64_t entry_paddr);
+
+#endif
@@ -127,6 +127,13 @@ void pic_init(void)
     port_out(PIC2_DATA, 0b11111111);
 }
 
+void pic_disable(void)
+{
+    port_out(PIC1_DATA, 0xFF);
+    port_wait();
+    port_out(PIC2_DATA, 0xFF);
+}
+
 void pic_mask_irq(uint8_t index)
 {
     uint8_t pic_mask, pic_port, bit_mask;
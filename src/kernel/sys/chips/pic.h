@@ -15,6 +15,11 @@ void pic_init(void);
  */
 void pic_acknowledge(uint8_t int_num);
 
+/**
+ * Mask every line of both PICs (once the I/O APIC takes over)
+ */
+void pic_disable(void);
+
 void pic_mask_irq(uint8_t index);
 void pic_unmask_irq(uint8_t index);
 void pic_toggle_irq(uint8_t index);
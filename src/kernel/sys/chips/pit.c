@@ -14,7 +14,30 @@
 #define PIT_CH2 0x42
 #define PIT_COMM 0x43
 
-#define PIT_CONFIG 0b00110110
+/**
+ *  Bit 0: If 1, the counter counts in BCD, otherwise in binary.
+ *  Bit 1-3: Operating mode (000 = Interrupt on terminal count).
+ *  Bit 4-5: Access mode (11 = Low byte then high byte).
+ *  Bit 6-7: Channel select (00 = Channel 0).
+ *  Writing this word also stops channel 0 until a new count is loaded.
+ */
+#define PIT_CONFIG_ONESHOT 0b00110000
+
+/**
+ *  Read-back command.
+ *  Bit 1: Select channel 0.
+ *  Bit 4: If 0, latch the status byte.
+ *  Bit 5: If 1, don't latch the count.
+ *  Bit 6-7: Must be 11.
+ *  Bit 7 of the status byte is the state of the channel's output pin,
+ *  which goes high once the terminal count is reached in mode 0.
+ */
+#define PIT_READBACK_STATUS_CH0 0b11100010
+#define PIT_STATUS_OUTPUT (1 << 7)
+
+#define PIT_MAX_COUNT 0xFFFF
+#define PIT_MAX_NS 60000000
+#define PIT_NS_TO_TICKS(ns) (((ns) * PIT_BASE_FREQUENCY) / 1000000000)
 
 typedef struct pit_callback
 {
@@ -65,23 +88,37 @@ int pit_register_callback(isr_handler_t handler)
     return 0;
 }
 
-void pit_set_interval(uint64_t interval)
+void pit_set_oneshot(uint64_t ns)
+{
+    uint64_t ticks;
+
+    ticks = (ns >= PIT_MAX_NS) ? PIT_MAX_COUNT : PIT_NS_TO_TICKS(ns);
+    if (ticks == 0)
+        ticks = 1;
+    else if (ticks > PIT_MAX_COUNT)
+        ticks = PIT_MAX_COUNT;
+
+    port_out(PIT_COMM, PIT_CONFIG_ONESHOT);
+    port_out(PIT_CH0, (uint8_t) ticks);
+    port_out(PIT_CH0, (uint8_t) (ticks >> 8));
+}
+
+void pit_stop(void)
+{
+    port_out(PIT_COMM, PIT_CONFIG_ONESHOT);
+}
+
+void pit_wait(uint64_t ns)
 {
-    uint64_t frequency;
-    uint16_t divider;
-    
-    frequency = 1000 / interval;
-    divider = (uint16_t) (PIT_BASE_FREQUENCY / frequency);
-    port_out(PIT_CH0, (uint8_t) divider);
-    port_wait();
-    port_out(PIT_CH0, (uint8_t) (divider >> 8));
-    port_wait();
+    pit_set_oneshot(ns);
+    do {
+        port_out(PIT_COMM, PIT_READBACK_STATUS_CH0);
+    } while (!(port_in(PIT_CH0) & PIT_STATUS_OUTPUT));
 }
 
 void pit_init(void)
 {
-    memset(&callbacks, 0, sizeof(pit_callback_list_t));   
-    port_out(PIT_COMM, PIT_CONFIG);
-    port_wait();
+    memset(&callbacks, 0, sizeof(pit_callback_list_t));
+    pit_stop();
     isr_register_handler(IRQ(0), &pit_handler);
 }
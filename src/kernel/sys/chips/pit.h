@@ -4,7 +4,23 @@
 #include "../cpu/isr.h"
 
 int pit_register_callback(isr_handler_t handler);
-void pit_set_interval(uint64_t interval);
+
+/**
+ * Arm channel 0 to fire a single IRQ0 after the given amount of nanoseconds
+ * (capped to the 16-bit counter range, roughly 54ms)
+ */
+void pit_set_oneshot(uint64_t ns);
+
+/**
+ * Disarm channel 0, no further IRQ0 is raised until it is armed again
+ */
+void pit_stop(void);
+
+/**
+ * Busy wait on channel 0 for the given amount of nanoseconds (used for calibration)
+ */
+void pit_wait(uint64_t ns);
+
 void pit_init(void);
 
 #endif
@@ -0,0 +1,99 @@
+[bits 64]
+
+[section .text]
+
+
+; cpu_cpuid -> Execute CPUID
+; args -> EDI the leaf
+;         ESI the subleaf
+;         RDX pointer to the output registers struct
+[global cpu_cpuid]
+cpu_cpuid:
+    push rbx ; RBX is callee saved
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8 + 4*0], eax
+    mov [r8 + 4*1], ebx
+    mov [r8 + 4*2], ecx
+    mov [r8 + 4*3], edx
+    pop rbx
+    ret
+
+; cpu_read_msr -> Read a model specific register
+; args -> EDI the MSR selector
+[global cpu_read_msr]
+cpu_read_msr:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+; cpu_write_msr -> Write a model specific register
+; args -> EDI the MSR selector
+;         RSI the value
+[global cpu_write_msr]
+cpu_write_msr:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
+; cpu_read_tsc -> Read the time stamp counter
+[global cpu_read_tsc]
+cpu_read_tsc:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+; cpu_read_cr0 -> Read control register 0
+[global cpu_read_cr0]
+cpu_read_cr0:
+    mov rax, cr0
+    ret
+
+; cpu_read_cr4 -> Read control register 4
+[global cpu_read_cr4]
+cpu_read_cr4:
+    mov rax, cr4
+    ret
+
+; cpu_write_cr0 -> Write control register 0
+; args -> RDI the value
+[global cpu_write_cr0]
+cpu_write_cr0:
+    mov cr0, rdi
+    ret
+
+; cpu_write_cr4 -> Write control register 4
+; args -> RDI the value
+[global cpu_write_cr4]
+cpu_write_cr4:
+    mov cr4, rdi
+    ret
+
+; cpu_write_xcr0 -> Write the extended control register 0
+; args -> RDI the value
+[global cpu_write_xcr0]
+cpu_write_xcr0:
+    xor ecx, ecx
+    mov eax, edi
+    mov rdx, rdi
+    shr rdx, 32
+    xsetbv
+    ret
+
+; cpu_run_on_stack -> Switch stack and call a function that never returns
+; args -> RDI the new stack pointer
+;         RSI the function
+[global cpu_run_on_stack]
+cpu_run_on_stack:
+    mov rsp, rdi
+    mov rbp, rsp
+    call rsi
+    jmp $
@@ -0,0 +1,53 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <stdint.h>
+
+#define CPUID_LEAF_FEATURES 0x00000001
+#define CPUID_LEAF_XSAVE 0x0000000D
+#define CPUID_LEAF_TSC 0x00000015
+#define CPUID_LEAF_EXT_MAX 0x80000000
+#define CPUID_LEAF_EXT_POWER 0x80000007
+
+#define CPUID_FEATURES_EDX_TSC (1 << 4)
+#define CPUID_FEATURES_EDX_MSR (1 << 5)
+#define CPUID_FEATURES_EDX_APIC (1 << 9)
+#define CPUID_FEATURES_ECX_TSC_DEADLINE (1 << 24)
+#define CPUID_FEATURES_ECX_XSAVE (1 << 26)
+#define CPUID_FEATURES_ECX_AVX (1 << 28)
+#define CPUID_XSAVE_EAX_XSAVEOPT (1 << 0)
+#define CPUID_XSAVE_EAX_XSAVES (1 << 3)
+#define CPUID_EXT_POWER_EDX_INVARIANT_TSC (1 << 8)
+
+#define MSR_APIC_BASE 0x0000001B
+#define MSR_TSC_DEADLINE 0x000006E0
+#define MSR_XSS 0x00000DA0
+#define MSR_EFER 0xC0000080
+#define MSR_FS_BASE 0xC0000100
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+typedef struct
+{
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} cpuid_regs_t;
+
+extern void cpu_cpuid(uint32_t leaf, uint32_t subleaf, cpuid_regs_t* out);
+extern uint64_t cpu_read_msr(uint32_t msr);
+extern void cpu_write_msr(uint32_t msr, uint64_t value);
+extern uint64_t cpu_read_tsc(void);
+extern uint64_t cpu_read_cr0(void);
+extern uint64_t cpu_read_cr4(void);
+extern void cpu_write_cr0(uint64_t value);
+extern void cpu_write_cr4(uint64_t value);
+extern void cpu_write_xcr0(uint64_t value);
+
+/**
+ * Switch to the given stack and call the function, which must not return
+ */
+extern void cpu_run_on_stack(uint64_t stack, void (*function)(void));
+
+#endif
@@ -0,0 +1,81 @@
+[bits 64]
+
+[section .text]
+
+; Every function takes the save area in RDI. The XSAVE family
+; saves every component enabled in XCR0 (EDX:EAX is all ones)
+
+; fpu_fxsave -> Save the x87/SSE state in the legacy format
+[global fpu_fxsave]
+fpu_fxsave:
+    fxsave [rdi]
+    ret
+
+; fpu_fxrstor -> Restore the x87/SSE state from the legacy format
+[global fpu_fxrstor]
+fpu_fxrstor:
+    fxrstor [rdi]
+    ret
+
+; fpu_xsave -> Save the extended state
+[global fpu_xsave]
+fpu_xsave:
+    mov eax, 0xFFFFFFFF
+    mov edx, eax
+    xsave [rdi]
+    ret
+
+; fpu_xsaveopt -> Save the extended state, skipping unmodified components
+[global fpu_xsaveopt]
+fpu_xsaveopt:
+    mov eax, 0xFFFFFFFF
+    mov edx, eax
+    xsaveopt [rdi]
+    ret
+
+; fpu_xsaves -> Save the extended state in the compacted format
+[global fpu_xsaves]
+fpu_xsaves:
+    mov eax, 0xFFFFFFFF
+    mov edx, eax
+    xsaves [rdi]
+    ret
+
+; fpu_xrstor -> Restore the extended state
+[global fpu_xrstor]
+fpu_xrstor:
+    mov eax, 0xFFFFFFFF
+    mov edx, eax
+    xrstor [rdi]
+    ret
+
+; fpu_xrstors -> Restore the extended state from the compacted format
+[global fpu_xrstors]
+fpu_xrstors:
+    mov eax, 0xFFFFFFFF
+    mov edx, eax
+    xrstors [rdi]
+    ret
+
+; fpu_reset -> Put the x87 and SSE units in their initial state
+[global fpu_reset]
+fpu_reset:
+    fninit
+    push qword 0x1F80 ; Default MXCSR, all exceptions masked
+    ldmxcsr [rsp]
+    add rsp, 8
+    ret
+
+; fpu_clts -> Clear CR0.TS, FPU instructions stop trapping
+[global fpu_clts]
+fpu_clts:
+    clts
+    ret
+
+; fpu_stts -> Set CR0.TS, the next FPU instruction raises #NM
+[global fpu_stts]
+fpu_stts:
+    mov rax, cr0
+    or rax, 1 << 3
+    mov cr0, rax
+    ret
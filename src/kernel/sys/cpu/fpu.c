@@ -0,0 +1,276 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "isr.h"
+#include "percpu.h"
+#include "../../proc/process.h"
+#include "../../utils/alloc.h"
+#include "../../utils/panic.h"
+#include "../../utils/log.h"
+#include <stddef.h>
+#include <mem.h>
+
+#define trace_fpu(msg, ...) trace("FPUS", msg, ##__VA_ARGS__)
+
+#define FPU_STATE_ALIGN 64
+#define FPU_FXSAVE_SIZE 512
+
+/**
+ *  Offset 0: x87 control word (FCW), 0x037F after FNINIT.
+ *  Offset 24: MXCSR, 0x1F80 masks every SIMD exception.
+ *  Offset 520: XCOMP_BV of the XSAVE header, bit 63 marks the compacted format.
+ */
+#define FPU_AREA_FCW 0
+#define FPU_AREA_MXCSR 24
+#define FPU_AREA_XCOMP_BV 520
+#define FPU_DEFAULT_FCW 0x037F
+#define FPU_DEFAULT_MXCSR 0x1F80
+#define FPU_XCOMP_BV_COMPACTED (1ULL << 63)
+
+/**
+ *  CR0 bit 1 (MP): WAIT/FWAIT honor CR0.TS.
+ *  CR0 bit 2 (EM): No x87 present, FPU instructions raise #UD.
+ */
+#define FPU_CR0_MP (1 << 1)
+#define FPU_CR0_EM (1 << 2)
+
+/**
+ *  CR4 bit 9 (OSFXSR): FXSAVE/FXRSTOR and SSE are enabled.
+ *  CR4 bit 10 (OSXMMEXCPT): SIMD exceptions are reported as #XF.
+ *  CR4 bit 18 (OSXSAVE): XSAVE and XCR0 are enabled.
+ */
+#define FPU_CR4_OSFXSR (1 << 9)
+#define FPU_CR4_OSXMMEXCPT (1 << 10)
+#define FPU_CR4_OSXSAVE (1 << 18)
+
+/**
+ *  XCR0 bit 0: x87 state (must be set).
+ *  XCR0 bit 1: SSE state.
+ *  XCR0 bit 2: AVX state.
+ */
+#define FPU_XCR0_X87 (1 << 0)
+#define FPU_XCR0_SSE (1 << 1)
+#define FPU_XCR0_AVX (1 << 2)
+
+typedef enum
+{
+    FPU_SAVE_FXSAVE,
+    FPU_SAVE_XSAVE,
+    FPU_SAVE_XSAVEOPT,
+    FPU_SAVE_XSAVES
+} fpu_save_mode_t;
+
+extern void fpu_fxsave(void* area);
+extern void fpu_fxrstor(void* area);
+extern void fpu_xsave(void* area);
+extern void fpu_xsaveopt(void* area);
+extern void fpu_xsaves(void* area);
+extern void fpu_xrstor(void* area);
+extern void fpu_xrstors(void* area);
+extern void fpu_reset(void);
+extern void fpu_clts(void);
+extern void fpu_stts(void);
+
+static fpu_save_mode_t save_mode;
+static uint64_t state_size;
+static uint64_t xcr0;
+static uint8_t detected;
+
+static void fpu_save(void* area)
+{
+    switch (save_mode)
+    {
+    case FPU_SAVE_XSAVES:
+        fpu_xsaves(area);
+        break;
+    case FPU_SAVE_XSAVEOPT:
+        fpu_xsaveopt(area);
+        break;
+    case FPU_SAVE_XSAVE:
+        fpu_xsave(area);
+        break;
+    default:
+        fpu_fxsave(area);
+        break;
+    }
+}
+
+static void fpu_restore(void* area)
+{
+    switch (save_mode)
+    {
+    case FPU_SAVE_XSAVES:
+        fpu_xrstors(area);
+        break;
+    case FPU_SAVE_XSAVEOPT:
+    case FPU_SAVE_XSAVE:
+        fpu_xrstor(area);
+        break;
+    default:
+        fpu_fxrstor(area);
+        break;
+    }
+}
+
+static void* fpu_allocate_state(void)
+{
+    void* area;
+
+    area = aligned_alloc(FPU_STATE_ALIGN, state_size);
+    if (area == NULL)
+        return NULL;
+    /**
+     * An empty XSTATE_BV puts every component in its initial state on XRSTOR,
+     * the legacy fields cover FXRSTOR and the MXCSR load done by XRSTOR
+     */
+    memset(area, 0, state_size);
+    *((uint16_t*) ((uint8_t*) area + FPU_AREA_FCW)) = FPU_DEFAULT_FCW;
+    *((uint32_t*) ((uint8_t*) area + FPU_AREA_MXCSR)) = FPU_DEFAULT_MXCSR;
+    if (save_mode == FPU_SAVE_XSAVES)
+        *((uint64_t*) ((uint8_t*) area + FPU_AREA_XCOMP_BV)) = FPU_XCOMP_BV_COMPACTED;
+    return area;
+}
+
+static void fpu_handle_nm(const interrupt_frame_t* int_frame)
+{
+    percpu_t* cpu;
+    thread_t* th;
+
+    cpu = percpu_get();
+    th = cpu->current;
+    fpu_clts();
+
+    if (cpu->fpu_owner == th)
+        return;
+
+    if (cpu->fpu_owner != NULL)
+        fpu_save(cpu->fpu_owner->fpu_state);
+    cpu->fpu_owner = NULL;
+
+    if (th == NULL)
+    {
+        fpu_reset();
+        return;
+    }
+
+    if (th->fpu_state != NULL)
+        fpu_restore(th->fpu_state);
+    else
+    {
+        /* First time this thread touches the FPU, the clean image wipes what the last owner left in the registers */
+        th->fpu_state = fpu_allocate_state();
+        if (th->fpu_state == NULL)
+            panic(int_frame, "Could not allocate FPU state (tid: %u)", th->tid);
+        fpu_restore(th->fpu_state);
+    }
+    cpu->fpu_owner = th;
+}
+
+static void fpu_detect(void)
+{
+    cpuid_regs_t regs;
+
+    save_mode = FPU_SAVE_FXSAVE;
+    xcr0 = 0;
+
+    cpu_cpuid(CPUID_LEAF_FEATURES, 0, &regs);
+    if (!(regs.ecx & CPUID_FEATURES_ECX_XSAVE))
+        return;
+
+    save_mode = FPU_SAVE_XSAVE;
+    xcr0 = FPU_XCR0_X87 | FPU_XCR0_SSE;
+    if (regs.ecx & CPUID_FEATURES_ECX_AVX)
+        xcr0 |= FPU_XCR0_AVX;
+
+    cpu_cpuid(CPUID_LEAF_XSAVE, 1, &regs);
+    if (regs.eax & CPUID_XSAVE_EAX_XSAVES)
+        save_mode = FPU_SAVE_XSAVES;
+    else if (regs.eax & CPUID_XSAVE_EAX_XSAVEOPT)
+        save_mode = FPU_SAVE_XSAVEOPT;
+}
+
+static uint64_t fpu_get_state_size(void)
+{
+    cpuid_regs_t regs;
+
+    if (save_mode == FPU_SAVE_FXSAVE)
+        return FPU_FXSAVE_SIZE;
+
+    /* EBX holds the size needed for the features currently enabled (XCR0 | XSS for XSAVES) */
+    cpu_cpuid(CPUID_LEAF_XSAVE, (save_mode == FPU_SAVE_XSAVES) ? 1 : 0, &regs);
+    return regs.ebx;
+}
+
+void fpu_init(void)
+{
+    if (!detected)
+        fpu_detect();
+
+    cpu_write_cr0((cpu_read_cr0() & ~FPU_CR0_EM) | FPU_CR0_MP);
+    cpu_write_cr4(cpu_read_cr4() | FPU_CR4_OSFXSR | FPU_CR4_OSXMMEXCPT | ((save_mode != FPU_SAVE_FXSAVE) ? FPU_CR4_OSXSAVE : 0));
+    if (save_mode != FPU_SAVE_FXSAVE)
+        cpu_write_xcr0(xcr0);
+    /* No supervisor state components are used */
+    if (save_mode == FPU_SAVE_XSAVES)
+        cpu_write_msr(MSR_XSS, 0);
+
+    fpu_reset();
+    percpu_get()->fpu_owner = NULL;
+    fpu_stts();
+
+    if (!detected)
+    {
+        state_size = fpu_get_state_size();
+        isr_register_handler(EXCEPTION_NM, &fpu_handle_nm);
+        detected = 1;
+        trace_fpu("Saving %u bytes of FPU state with mode %u", state_size, save_mode);
+    }
+}
+
+void fpu_switch(struct thread* th)
+{
+    if (percpu_get()->fpu_owner == th)
+        fpu_clts();
+    else
+        fpu_stts();
+}
+
+int fpu_copy_state(struct thread* dst, struct thread* src)
+{
+    if (src->fpu_state == NULL)
+        return 0;
+
+    dst->fpu_state = fpu_allocate_state();
+    if (dst->fpu_state == NULL)
+        return -1;
+
+    /* The registers are newer than the saved copy while the parent owns them */
+    if (percpu_get()->fpu_owner == src)
+    {
+        fpu_clts();
+        fpu_save(src->fpu_state);
+        if (percpu_get()->current != src)
+            fpu_stts();
+    }
+    memcpy(dst->fpu_state, src->fpu_state, state_size);
+
+    return 0;
+}
+
+void fpu_release(struct thread* th)
+{
+    uint64_t i;
+    percpu_t* cpu;
+
+    for (i = 0; i < percpu_get_count(); i++)
+    {
+        cpu = percpu_get_by_id(i);
+        if (cpu->fpu_owner == th)
+            cpu->fpu_owner = NULL;
+    }
+
+    if (th->fpu_state != NULL)
+    {
+        free(th->fpu_state);
+        th->fpu_state = NULL;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef __FPU_H__
+#define __FPU_H__
+
+#include <stdint.h>
+
+struct thread;
+
+/**
+ * Enable the FPU and SSE (through XSAVE if present) on the calling CPU.
+ * A thread's state is only loaded once it actually touches the FPU.
+ */
+void fpu_init(void);
+
+/**
+ * Call when switching to a thread, its first FPU instruction
+ * traps unless its state is still loaded on this CPU
+ */
+void fpu_switch(struct thread* th);
+
+/**
+ * Give the child of a fork a copy of the forking thread's FPU state
+ */
+int fpu_copy_state(struct thread* dst, struct thread* src);
+
+/**
+ * Forget about a thread's FPU state and free it
+ */
+void fpu_release(struct thread* th);
+
+#endif
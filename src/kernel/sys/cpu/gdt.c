@@ -1,9 +1,10 @@
 #include "gdt.h"
 #include "tss.h"
+#include "percpu.h"
 #include "../../headers/constants.h"
 #include <mem.h>
 
-#define GDT_NUM_TSS_ENTRIES 1
+#define GDT_NUM_TSS_ENTRIES PERCPU_MAX_CPUS
 #define GDT_NUM_STD_ENTRIES 5
 #define GDT_NUM_ENTRIES (GDT_NUM_STD_ENTRIES + GDT_NUM_TSS_ENTRIES * 2)
 
@@ -40,7 +41,6 @@ __attribute__((aligned(SIZE_4KB))) gdt_descriptor_t gdt_descriptor;
 
 static uint16_t kernel_cs, kernel_ds;
 static uint16_t user_cs, user_ds;
-static uint16_t tss_ss;
 
 extern void gdt_load(uint64_t gdt_descriptor_addr, uint16_t kernel_cs, uint16_t kernel_ds);
 
@@ -121,22 +121,30 @@ static uint16_t gdt_create_tss_entry(uint16_t index, uint64_t addr)
 
 void gdt_init(void)
 {
-    uint64_t tss_addr;
-    
-    tss_addr = (uint64_t) tss_get();
-
     gdt_create_entry(0, 0x00000000, 0x00000000, PL0, GDT_SEG_NULL);
     kernel_cs = gdt_create_entry(1, 0x00000000, 0xFFFFFFFF, PL0, GDT_SEG_CODE);
     kernel_ds = gdt_create_entry(2, 0x00000000, 0xFFFFFFFF, PL0, GDT_SEG_DATA);
     user_cs = gdt_create_entry(4, 0x00000000, 0xFFFFFFFF, PL3, GDT_SEG_CODE);
     user_ds = gdt_create_entry(3, 0x00000000, 0xFFFFFFFF, PL3, GDT_SEG_DATA);
-    tss_ss = gdt_create_tss_entry(5, tss_addr);
 
     gdt_descriptor.size = (GDT_NUM_ENTRIES * sizeof(gdt_entry_t)) - 1;
     gdt_descriptor.addr = (uint64_t) &gdt;
 
+    gdt_reload();
+}
+
+void gdt_reload(void)
+{
     gdt_load((uint64_t) &gdt_descriptor, kernel_cs, kernel_ds);
+}
+
+uint16_t gdt_load_tss(uint64_t cpu_id, tss_t* tss)
+{
+    uint16_t tss_ss;
+    /* Every CPU gets its own descriptor, since LTR marks it busy */
+    tss_ss = gdt_create_tss_entry(GDT_NUM_STD_ENTRIES + (cpu_id * 2), (uint64_t) tss);
     tss_load(tss_ss);
+    return tss_ss;
 }
 
 uint16_t gdt_get_kernel_cs(void)
@@ -159,11 +167,6 @@ uint16_t gdt_get_user_ds(void)
     return user_ds;
 }
 
-uint16_t gdt_get_tss_ss(void)
-{
-    return tss_ss;
-}
-
 gdt_descriptor_t* gdt_get_descriptor(void)
 {
     return &gdt_descriptor;
@@ -1,6 +1,7 @@
 #ifndef __GDT_H__
 #define __GDT_H__
 
+#include "tss.h"
 #include <stdint.h>
 
 struct gdt_descriptor 
@@ -11,11 +12,20 @@ struct gdt_descriptor
 typedef struct gdt_descriptor gdt_descriptor_t;
 
 void gdt_init(void);
+
+/**
+ * Load the GDT and segment registers on the calling CPU (clears the GS base)
+ */
+void gdt_reload(void);
+
+/**
+ * Install the TSS of the given CPU and load it on the calling CPU
+ */
+uint16_t gdt_load_tss(uint64_t cpu_id, tss_t* tss);
 uint16_t gdt_get_kernel_cs(void);
 uint16_t gdt_get_kernel_ds(void);
 uint16_t gdt_get_user_cs(void);
 uint16_t gdt_get_user_ds(void);
-uint16_t gdt_get_tss_ss(void);
 gdt_descriptor_t* gdt_get_descriptor(void);
 
 #endif
@@ -7,41 +7,43 @@ void handler_pf(const interrupt_frame_t* int_frame)
 {
     uint64_t fault_address, size;
     process_t* ps;
+    thread_t* th;
 
     READ_REGISTER("cr2", fault_address);
 
+    th = scheduler_get_current_thread();
     ps = scheduler_get_current_process();
     if 
     (
-        ps == NULL || 
+        th == NULL || 
         fault_address > KERNEL_PML4_VADDR
     )
         panic(int_frame, "Page fault occurred in kernel context. Fault address %p", fault_address);
 
     if 
     (
-        fault_address < ps->user_stack.ceil &&
-        (size = ps->user_stack.floor - fault_address) < PROC_MAX_STACK_SIZE
+        fault_address < th->user_stack.ceil &&
+        (size = th->user_stack.floor - fault_address) < PROC_MAX_STACK_SIZE
     )
     {
-        if (process_grow_stack(ps, &ps->user_stack, size))
+        if (process_grow_stack(ps, &th->user_stack, size))
         {
             trace_pf("Failed to expand user stack (pid: %u)", ps->pid);
-            scheduler_terminate_process(ps);
+            scheduler_terminate_process(ps, PROC_EXIT_STATUS_FAULT);
             return;
         }
         return;
     }
     else if
     (
-        fault_address < ps->kernel_stack.ceil &&
-        (size = ps->kernel_stack.floor - fault_address) < PROC_MAX_STACK_SIZE
+        fault_address < th->kernel_stack.ceil &&
+        (size = th->kernel_stack.floor - fault_address) < PROC_MAX_STACK_SIZE
     )
     {
-        if (process_grow_stack(ps, &ps->kernel_stack, size))
+        if (process_grow_stack(ps, &th->kernel_stack, size))
         {
             trace_pf("Failed to expand kernel stack (pid: %u)", ps->pid);
-            scheduler_terminate_process(ps);
+            scheduler_terminate_process(ps, PROC_EXIT_STATUS_FAULT);
             return;
         }
         return;
@@ -32,7 +32,6 @@ typedef struct idt64_entry idt64_entry_t;
 static idt64_entry_t idt[IDT_NUM_ENTRIES];
 static idt64_descriptor_t idt_descriptor;
 
-extern void idt_load(uint64_t idt); /* ASM call */
 
 static void idt_set_gate
 (
@@ -120,6 +119,22 @@ void idt_init(void)
     SET_IRQ(13);
     SET_IRQ(14);
     SET_IRQ(15);
+    SET_IRQ(16);
+    SET_IRQ(17);
+    SET_IRQ(18);
+    SET_IRQ(19);
+    SET_IRQ(20);
+    SET_IRQ(21);
+    SET_IRQ(22);
+    SET_IRQ(23);
+    SET_IRQ(24);
+    SET_IRQ(25);
+    SET_IRQ(26);
+    SET_IRQ(27);
+    SET_IRQ(28);
+    SET_IRQ(29);
+    SET_IRQ(30);
+    SET_IRQ(31);
 
     idt_load((uint64_t) &idt_descriptor);
 }
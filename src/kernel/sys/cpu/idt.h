@@ -15,5 +15,6 @@ typedef struct idt64_descriptor idt64_descriptor_t;
 void idt_init(void);
 void idt_set_interrupt_present(uint8_t interruptNumber, uint8_t value);
 idt64_descriptor_t* idt_get_descriptor(void);
+extern void idt_load(uint64_t idt);
 
 #endif
@@ -1,72 +1,43 @@
-[section .bss]
-
-int_frame:
-    int_info:
-        .int_num: resq 1
-        .err_code: resq 1
-    cpu_state:
-        .rax: resq 1
-        .rbx: resq 1
-        .rcx: resq 1
-        .rdx: resq 1
-        .rdi: resq 1
-        .rsi: resq 1
-        .rbp: resq 1
-        .r8: resq 1
-        .r9: resq 1
-        .r10: resq 1
-        .r11: resq 1
-        .r12: resq 1
-        .r13: resq 1
-        .r14: resq 1
-        .r15: resq 1
-    stack_state:
-        .rip: resq 1
-        .cs: resq 1
-        .rflags: resq 1
-        .rsp: resq 1
-        .ss: resq 1
-    align 16
-    fpu_state:
-        resb 512
-    
-
-
 [section .text]
 [bits 64]
 
+; Pushes the registers in the order of registers_state_t,
+; together with the interrupt info and the CPU-pushed stack
+; state this builds an interrupt_frame_t on the kernel stack
 %macro PUSHALL 0
-    push rax
-    push rbx
-    push rcx
-    push rdx
+    push r15
+    push r14
+    push r13
+    push r12
+    push r11
+    push r10
+    push r9
+    push r8
+    push rbp
     push rsi
     push rdi
-    push r8
-    push r9
-    push r10
-    push r11
-    push r12
-    push r13
-    push r14
-    push r15
+    push rdx
+    push rcx
+    push rbx
+    push rax
 %endmacro
 
 %macro POPALL 0
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop r11
-    pop r10
-    pop r9
-    pop r8
+    pop rax
+    pop rbx
+    pop rcx
+    pop rdx
     pop rdi
     pop rsi
-    pop rdx
-    pop rcx
-    pop rbx
-    pop rax
+    pop rbp
+    pop r8
+    pop r9
+    pop r10
+    pop r11
+    pop r12
+    pop r13
+    pop r14
+    pop r15
 %endmacro
 
 %macro ISR_NOERR 1
@@ -100,67 +71,38 @@ int_frame:
         jmp isr_stub
 %endmacro
 
-%macro FILL_STRUCT 0
-    mov [cpu_state.rdi], rdi
-    mov [cpu_state.rsi], rsi
-    mov [cpu_state.rbp], rbp
-    mov [cpu_state.rdx], rdx
-    mov [cpu_state.rcx], rcx
-    mov [cpu_state.rbx], rbx
-    mov [cpu_state.rax], rax
-    mov [cpu_state.r8], r8
-    mov [cpu_state.r9], r9
-    mov [cpu_state.r10], r10
-    mov [cpu_state.r11], r11
-    mov [cpu_state.r12], r12
-    mov [cpu_state.r13], r13
-    mov [cpu_state.r14], r14
-    mov [cpu_state.r15], r15
-
-    mov rax, [rsp+8*0]
-    mov [int_info.int_num], rax
-    mov rax, [rsp+8*1]
-    mov [int_info.err_code], rax
-
-    mov rax, [rsp+8*2]
-    mov [stack_state.rip], rax
-    mov rax, [rsp+8*3]
-    mov [stack_state.cs], rax
-    mov rax, [rsp+8*4]
-    mov [stack_state.rflags], rax
-    mov rax, [rsp+8*5]
-    mov [stack_state.rsp], rax
-    mov rax, [rsp+8*6]
-    mov [stack_state.ss], rax
-
-    fxsave [fpu_state]
-%endmacro
-
-
-
 [extern gdt_get_kernel_ds]
 [extern isr_handler]
 
+[global isr_exit]
+
 isr_stub:
-    FILL_STRUCT
+    ; Coming from user mode the GS base still belongs to the user
+    test qword [rsp+8*3], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
     PUSHALL
+    ; RBX and R12 (callee saved) keep the frame pointer and the old DS across calls,
+    ; nothing else is pushed so RSP stays 16 byte aligned at each call
+    mov rbx, rsp
     mov ax, ds
-    push rax
+    movzx r12d, ax
     call gdt_get_kernel_ds
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
-    mov rdi, int_frame
+    mov rdi, rbx
     cld
     call isr_handler
-    pop rbx
-    mov ds, bx
-    mov es, bx
-    mov fs, bx
-    mov gs, bx
+    mov ds, r12w
+    mov es, r12w
+; isr_exit -> Return from the interrupt frame RSP points to
+isr_exit:
     POPALL
-    fxrstor [fpu_state]
+    test qword [rsp+8*3], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     add rsp, 16
     iretq
 
@@ -215,3 +157,19 @@ IRQ 12
 IRQ 13
 IRQ 14
 IRQ 15
+IRQ 16
+IRQ 17
+IRQ 18
+IRQ 19
+IRQ 20
+IRQ 21
+IRQ 22
+IRQ 23
+IRQ 24
+IRQ 25
+IRQ 26
+IRQ 27
+IRQ 28
+IRQ 29
+IRQ 30
+IRQ 31
@@ -2,6 +2,8 @@
 #include "idt.h"
 #include "handlers.h"
 #include "../chips/pic.h"
+#include "../chips/lapic.h"
+#include "../chips/ioapic.h"
 #include "../../utils/log.h"
 #include <stddef.h>
 #include <mem.h>
@@ -16,6 +18,14 @@ void isr_init(void)
     isr_register_handler(EXCEPTION_PF, &handler_pf);
 }
 
+void isr_acknowledge(uint8_t interrupt_number)
+{
+    if (interrupt_number < IRQ(IRQ_COUNT) && !ioapic_is_initialized())
+        pic_acknowledge(interrupt_number);
+    else if (interrupt_number != LAPIC_SPURIOUS_VECTOR)
+        lapic_acknowledge();
+}
+
 void isr_handler(interrupt_frame_t* frame)
 {
     uint64_t interrupt_number;
@@ -24,14 +34,14 @@ void isr_handler(interrupt_frame_t* frame)
     {
         isr_handlers[interrupt_number](frame);
         if (interrupt_number >= IRQ(0))
-            pic_acknowledge(interrupt_number);
+            isr_acknowledge(interrupt_number);
     }
     else if (interrupt_number < IRQ(0))
         panic(frame, "Unhandled exception %02X", interrupt_number);
     else
     {
         trace_isr("Unhandled interrupt %02X", interrupt_number);
-        pic_acknowledge(interrupt_number);
+        isr_acknowledge(interrupt_number);
     }
 }
 
@@ -40,6 +50,31 @@ void isr_register_handler(uint8_t interrupt_number, isr_handler_t handler)
     /* Allow overwriting handlers (idk might be useful) */
     isr_handlers[interrupt_number] = handler;
     idt_set_interrupt_present(interrupt_number, 1);
-    if (interrupt_number >= IRQ(0))
-        pic_unmask_irq(interrupt_number);
+    if (interrupt_number >= IRQ(0) && interrupt_number < IRQ(IRQ_COUNT))
+    {
+        if (ioapic_is_initialized())
+            ioapic_unmask_irq(interrupt_number);
+        else
+            pic_unmask_irq(interrupt_number);
+    }
+}
+
+int isr_allocate_vector(isr_handler_t handler)
+{
+    uint8_t interrupt_number;
+    for 
+    (
+        interrupt_number = ISR_DYNAMIC_VECTORS_START; 
+        interrupt_number < ISR_DYNAMIC_VECTORS_END; 
+        interrupt_number++
+    )
+    {
+        if (isr_handlers[interrupt_number] == NULL)
+        {
+            isr_register_handler(interrupt_number, handler);
+            return interrupt_number;
+        }
+    }
+    trace_isr("No free interrupt vector left");
+    return -1;
 }
@@ -9,6 +9,10 @@
 
 #define IRQ(index) (32 + index)
 
+/* Vectors handed out to devices with dedicated interrupts (MSI) */
+#define ISR_DYNAMIC_VECTORS_START IRQ(17)
+#define ISR_DYNAMIC_VECTORS_END IRQ(30)
+
 
 /* ISRs */
 DECLARE_ISR(0);
@@ -61,6 +65,22 @@ DECLARE_IRQ(12);
 DECLARE_IRQ(13);
 DECLARE_IRQ(14);
 DECLARE_IRQ(15);
+DECLARE_IRQ(16);
+DECLARE_IRQ(17);
+DECLARE_IRQ(18);
+DECLARE_IRQ(19);
+DECLARE_IRQ(20);
+DECLARE_IRQ(21);
+DECLARE_IRQ(22);
+DECLARE_IRQ(23);
+DECLARE_IRQ(24);
+DECLARE_IRQ(25);
+DECLARE_IRQ(26);
+DECLARE_IRQ(27);
+DECLARE_IRQ(28);
+DECLARE_IRQ(29);
+DECLARE_IRQ(30);
+DECLARE_IRQ(31);
 
 typedef enum
 {
@@ -135,14 +155,14 @@ struct stack_state
 } __attribute__((packed));
 typedef struct stack_state stack_state_t;
 
-typedef uint8_t fpu_state_t[512 + 16];
-
+/**
+ * Built on the kernel stack by the ISR stubs, lowest address first
+ */
 struct interrupt_frame
 {
-    interrupt_info_t interrupt_info;
     registers_state_t registers_state;
+    interrupt_info_t interrupt_info;
     stack_state_t stack_state;
-    fpu_state_t fpu_state;
 } __attribute__((packed));
 typedef struct interrupt_frame interrupt_frame_t;
 
@@ -151,4 +171,14 @@ typedef void (*isr_handler_t)(const interrupt_frame_t* info);
 void isr_init(void);
 void isr_register_handler(uint8_t interrupt_number, isr_handler_t handler);
 
+/**
+ * Register a handler on a free vector reserved for devices, returns the vector or -1
+ */
+int isr_allocate_vector(isr_handler_t handler);
+
+/**
+ * Signal end of interrupt to whichever controller delivered it
+ */
+void isr_acknowledge(uint8_t interrupt_number);
+
 #endif
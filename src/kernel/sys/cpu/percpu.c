@@ -0,0 +1,75 @@
+#include "percpu.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "../../utils/alloc.h"
+#include "../../utils/log.h"
+#include <stddef.h>
+#include <mem.h>
+
+#define trace_percpu(msg, ...) trace("PCPU", msg, ##__VA_ARGS__)
+
+extern uint64_t kernel_stack_bottom;
+
+static percpu_t cpus[PERCPU_MAX_CPUS];
+static uint64_t cpus_count;
+
+static void percpu_setup(percpu_t* cpu, uint64_t id, uint64_t stack_top)
+{
+    memset(cpu, 0, sizeof(percpu_t));
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu->kernel_stack = stack_top;
+    tss_init(&cpu->tss);
+}
+
+void percpu_load(percpu_t* cpu)
+{
+    /* The user's GS base lives in the shadow register while in kernel mode */
+    cpu_write_msr(MSR_GS_BASE, (uint64_t) cpu);
+    cpu_write_msr(MSR_KERNEL_GS_BASE, 0);
+    gdt_load_tss(cpu->id, &cpu->tss);
+}
+
+void percpu_init_bsp(void)
+{
+    percpu_setup(&cpus[0], 0, ((uint64_t) &kernel_stack_bottom) - sizeof(uint64_t));
+    cpus_count = 1;
+    percpu_load(&cpus[0]);
+    cpus[0].online = 1;
+}
+
+percpu_t* percpu_allocate(uint8_t lapic_id)
+{
+    percpu_t* cpu;
+    void* stack;
+
+    if (cpus_count >= PERCPU_MAX_CPUS)
+    {
+        trace_percpu("Too many CPUs, ignoring APIC ID %u", lapic_id);
+        return NULL;
+    }
+
+    stack = malloc(PERCPU_STACK_SIZE);
+    if (stack == NULL)
+    {
+        trace_percpu("Could not allocate kernel stack for APIC ID %u", lapic_id);
+        return NULL;
+    }
+
+    cpu = &cpus[cpus_count];
+    percpu_setup(cpu, cpus_count, ((uint64_t) stack) + PERCPU_STACK_SIZE - sizeof(uint64_t));
+    cpu->lapic_id = lapic_id;
+    ++cpus_count;
+
+    return cpu;
+}
+
+percpu_t* percpu_get_by_id(uint64_t id)
+{
+    return (id < cpus_count) ? &cpus[id] : NULL;
+}
+
+uint64_t percpu_get_count(void)
+{
+    return cpus_count;
+}
@@ -0,0 +1,62 @@
+#ifndef __PERCPU_H__
+#define __PERCPU_H__
+
+#include "tss.h"
+#include <stdint.h>
+
+#define PERCPU_MAX_CPUS 16
+#define PERCPU_STACK_SIZE 32768
+
+/**
+ *  Offsets used by the assembly stubs (mirrored in percpu.inc).
+ */
+#define PERCPU_SELF 0x00
+#define PERCPU_KERNEL_STACK 0x08
+#define PERCPU_SYSCALL_STACK 0x10
+#define PERCPU_USER_STACK 0x18
+
+struct thread;
+
+/**
+ * Reached through the GS base while in kernel mode
+ */
+typedef struct percpu
+{
+    struct percpu* self;
+    uint64_t kernel_stack;
+    uint64_t syscall_stack;
+    uint64_t user_stack;     /* Scratch slot for the user RSP on syscall entry */
+    uint64_t id;
+    struct thread* current;
+    struct thread* fpu_owner;
+    uint8_t lapic_id;
+    volatile uint8_t online;
+    tss_t tss __attribute__((aligned(16)));
+} __attribute__((aligned(64))) percpu_t;
+
+static inline percpu_t* percpu_get(void)
+{
+    percpu_t* cpu;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r" (cpu));
+    return cpu;
+}
+
+/**
+ * Set up the boot CPU's block, must run after gdt_init()
+ */
+void percpu_init_bsp(void);
+
+/**
+ * Hand out the block for the next CPU to be started
+ */
+percpu_t* percpu_allocate(uint8_t lapic_id);
+
+/**
+ * Load this CPU's GS base, TSS and kernel stack pointer
+ */
+void percpu_load(percpu_t* cpu);
+
+percpu_t* percpu_get_by_id(uint64_t id);
+uint64_t percpu_get_count(void);
+
+#endif
@@ -0,0 +1,110 @@
+; Real mode entry point for the application processors.
+; The code is copied to a page below 1MB and started with a SIPI,
+; everything in here is addressed relative to the start of that page.
+
+%define SMP_OFFSET(label) (label - smp_trampoline_start)
+
+[section .text]
+
+[global smp_trampoline_start]
+[global smp_trampoline_end]
+[global smp_trampoline_data]
+
+[bits 16]
+smp_trampoline_start:
+    cli
+    cld
+    ; CS points at the page the trampoline was copied to
+    mov ax, cs
+    mov ds, ax
+    ; Keep the physical base of the page in EBX
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4
+    ; Load the temporary GDT and enter protected mode
+    o32 lgdt [SMP_OFFSET(smp_trampoline_gdtr)]
+    mov eax, cr0
+    or eax, 1 << 0
+    mov cr0, eax
+    o32 jmp far [SMP_OFFSET(smp_trampoline_pm_entry)]
+
+[bits 32]
+smp_trampoline_protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    ; Enable PAE
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+    ; Load the kernel PML4 (must be below 4GB)
+    mov eax, [ebx + SMP_OFFSET(smp_trampoline_cr3)]
+    mov cr3, eax
+    ; Copy the BSP's EFER, this sets LME
+    mov ecx, 0xC0000080
+    mov eax, [ebx + SMP_OFFSET(smp_trampoline_efer)]
+    mov edx, [ebx + SMP_OFFSET(smp_trampoline_efer) + 4]
+    wrmsr
+    ; Enable paging, the trampoline page is identity mapped
+    mov eax, cr0
+    or eax, 1 << 31
+    mov cr0, eax
+    jmp far [ebx + SMP_OFFSET(smp_trampoline_lm_entry)]
+
+[bits 64]
+smp_trampoline_long_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov ebx, ebx
+    ; Match the BSP's control registers
+    mov rax, [rbx + SMP_OFFSET(smp_trampoline_cr4)]
+    mov cr4, rax
+    mov rax, [rbx + SMP_OFFSET(smp_trampoline_cr0)]
+    mov cr0, rax
+    ; Jump to the kernel on this CPU's stack
+    mov rsp, [rbx + SMP_OFFSET(smp_trampoline_stack)]
+    mov rbp, rsp
+    mov rdi, [rbx + SMP_OFFSET(smp_trampoline_cpu)]
+    mov rax, [rbx + SMP_OFFSET(smp_trampoline_entry)]
+    call rax
+    cli
+    hlt
+    jmp $
+
+smp_trampoline_gdt:
+    dq 0x0000000000000000 ; Null
+    dq 0x00CF9A000000FFFF ; 32-bit code
+    dq 0x00CF92000000FFFF ; Data
+    dq 0x00AF9A000000FFFF ; 64-bit code
+smp_trampoline_gdt_end:
+
+; Mirrored by smp_trampoline_data_t, the addresses hold offsets
+; into the page until the kernel adds the page's base to them
+smp_trampoline_data:
+smp_trampoline_gdtr:
+    dw (smp_trampoline_gdt_end - smp_trampoline_gdt - 1)
+    dd SMP_OFFSET(smp_trampoline_gdt)
+smp_trampoline_pm_entry:
+    dd SMP_OFFSET(smp_trampoline_protected_mode)
+    dw 0x08
+smp_trampoline_lm_entry:
+    dd SMP_OFFSET(smp_trampoline_long_mode)
+    dw 0x18
+smp_trampoline_cr0:
+    dq 0
+smp_trampoline_cr3:
+    dq 0
+smp_trampoline_cr4:
+    dq 0
+smp_trampoline_efer:
+    dq 0
+smp_trampoline_stack:
+    dq 0
+smp_trampoline_cpu:
+    dq 0
+smp_trampoline_entry:
+    dq 0
+smp_trampoline_end:
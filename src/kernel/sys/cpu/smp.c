@@ -0,0 +1,194 @@
+#include "smp.h"
+#include "percpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "fpu.h"
+#include "../chips/lapic.h"
+#include "../mem/paging.h"
+#include "../mem/pfa.h"
+#include "../drivers/power/acpi.h"
+#include "../../proc/scheduler.h"
+#include "../../proc/syscall.h"
+#include "../../utils/log.h"
+#include <stddef.h>
+#include <mem.h>
+
+#define trace_smp(msg, ...) trace("SMPB", msg, ##__VA_ARGS__)
+
+/* The SIPI vector can only address pages below 1MB, stay clear of the EBDA */
+#define SMP_TRAMPOLINE_CEIL 0x90000
+#define SMP_INIT_DELAY_NS 10000000
+#define SMP_STARTUP_DELAY_NS 200000
+#define SMP_BOOT_TIMEOUT_NS 100000000
+
+/**
+ *  EFER bit 10: Long mode active (read-only, set by the CPU itself).
+ */
+#define SMP_EFER_LMA (1 << 10)
+
+struct smp_trampoline_data
+{
+    uint16_t gdtr_limit;
+    uint32_t gdtr_base;
+    uint32_t pm_entry;
+    uint16_t pm_selector;
+    uint32_t lm_entry;
+    uint16_t lm_selector;
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t stack;
+    uint64_t cpu;
+    uint64_t entry;
+} __attribute__((packed));
+typedef struct smp_trampoline_data smp_trampoline_data_t;
+
+extern uint8_t smp_trampoline_start;
+extern uint8_t smp_trampoline_end;
+extern uint8_t smp_trampoline_data;
+
+static void smp_ap_main(percpu_t* cpu)
+{
+    gdt_reload();
+    percpu_load(cpu);
+    idt_load((uint64_t) idt_get_descriptor());
+    fpu_init();
+    syscall_init();
+    lapic_init_ap();
+    cpu->online = 1;
+    scheduler_run();
+}
+
+static smp_trampoline_data_t* smp_setup_trampoline(uint64_t paddr)
+{
+    smp_trampoline_data_t* data;
+    uint64_t size;
+
+    size = ((uint64_t) &smp_trampoline_end) - ((uint64_t) &smp_trampoline_start);
+    memcpy((void*) paddr, &smp_trampoline_start, size);
+
+    data = (smp_trampoline_data_t*) (paddr + ((uint64_t) &smp_trampoline_data) - ((uint64_t) &smp_trampoline_start));
+    data->gdtr_base += paddr;
+    data->pm_entry += paddr;
+    data->lm_entry += paddr;
+    data->cr0 = cpu_read_cr0();
+    data->cr3 = kernel_get_pml4_paddr();
+    data->cr4 = cpu_read_cr4();
+    data->efer = cpu_read_msr(MSR_EFER) & ~SMP_EFER_LMA;
+    data->entry = (uint64_t) &smp_ap_main;
+
+    return data;
+}
+
+static int smp_boot_cpu(uint8_t apic_id, uint64_t trampoline_paddr, smp_trampoline_data_t* data)
+{
+    percpu_t* cpu;
+    uint64_t deadline;
+
+    cpu = percpu_allocate(apic_id);
+    if (cpu == NULL)
+        return -1;
+    data->stack = cpu->kernel_stack;
+    data->cpu = (uint64_t) cpu;
+
+    /* INIT-SIPI-SIPI */
+    lapic_send_init(apic_id);
+    tsc_wait(SMP_INIT_DELAY_NS);
+    lapic_send_startup(apic_id, trampoline_paddr);
+    tsc_wait(SMP_STARTUP_DELAY_NS);
+    if (!cpu->online)
+        lapic_send_startup(apic_id, trampoline_paddr);
+
+    /* Only one CPU at a time may use the trampoline */
+    deadline = tsc_get_ns() + SMP_BOOT_TIMEOUT_NS;
+    while (!cpu->online && tsc_get_ns() < deadline)
+        __asm__ volatile ("pause");
+
+    if (!cpu->online)
+    {
+        trace_smp("CPU with APIC ID %u did not come up", apic_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+int smp_init(void)
+{
+    madt_t* madt;
+    madt_entry_header_t* header;
+    madt_entry_lapic_t* entry;
+    smp_trampoline_data_t* data;
+    uint64_t paddr, offset, length, online;
+    uint8_t bsp_id;
+
+    if (!lapic_is_initialized())
+        return -1;
+
+    bsp_id = lapic_get_id();
+    percpu_get()->lapic_id = bsp_id;
+
+    madt = (madt_t*) acpi_find_table(MADT_SIG);
+    if (madt == NULL)
+    {
+        trace_smp("MADT table not found");
+        return -1;
+    }
+
+    /* The trampoline loads CR3 while still in 32-bit mode */
+    if (kernel_get_pml4_paddr() > 0xFFFFFFFF)
+    {
+        trace_smp("Kernel PML4 is out of reach of the trampoline");
+        return -1;
+    }
+
+    paddr = pfa_request_page_below(SMP_TRAMPOLINE_CEIL);
+    if (paddr == 0)
+    {
+        trace_smp("Could not allocate a page for the trampoline");
+        return -1;
+    }
+
+    /* The APs turn paging on while executing from the trampoline */
+    if (paging_map_memory(paddr, paddr, SIZE_4KB, PAGE_ACCESS_RW, PL0) < SIZE_4KB)
+    {
+        trace_smp("Could not identity map the trampoline");
+        pfa_free_page(paddr);
+        return -1;
+    }
+    data = smp_setup_trampoline(paddr);
+
+    online = 1;
+    length = madt->sdt_header.length - sizeof(madt_t);
+    for (offset = 0; offset + sizeof(madt_entry_header_t) <= length; offset += header->length)
+    {
+        header = (madt_entry_header_t*) &madt->entries[offset];
+        if (header->length == 0)
+            break;
+        if (header->type != MADT_ENTRY_LAPIC)
+            continue;
+
+        entry = (madt_entry_lapic_t*) header;
+        if
+        (
+            entry->apic_id == bsp_id ||
+            !(entry->flags & MADT_LAPIC_ENABLED)
+        )
+            continue;
+
+        /* A CPU that's late might still be using the trampoline, stop here */
+        if (smp_boot_cpu(entry->apic_id, paddr, data))
+            break;
+        ++online;
+    }
+
+    paging_unmap_memory(paddr, SIZE_4KB);
+    pfa_free_page(paddr);
+
+    info("%u CPU(s) online", online);
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+
+/**
+ * Start every application processor listed in the MADT,
+ * the scheduler must be initialized beforehand
+ */
+int smp_init(void);
+
+#endif
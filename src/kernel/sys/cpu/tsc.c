@@ -0,0 +1,109 @@
+#include "tsc.h"
+#include "cpu.h"
+#include "../chips/pit.h"
+#include "../../utils/log.h"
+
+#define trace_tsc(msg, ...) trace("TSCC", msg, ##__VA_ARGS__)
+
+#define TSC_CALIBRATION_NS 10000000
+#define TSC_SCALE_SHIFT 24
+
+static uint64_t frequency;
+static uint64_t start_ticks;
+static uint64_t ns_per_tick_scaled;
+static uint64_t ticks_per_ns_scaled;
+static uint8_t invariant;
+
+static uint64_t tsc_get_cpuid_frequency(void)
+{
+    cpuid_regs_t regs;
+
+    cpu_cpuid(0, 0, &regs);
+    if (regs.eax < CPUID_LEAF_TSC)
+        return 0;
+    
+    /* EAX/EBX is the TSC/crystal ratio, ECX is the crystal frequency (if enumerated) */
+    cpu_cpuid(CPUID_LEAF_TSC, 0, &regs);
+    if (regs.eax == 0 || regs.ebx == 0 || regs.ecx == 0)
+        return 0;
+    return (((uint64_t) regs.ecx) * regs.ebx) / regs.eax;
+}
+
+static uint64_t tsc_get_pit_frequency(void)
+{
+    uint64_t before, after;
+    before = cpu_read_tsc();
+    pit_wait(TSC_CALIBRATION_NS);
+    after = cpu_read_tsc();
+    return ((after - before) * NS_PER_SECOND) / TSC_CALIBRATION_NS;
+}
+
+int tsc_init(void)
+{
+    cpuid_regs_t regs;
+
+    cpu_cpuid(CPUID_LEAF_FEATURES, 0, &regs);
+    if (!(regs.edx & CPUID_FEATURES_EDX_TSC))
+    {
+        trace_tsc("Time stamp counter not supported");
+        return -1;
+    }
+
+    cpu_cpuid(CPUID_LEAF_EXT_MAX, 0, &regs);
+    invariant = 0;
+    if (regs.eax >= CPUID_LEAF_EXT_POWER)
+    {
+        cpu_cpuid(CPUID_LEAF_EXT_POWER, 0, &regs);
+        invariant = ((regs.edx & CPUID_EXT_POWER_EDX_INVARIANT_TSC) != 0);
+    }
+
+    frequency = tsc_get_cpuid_frequency();
+    if (frequency == 0)
+        frequency = tsc_get_pit_frequency();
+    if (frequency == 0)
+    {
+        trace_tsc("Could not calibrate time stamp counter");
+        return -1;
+    }
+
+    /* Fixed point factors, so that conversions don't need 128-bit divisions */
+    ns_per_tick_scaled = (((uint64_t) NS_PER_SECOND) << TSC_SCALE_SHIFT) / frequency;
+    ticks_per_ns_scaled = (frequency << TSC_SCALE_SHIFT) / NS_PER_SECOND;
+    start_ticks = cpu_read_tsc();
+
+    info("TSC running at %u kHz (%s)", frequency / 1000, (invariant) ? "invariant" : "not invariant");
+
+    return 0;
+}
+
+uint64_t tsc_get_ns(void)
+{
+    unsigned __int128 ticks;
+    ticks = cpu_read_tsc() - start_ticks;
+    return (uint64_t) ((ticks * ns_per_tick_scaled) >> TSC_SCALE_SHIFT);
+}
+
+uint64_t tsc_ns_to_ticks(uint64_t ns)
+{
+    unsigned __int128 ticks;
+    ticks = ns;
+    return (uint64_t) ((ticks * ticks_per_ns_scaled) >> TSC_SCALE_SHIFT);
+}
+
+void tsc_wait(uint64_t ns)
+{
+    uint64_t deadline;
+    deadline = tsc_get_ns() + ns;
+    while (tsc_get_ns() < deadline)
+        __asm__ volatile ("pause");
+}
+
+uint64_t tsc_get_frequency(void)
+{
+    return frequency;
+}
+
+int tsc_is_invariant(void)
+{
+    return invariant;
+}
@@ -0,0 +1,28 @@
+#ifndef __TSC_H__
+#define __TSC_H__
+
+#include <stdint.h>
+
+#define NS_PER_SECOND 1000000000
+
+/**
+ * Calibrate the time stamp counter (against CPUID leaf 0x15 if it
+ * reports the crystal frequency, against the PIT otherwise)
+ */
+int tsc_init(void);
+
+/**
+ * Monotonic nanoseconds since tsc_init()
+ */
+uint64_t tsc_get_ns(void);
+
+uint64_t tsc_ns_to_ticks(uint64_t ns);
+
+/**
+ * Busy wait, usable before any timer interrupt is set up
+ */
+void tsc_wait(uint64_t ns);
+uint64_t tsc_get_frequency(void);
+int tsc_is_invariant(void);
+
+#endif
@@ -1,20 +1,21 @@
 #include "tss.h"
-#include "../../headers/constants.h"
+#include "percpu.h"
 #include <mem.h>
 
-static __attribute__((aligned(SIZE_4KB))) tss_t tss;
-
-void tss_init(void)
+void tss_init(tss_t* tss)
 {
-    memset(&tss, 0, sizeof(tss_t));
+    memset(tss, 0, sizeof(tss_t));
 }
 
 void tss_set_kernel_stack(uint64_t stack_vaddr)
 {
-    tss.rsp0 = stack_vaddr;
+    percpu_t* cpu;
+    cpu = percpu_get();
+    cpu->tss.rsp0 = stack_vaddr;
+    cpu->syscall_stack = stack_vaddr;
 }
 
 tss_t* tss_get(void)
 {
-    return &tss;
+    return &percpu_get()->tss;
 }
@@ -23,7 +23,11 @@ struct tss
 } __attribute__((packed));
 typedef struct tss tss_t;
 
-void tss_init(void);
+void tss_init(tss_t* tss);
+
+/**
+ * Set RSP0 of the calling CPU's TSS
+ */
 void tss_set_kernel_stack(uint64_t stack_vaddr);
 tss_t* tss_get(void);
 extern void tss_load(uint16_t tss_seg_sel);
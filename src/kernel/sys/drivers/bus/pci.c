@@ -1,5 +1,6 @@
 #include "pci.h"
 #include "../power/acpi.h"
+#include "../../chips/lapic.h"
 #include "../../mem/paging.h"
 #include "../../../utils/log.h"
 #include "../../../utils/alloc.h"
@@ -8,6 +9,54 @@
 
 #define trace_pci(msg, ...) trace("PCIB", msg, ##__VA_ARGS__)
 
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+#define PCI_CAPABILITIES_POINTER 0x34
+
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_MSIX 0x11
+
+/**
+ *  MSI message control.
+ *  Bit 0: If 1, MSI is enabled.
+ *  Bit 4-6: Number of enabled vectors (log2).
+ *  Bit 7: If 1, the function supports 64-bit message addresses.
+ */
+#define PCI_MSI_CONTROL_ENABLE (1 << 0)
+#define PCI_MSI_CONTROL_MME_MASK (0b111 << 4)
+#define PCI_MSI_CONTROL_64BIT (1 << 7)
+
+/**
+ *  MSI-X message control.
+ *  Bit 0-10: Table size - 1.
+ *  Bit 14: If 1, all vectors of the function are masked.
+ *  Bit 15: If 1, MSI-X is enabled.
+ */
+#define PCI_MSIX_CONTROL_FUNCTION_MASK (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE (1 << 15)
+#define PCI_MSIX_BIR_MASK 0b111
+#define PCI_MSIX_ENTRY_MASKED (1 << 0)
+
+/**
+ *  Message address: Bit 20-31 fixed to 0xFEE, bit 12-19 destination APIC ID.
+ *  Message data: Bit 0-7 vector, bit 8-10 delivery mode (000 = Fixed), bit 15 trigger (0 = Edge).
+ */
+#define PCI_MSI_ADDRESS(apic_id) (0xFEE00000 | (((uint32_t) (apic_id)) << 12))
+#define PCI_MSI_DATA(vector) ((uint32_t) (vector))
+
+#define PCI_BAR_TYPE_MASK 0b110
+#define PCI_BAR_TYPE_64BIT 0b100
+#define PCI_BAR_MEMORY_MASK 0xFFFFFFF0
+
+struct pci_msix_entry
+{
+    uint32_t address_lo;
+    uint32_t address_hi;
+    uint32_t data;
+    uint32_t vector_control;
+} __attribute__((packed));
+typedef volatile struct pci_msix_entry pci_msix_entry_t;
+
 static pci_devices_list_t devices_list;
 
 static void pci_enumerate_function(uint64_t address, uint64_t num)
@@ -166,3 +215,121 @@ void pci_delete_devices_list(pci_devices_list_t* list)
     
     memset(list, 0, sizeof(pci_devices_list_t));    
 }
+
+static uint8_t pci_find_capability(uint64_t header_vaddr, uint8_t id)
+{
+    pci_header_common_t* header;
+    uint8_t offset;
+    uint64_t hops;
+
+    header = (pci_header_common_t*) header_vaddr;
+    if 
+    (
+        header->header_type != PCI_HEADER_0x0 ||
+        !(header->status & PCI_STATUS_CAPABILITIES)
+    )
+        return 0;
+
+    /* Bound the walk in case the list loops */
+    for 
+    (
+        offset = *((uint8_t*) (header_vaddr + PCI_CAPABILITIES_POINTER)) & 0xFC, hops = 0; 
+        offset != 0 && hops < 48; 
+        offset = *((uint8_t*) (header_vaddr + offset + 1)) & 0xFC, hops++
+    )
+    {
+        if (*((uint8_t*) (header_vaddr + offset)) == id)
+            return offset;
+    }
+
+    return 0;
+}
+
+static void pci_enable_msi_capability(uint64_t header_vaddr, uint8_t offset, uint8_t vector)
+{
+    volatile uint16_t* control;
+    uint64_t data_offset;
+
+    control = (volatile uint16_t*) (header_vaddr + offset + 2);
+    *((volatile uint32_t*) (header_vaddr + offset + 4)) = PCI_MSI_ADDRESS(lapic_get_id());
+    if (*control & PCI_MSI_CONTROL_64BIT)
+    {
+        *((volatile uint32_t*) (header_vaddr + offset + 8)) = 0;
+        data_offset = 12;
+    }
+    else
+        data_offset = 8;
+    *((volatile uint16_t*) (header_vaddr + offset + data_offset)) = (uint16_t) PCI_MSI_DATA(vector);
+    *control = (*control & ~PCI_MSI_CONTROL_MME_MASK) | PCI_MSI_CONTROL_ENABLE;
+}
+
+static int pci_enable_msix_capability(uint64_t header_vaddr, uint8_t offset, uint8_t vector)
+{
+    volatile uint16_t* control;
+    pci_msix_entry_t* entry;
+    uint64_t table, bar_offset, bar, table_paddr, table_vaddr;
+    uint8_t bir;
+
+    control = (volatile uint16_t*) (header_vaddr + offset + 2);
+    table = *((volatile uint32_t*) (header_vaddr + offset + 4));
+    bir = table & PCI_MSIX_BIR_MASK;
+    if (bir > 5)
+        return -1;
+
+    bar_offset = ((uint64_t) &((pci_header_0x0_t*) 0)->bar0) + (bir * sizeof(uint32_t));
+    bar = *((volatile uint32_t*) (header_vaddr + bar_offset));
+    table_paddr = bar & PCI_BAR_MEMORY_MASK;
+    if ((bar & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64BIT)
+        table_paddr |= ((uint64_t) *((volatile uint32_t*) (header_vaddr + bar_offset + sizeof(uint32_t)))) << 32;
+    table_paddr += table & ~((uint64_t) PCI_MSIX_BIR_MASK);
+
+    /* Only the first entry is used, a page is enough */
+    if (kernel_get_next_vaddr(SIZE_4KB, &table_vaddr) < SIZE_4KB)
+        return -1;
+    if 
+    (
+        paging_map_memory(alignd(table_paddr, SIZE_4KB), table_vaddr, SIZE_4KB, PAGE_ACCESS_RW, PL0) < SIZE_4KB ||
+        paging_flag_memory_area(table_vaddr, SIZE_4KB, PAGE_FLAG_UNCACHABLE)
+    )
+    {
+        paging_unmap_memory(table_vaddr, SIZE_4KB);
+        return -1;
+    }
+
+    *control |= PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_FUNCTION_MASK;
+    entry = (pci_msix_entry_t*) (table_vaddr + GET_ADDR_OFFSET(table_paddr));
+    entry->address_lo = PCI_MSI_ADDRESS(lapic_get_id());
+    entry->address_hi = 0;
+    entry->data = PCI_MSI_DATA(vector);
+    entry->vector_control &= ~PCI_MSIX_ENTRY_MASKED;
+    *control &= ~PCI_MSIX_CONTROL_FUNCTION_MASK;
+
+    paging_unmap_memory(table_vaddr, SIZE_4KB);
+    return 0;
+}
+
+int pci_enable_msi(uint64_t header_paddr, uint8_t vector)
+{
+    uint64_t header_vaddr;
+    uint8_t offset;
+    int err;
+
+    if (!lapic_is_initialized())
+        return -1;
+
+    header_vaddr = paging_map_temporary_page(header_paddr, PAGE_ACCESS_RW, PL0) + GET_ADDR_OFFSET(header_paddr);
+    err = 0;
+    if ((offset = pci_find_capability(header_vaddr, PCI_CAP_ID_MSI)) != 0)
+        pci_enable_msi_capability(header_vaddr, offset, vector);
+    else if ((offset = pci_find_capability(header_vaddr, PCI_CAP_ID_MSIX)) != 0)
+        err = pci_enable_msix_capability(header_vaddr, offset, vector);
+    else
+        err = -1;
+
+    /* Messages replace the shared INTx line */
+    if (!err)
+        ((pci_header_common_t*) header_vaddr)->command |= PCI_COMMAND_INTX_DISABLE;
+    
+    paging_unmap_temporary_page(header_vaddr);
+    return err;
+}
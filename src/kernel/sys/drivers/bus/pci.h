@@ -126,4 +126,10 @@ int pci_init(void);
 pci_devices_list_t* pci_find_devices(int class, int subclass, int program_interface);
 void pci_delete_devices_list(pci_devices_list_t* list);
 
+/**
+ * Route the function's interrupts to the given vector on this CPU,
+ * through MSI if available, otherwise through the first MSI-X entry
+ */
+int pci_enable_msi(uint64_t header_paddr, uint8_t vector);
+
 #endif
@@ -0,0 +1,425 @@
+#include "bcache.h"
+#include "../../mem/pfa.h"
+#include "../../mem/paging.h"
+#include "../../cpu/tsc.h"
+#include "../../../proc/scheduler.h"
+#include "../../../utils/alloc.h"
+#include "../../../utils/log.h"
+#include "../../../utils/spinlock.h"
+#include <stddef.h>
+#include <math.h>
+#include <mem.h>
+
+#define trace_bcache(msg, ...) trace("BCCH", msg, ##__VA_ARGS__)
+
+/* Every block is one page from the PFA */
+#define BCACHE_BLOCK_SIZE SIZE_4KB
+#define BCACHE_MAX_BLOCKS 1024
+/* Blocks are hashed into 1 << SHIFT buckets by (drive, block number) */
+#define BCACHE_BUCKETS_SHIFT 8
+#define BCACHE_BUCKETS (1 << BCACHE_BUCKETS_SHIFT)
+/* Most blocks fetched from the drive with a single read (or written with a single write) */
+#define BCACHE_MAX_RUN 32
+/* Dirty blocks are flushed once the oldest has waited this long or there are this many */
+#define BCACHE_FLUSH_DELAY_NS 5000000000
+#define BCACHE_MAX_DIRTY (BCACHE_MAX_BLOCKS / 2)
+
+typedef struct bcache_block
+{
+    struct bcache_block* hash_next;
+    drive_t* drive;
+    uint64_t number;
+    uint8_t* data;
+    uint8_t valid : 1;
+    /* Cleared as the clock hand passes, set on every hit */
+    uint8_t referenced : 1;
+    /* Newer than what's on the drive */
+    uint8_t dirty : 1;
+    uint8_t reserved : 5;
+} bcache_block_t;
+
+static bcache_block_t blocks[BCACHE_MAX_BLOCKS];
+static bcache_block_t* buckets[BCACHE_BUCKETS];
+/* Dirty blocks sorted by drive and number while they're flushed */
+static bcache_block_t* flush_order[BCACHE_MAX_BLOCKS];
+static uint64_t clock_hand;
+static uint64_t num_dirty;
+/* When the oldest dirty block was first written */
+static uint64_t dirty_since;
+static spinlock_t bcache_lock;
+
+void bcache_init(void)
+{
+    memset(blocks, 0, sizeof(blocks));
+    memset(buckets, 0, sizeof(buckets));
+    clock_hand = 0;
+    num_dirty = 0;
+    dirty_since = 0;
+    spinlock_init(&bcache_lock);
+}
+
+static bcache_block_t** bcache_get_bucket(drive_t* drive, uint64_t number)
+{
+    return &buckets[((number ^ (((uint64_t) drive) >> 4)) * 0x9E3779B97F4A7C15) >> (64 - BCACHE_BUCKETS_SHIFT)];
+}
+
+static bcache_block_t* bcache_find(drive_t* drive, uint64_t number)
+{
+    bcache_block_t* block;
+
+    for (block = *bcache_get_bucket(drive, number); block != NULL; block = block->hash_next)
+    {
+        if (block->drive == drive && block->number == number)
+            return block;
+    }
+
+    return NULL;
+}
+
+static void bcache_unhash(bcache_block_t* block)
+{
+    bcache_block_t** link;
+
+    for (link = bcache_get_bucket(block->drive, block->number); *link != NULL && *link != block; link = &(*link)->hash_next);
+    if (*link != NULL)
+        *link = block->hash_next;
+    block->hash_next = NULL;
+    block->valid = 0;
+}
+
+static uint8_t* bcache_allocate_page(void)
+{
+    uint64_t paddr, vaddr;
+
+    paddr = pfa_request_page();
+    if (paddr == 0)
+        return NULL;
+
+    if
+    (
+        kernel_get_next_vaddr(BCACHE_BLOCK_SIZE, &vaddr) < BCACHE_BLOCK_SIZE ||
+        paging_map_memory(paddr, vaddr, BCACHE_BLOCK_SIZE, PAGE_ACCESS_RW, PL0) < BCACHE_BLOCK_SIZE
+    )
+    {
+        pfa_free_page(paddr);
+        return NULL;
+    }
+
+    return (uint8_t*) vaddr;
+}
+
+static uint8_t bcache_comes_before(const bcache_block_t* a, const bcache_block_t* b)
+{
+    return (a->drive < b->drive || (a->drive == b->drive && a->number < b->number));
+}
+
+/* Write a run of blocks that follow each other on the same drive with a single command */
+static void bcache_write_run(bcache_block_t** run, uint64_t count)
+{
+    drive_t* drive;
+    uint8_t* buffer;
+    uint64_t i;
+
+    drive = run[0]->drive;
+    buffer = malloc(count * BCACHE_BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        /* Still better than not writing them at all */
+        for (i = 1; i < count; i++)
+            bcache_write_run(&run[i], 1);
+        count = 1;
+        buffer = run[0]->data;
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+            memcpy(&buffer[i * BCACHE_BLOCK_SIZE], run[i]->data, BCACHE_BLOCK_SIZE);
+    }
+
+    if (drive->ops->write(drive, (run[0]->number * BCACHE_BLOCK_SIZE) / drive->sector_bytes, count * BCACHE_BLOCK_SIZE, buffer) < count * BCACHE_BLOCK_SIZE)
+        trace_bcache("Could not write back %u block(s) from block %u", count, run[0]->number);
+    else
+    {
+        /* Blocks that failed stay dirty for the next flush */
+        for (i = 0; i < count; i++)
+            run[i]->dirty = 0;
+        num_dirty -= count;
+    }
+
+    if (buffer != run[0]->data)
+        free(buffer);
+}
+
+/* Write back every dirty block in drive order, adjacent blocks in as few commands as possible */
+static void bcache_flush(void)
+{
+    bcache_block_t* block;
+    uint64_t count, gap, i, j, run;
+
+    for (i = 0, count = 0; i < BCACHE_MAX_BLOCKS; i++)
+    {
+        if (blocks[i].valid && blocks[i].dirty)
+            flush_order[count++] = &blocks[i];
+    }
+
+    /* Shell sort, the array is small and there's no room for recursion */
+    for (gap = count / 2; gap > 0; gap /= 2)
+    {
+        for (i = gap; i < count; i++)
+        {
+            block = flush_order[i];
+            for (j = i; j >= gap && bcache_comes_before(block, flush_order[j - gap]); j -= gap)
+                flush_order[j] = flush_order[j - gap];
+            flush_order[j] = block;
+        }
+    }
+
+    for (i = 0; i < count; i += run)
+    {
+        for
+        (
+            run = 1;
+            i + run < count &&
+            run < BCACHE_MAX_RUN &&
+            flush_order[i + run]->drive == flush_order[i]->drive &&
+            flush_order[i + run]->number == flush_order[i]->number + run;
+            run++
+        );
+        bcache_write_run(&flush_order[i], run);
+    }
+
+    dirty_since = (num_dirty > 0) ? tsc_get_ns() : 0;
+}
+
+static void bcache_flush_if_due(void)
+{
+    if
+    (
+        num_dirty >= BCACHE_MAX_DIRTY ||
+        (num_dirty > 0 && tsc_get_ns() - dirty_since >= BCACHE_FLUSH_DELAY_NS)
+    )
+        bcache_flush();
+}
+
+static bcache_block_t* bcache_evict(void)
+{
+    bcache_block_t* block;
+    uint64_t i;
+
+    /* Two turns of the clock, the second one finds every block unreferenced */
+    for (i = 0; i < 2 * BCACHE_MAX_BLOCKS; i++)
+    {
+        block = &blocks[clock_hand];
+        clock_hand = (clock_hand + 1) % BCACHE_MAX_BLOCKS;
+
+        if (block->referenced)
+        {
+            block->referenced = 0;
+            continue;
+        }
+
+        /* One dirty block going means they all go, in a single ordered pass */
+        if (block->valid && block->dirty)
+            bcache_flush();
+        if (block->valid && block->dirty)
+            continue;
+
+        /* Pages are only taken from the PFA once the cache fills up */
+        if (block->data == NULL && (block->data = bcache_allocate_page()) == NULL)
+            continue;
+
+        if (block->valid)
+            bcache_unhash(block);
+        return block;
+    }
+
+    return NULL;
+}
+
+/* Load up to count blocks starting at number, stops at the first one already cached */
+static bcache_block_t* bcache_fill(drive_t* drive, uint64_t number, uint64_t count)
+{
+    bcache_block_t* block;
+    bcache_block_t** bucket;
+    uint8_t* buffer;
+    uint64_t run, loaded, i;
+
+    count = minu(count, BCACHE_MAX_RUN);
+    for (run = 0; run < count && bcache_find(drive, number + run) == NULL; run++);
+    if (run == 0)
+        return bcache_find(drive, number);
+
+    buffer = malloc(run * BCACHE_BLOCK_SIZE);
+    if (buffer == NULL)
+        return NULL;
+
+    /* Past the end of the drive only the blocks read in full are kept */
+    loaded = drive->ops->read(drive, (number * BCACHE_BLOCK_SIZE) / drive->sector_bytes, run * BCACHE_BLOCK_SIZE, buffer) / BCACHE_BLOCK_SIZE;
+    for (i = 0; i < minu(loaded, run); i++)
+    {
+        block = bcache_evict();
+        if (block == NULL)
+            break;
+        memcpy(block->data, &buffer[i * BCACHE_BLOCK_SIZE], BCACHE_BLOCK_SIZE);
+        block->drive = drive;
+        block->number = number + i;
+        block->valid = 1;
+        block->referenced = 0;
+        block->dirty = 0;
+        bucket = bcache_get_bucket(drive, block->number);
+        block->hash_next = *bucket;
+        *bucket = block;
+    }
+    free(buffer);
+
+    return bcache_find(drive, number);
+}
+
+static uint8_t bcache_is_usable(drive_t* drive)
+{
+    return 
+    (
+        drive->sector_bytes != 0 &&
+        drive->sector_bytes <= BCACHE_BLOCK_SIZE &&
+        (BCACHE_BLOCK_SIZE % drive->sector_bytes) == 0
+    );
+}
+
+uint64_t bcache_read(drive_t* drive, uint64_t lba, uint64_t bytes, void* buffer)
+{
+    bcache_block_t* block;
+    uint64_t number, offset, done, size;
+
+    if (!bcache_is_usable(drive))
+        return drive->ops->read(drive, lba, bytes, buffer);
+
+    number = (lba * drive->sector_bytes) / BCACHE_BLOCK_SIZE;
+    offset = (lba * drive->sector_bytes) % BCACHE_BLOCK_SIZE;
+
+    spinlock_acquire(&bcache_lock);
+    for (done = 0; done < bytes; done += size, offset = 0, number++)
+    {
+        block = bcache_find(drive, number);
+        if (block == NULL)
+            block = bcache_fill(drive, number, ceildivu(offset + bytes - done, BCACHE_BLOCK_SIZE));
+        if (block == NULL)
+            break;
+
+        block->referenced = 1;
+        size = minu(BCACHE_BLOCK_SIZE - offset, bytes - done);
+        memcpy(&((uint8_t*) buffer)[done], &block->data[offset], size);
+    }
+    bcache_flush_if_due();
+    spinlock_release(&bcache_lock);
+
+    /**
+     * Out of pages or a partial block at the end of the drive, the read comes up short.
+     * Going around the cache would miss dirty copies of the blocks after it
+     */
+    return done;
+}
+
+void bcache_read_ahead(drive_t* drive, uint64_t lba, uint64_t bytes)
+{
+    uint64_t number, last;
+
+    if (!bcache_is_usable(drive) || bytes == 0)
+        return;
+
+    number = (lba * drive->sector_bytes) / BCACHE_BLOCK_SIZE;
+    last = (lba * drive->sector_bytes + bytes - 1) / BCACHE_BLOCK_SIZE;
+
+    spinlock_acquire(&bcache_lock);
+    for (; number <= last; number++)
+    {
+        if (bcache_find(drive, number) == NULL && bcache_fill(drive, number, last - number + 1) == NULL)
+            break;
+    }
+    spinlock_release(&bcache_lock);
+}
+
+uint64_t bcache_write(drive_t* drive, uint64_t lba, uint64_t bytes, const void* data)
+{
+    bcache_block_t* block;
+    bcache_block_t** bucket;
+    uint64_t number, offset, done, size;
+    uint8_t was_clean;
+
+    if (drive->ops->write == NULL)
+        return 0;
+    if (!bcache_is_usable(drive))
+        return drive->ops->write(drive, lba, bytes, data);
+
+    number = (lba * drive->sector_bytes) / BCACHE_BLOCK_SIZE;
+    offset = (lba * drive->sector_bytes) % BCACHE_BLOCK_SIZE;
+
+    spinlock_acquire(&bcache_lock);
+    was_clean = (num_dirty == 0);
+    for (done = 0; done < bytes; done += size, offset = 0, number++)
+    {
+        size = minu(BCACHE_BLOCK_SIZE - offset, bytes - done);
+        block = bcache_find(drive, number);
+        if (block == NULL && size == BCACHE_BLOCK_SIZE)
+        {
+            /* Overwritten whole, there's nothing to read first */
+            block = bcache_evict();
+            if (block != NULL)
+            {
+                block->drive = drive;
+                block->number = number;
+                block->valid = 1;
+                block->dirty = 0;
+                bucket = bcache_get_bucket(drive, number);
+                block->hash_next = *bucket;
+                *bucket = block;
+            }
+        }
+        else if (block == NULL)
+            block = bcache_fill(drive, number, 1);
+        if (block == NULL)
+            break;
+
+        block->referenced = 1;
+        memcpy(&block->data[offset], &((const uint8_t*) data)[done], size);
+        if (!block->dirty)
+        {
+            block->dirty = 1;
+            if (num_dirty++ == 0)
+                dirty_since = tsc_get_ns();
+        }
+    }
+    bcache_flush_if_due();
+    spinlock_release(&bcache_lock);
+
+    /* The flush deadline is new, the timer may not be armed at all */
+    if (was_clean && num_dirty > 0)
+        scheduler_update_timer();
+
+    /**
+     * Out of pages or a partial block at the end of the drive, the write comes up short.
+     * Going around the cache would be undone when cached copies of the blocks after it are flushed
+     */
+    return done;
+}
+
+void bcache_flush_expired(void)
+{
+    if (!spinlock_try_acquire(&bcache_lock))
+        return;
+    bcache_flush_if_due();
+    spinlock_release(&bcache_lock);
+}
+
+uint64_t bcache_get_flush_deadline(void)
+{
+    /* Read without the lock, a stale value only moves the next check */
+    return (num_dirty > 0) ? dirty_since + BCACHE_FLUSH_DELAY_NS : 0;
+}
+
+void bcache_sync(void)
+{
+    spinlock_acquire(&bcache_lock);
+    if (num_dirty > 0)
+        bcache_flush();
+    spinlock_release(&bcache_lock);
+}
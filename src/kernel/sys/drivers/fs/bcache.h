@@ -0,0 +1,20 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include "drivefs.h"
+
+void bcache_init(void);
+/* Read through the cache, returns how many bytes were read */
+uint64_t bcache_read(drive_t* drive, uint64_t lba, uint64_t bytes, void* buffer);
+/* Hint that the range is about to be read, whatever isn't cached yet is loaded in one go */
+void bcache_read_ahead(drive_t* drive, uint64_t lba, uint64_t bytes);
+/* Write into the cache, the blocks reach the drive with the next flush. Returns how many bytes were written */
+uint64_t bcache_write(drive_t* drive, uint64_t lba, uint64_t bytes, const void* data);
+/* Flush every dirty block */
+void bcache_sync(void);
+/* Flush if the oldest dirty block has waited long enough, skipped while another CPU is in the cache */
+void bcache_flush_expired(void);
+/* When the dirty blocks are due on the drive, 0 if there are none */
+uint64_t bcache_get_flush_deadline(void);
+
+#endif
@@ -1,4 +1,5 @@
 #include "devfs.h"
+#include "../../../proc/vfs/dcache.h"
 #include "../../../utils/macros.h"
 #include "../../../utils/log.h"
 #include "../../../utils/alloc.h"
@@ -20,49 +21,8 @@ typedef struct
     devfs_inode_t* tail;
 } devfs_inode_list_t;
 
-typedef struct devfs_vfss_list_entry
-{
-    struct devfs_vfss_list_entry* next;
-    vnode_t root;
-} devfs_vfss_list_entry_t;
-
-typedef struct
-{
-    devfs_vfss_list_entry_t* head;
-    devfs_vfss_list_entry_t* tail;
-} devfs_vfss_list_t;
-
-static uint64_t index;
-static devfs_vfss_list_t vfss_list;
 static devfs_inode_list_t inodes_list;
 static vnode_ops_t vnode_ops;
-static vfs_ops_t vfs_ops;
-
-static devfs_vfss_list_entry_t* devfs_get_entry(uint64_t index)
-{
-    devfs_vfss_list_entry_t* entry;
-    for 
-    (
-        entry = vfss_list.head; 
-        index > 0 && entry != NULL; 
-        index--, entry = entry->next
-    );
-    if (index > 0)
-        return NULL;
-    return entry;
-}
-
-static int devfs_root(vfs_t* vfs, vnode_t* out)
-{
-    devfs_vfss_list_entry_t* entry;
-
-    entry = devfs_get_entry(vfs->index);
-    if (entry == NULL)
-        return -1;
-    out->ops = entry->root.ops;
-    out->data = entry->root.data;
-    return 0;
-}
 
 static int devfs_open(vnode_t* node)
 {
@@ -70,17 +30,19 @@ static int devfs_open(vnode_t* node)
     return -1;
 }
 
-static int devfs_read(vnode_t* node, void* buffer, uint64_t count)
+static int64_t devfs_read(vnode_t* node, void* buffer, uint64_t count, uint64_t offset)
 {
     UNUSED(node);
+    UNUSED(offset);
     UNUSED(buffer);
     UNUSED(count);
     return -1;
 }
 
-static int devfs_write(vnode_t* node, const char* data, uint64_t count)
+static int64_t devfs_write(vnode_t* node, const char* data, uint64_t count, uint64_t offset)
 {
     UNUSED(node);
+    UNUSED(offset);
     UNUSED(data);
     UNUSED(count);
     return -1;
@@ -117,12 +79,13 @@ static int devfs_lookup(vnode_t* dir, const char* path, vnode_t* out)
         }
     }
 
-    return -1;
+    return VNODE_LOOKUP_NOT_FOUND;
 }
 
 int devfs_add_device(const char* path, vnode_t* node)
 {
     devfs_inode_t* inode;
+    vnode_t root;
     uint64_t path_len;
 
     if (path == NULL || strlen(path) == 0)
@@ -166,40 +129,28 @@ int devfs_add_device(const char* path, vnode_t* node)
         inodes_list.tail->next = inode;
     inodes_list.tail = inode;
 
+    /* An earlier lookup may have cached that the device doesn't exist */
+    root.ops = &vnode_ops;
+    root.data = NULL;
+    dcache_invalidate(&root, (path[0] == '/') ? &path[1] : path);
+
     return 0;
 }
 
 
 int devfs_create(vfs_t* vfs)
 {
-    devfs_vfss_list_entry_t* entry;
-
-    entry = malloc(sizeof(devfs_vfss_list_entry_t));
-    if (entry == NULL)
-        return -1;
-
-    entry->root.ops = &vnode_ops;
-    entry->next = NULL;
-    if (vfss_list.tail == NULL)
-        vfss_list.head = entry;
-    else
-        vfss_list.tail->next = entry;
-    vfss_list.tail = entry;
-
-    vfs->index = index++;
-    vfs->ops = &vfs_ops;
+    vfs->root.ops = &vnode_ops;
+    /* Part of the key of every cached lookup in this instance */
+    vfs->root.data = NULL;
     return 0;
 }
 
 void devfs_init(void)
 {
-    index = 0;
-    vfss_list.head = NULL;
-    vfss_list.tail = NULL;
     vnode_ops.open = &devfs_open;
     vnode_ops.read = &devfs_read;
     vnode_ops.write = &devfs_write;
     vnode_ops.lookup = &devfs_lookup;
     vnode_ops.get_attribs = &devfs_get_attribs;
-    vfs_ops.root = &devfs_root;
 }
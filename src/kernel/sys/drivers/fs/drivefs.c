@@ -1,6 +1,8 @@
 #include "drivefs.h"
+#include "bcache.h"
 #include "../storage/partition-tables/gpt.h"
 #include "../../../kernel.h"
+#include <mem.h>
 
 #define trace_drivefs(msg, ...) trace("DRFS", msg, ##__VA_ARGS__)
 
@@ -9,7 +11,8 @@ typedef int (*fs_create_t)(drive_t* drive, uint64_t partition_index);
 static uint64_t drive_index;
 static vnode_ops_t drivefs_vnode_ops;
 static fs_create_t fss[] = {
-    &isofs_create
+    &isofs_create,
+    &fatfs_create
 };
 
 static int drivefs_open_stub(vnode_t* node)
@@ -18,17 +21,19 @@ static int drivefs_open_stub(vnode_t* node)
     return -1;
 }
 
-static int drivefs_read_stub(vnode_t* node, void* buffer, uint64_t count)
+static int64_t drivefs_read_stub(vnode_t* node, void* buffer, uint64_t count, uint64_t offset)
 {
     UNUSED(node);
+    UNUSED(offset);
     UNUSED(buffer);
     UNUSED(count);
     return -1;
 }
 
-static int drivefs_write_stub(vnode_t* node, const char* data, uint64_t count)
+static int64_t drivefs_write_stub(vnode_t* node, const char* data, uint64_t count, uint64_t offset)
 {
     UNUSED(node);
+    UNUSED(offset);
     UNUSED(data);
     UNUSED(count);
     return -1;
@@ -65,11 +70,19 @@ static int drivefs_detect_mbr_partitions(drive_t* drive)
 
 static int drivefs_detect_partitions(drive_t* drive)
 {
+    int num_partitions;
+
+    num_partitions = 0;
     if (gpt_check(drive)) 
-        return drivefs_detect_gpt_partitions(drive);
+        num_partitions = drivefs_detect_gpt_partitions(drive);
     else if (mbr_check(drive))
-        return drivefs_detect_mbr_partitions(drive);
-    return 0;
+        num_partitions = drivefs_detect_mbr_partitions(drive);
+    if (num_partitions > 0)
+        return num_partitions;
+
+    /* No partition table (like the FAT image made for UEFI), the filesystem might span the whole drive */
+    drive->partitions = calloc(1, sizeof(drive_partition_t));
+    return (drive->partitions != NULL);
 }
 
 static int drivefs_detect_partition_fs(drive_t* drive, uint64_t index)
@@ -159,6 +172,7 @@ int drivefs_register_drive(drive_t* drive)
 void drivefs_init(void)
 {
     drive_index = 0;
+    bcache_init();
     drivefs_vnode_ops.open = &drivefs_open_stub;
     drivefs_vnode_ops.lookup = &drivefs_lookup_stub;
     drivefs_vnode_ops.read = &drivefs_read_stub;
@@ -169,11 +183,64 @@ void drivefs_init(void)
 drive_t* drivefs_lookup(const char* path)
 {
     vnode_t out;
-    vfs_lookup(path, &out);
+    if (vfs_lookup(path, &out))
+        return NULL;
+    /* Drives outlive their devfs vnodes */
+    vfs_put(&out);
     return ((drive_t*) out.data);
 }
 
 uint64_t drivefs_read(drive_t* drive, uint64_t lba, uint64_t bytes, void* buffer)
 {
-    return drive->ops->read(drive, lba, bytes, buffer);
+    return bcache_read(drive, lba, bytes, buffer);
+}
+
+int drivefs_read_bytes(drive_t* drive, uint64_t position, uint64_t count, void* buffer)
+{
+    uint64_t lba, skip;
+    uint8_t* data;
+
+    /* Drives read whole sectors, the start of the first one might not be wanted */
+    lba = position / drive->sector_bytes;
+    skip = position % drive->sector_bytes;
+    if (skip == 0)
+        return -(drivefs_read(drive, lba, count, buffer) < count);
+
+    data = malloc(skip + count);
+    if (data == NULL)
+        return -1;
+    if (drivefs_read(drive, lba, skip + count, data) < skip + count)
+    {
+        free(data);
+        return -1;
+    }
+    memcpy(buffer, &data[skip], count);
+    free(data);
+
+    return 0;
+}
+
+void drivefs_read_ahead(drive_t* drive, uint64_t lba, uint64_t bytes)
+{
+    bcache_read_ahead(drive, lba, bytes);
+}
+
+uint64_t drivefs_write(drive_t* drive, uint64_t lba, uint64_t bytes, const void* data)
+{
+    return bcache_write(drive, lba, bytes, data);
+}
+
+void drivefs_sync(void)
+{
+    bcache_sync();
+}
+
+void drivefs_flush_expired(void)
+{
+    bcache_flush_expired();
+}
+
+uint64_t drivefs_get_flush_deadline(void)
+{
+    return bcache_get_flush_deadline();
 }
@@ -32,12 +32,27 @@ typedef struct
 typedef struct drive_ops
 {
     uint64_t (*read)(drive_t* drive, uint64_t lba, uint64_t size, void* buffer);
+    /* NULL for read-only drives */
+    uint64_t (*write)(drive_t* drive, uint64_t lba, uint64_t size, const void* buffer);
 } drive_ops_t;
 
 int drivefs_register_drive(drive_t* drive);
 void drivefs_init(void);
 
 drive_t* drivefs_lookup(const char* path);
+/* Goes through the block cache */
 uint64_t drivefs_read(drive_t* drive, uint64_t lba, uint64_t bytes, void* buffer);
+/* Like drivefs_read but at any byte position of the drive, returns 0 if all count bytes were read */
+int drivefs_read_bytes(drive_t* drive, uint64_t position, uint64_t count, void* buffer);
+/* Hint that the range is about to be read */
+void drivefs_read_ahead(drive_t* drive, uint64_t lba, uint64_t bytes);
+/* Goes to the block cache, it's on the drive after the next sync at the latest */
+uint64_t drivefs_write(drive_t* drive, uint64_t lba, uint64_t bytes, const void* data);
+/* Write everything still only in the block cache to the drives */
+void drivefs_sync(void);
+/* Write the block cache back if it's been dirty for too long, for the timer to call */
+void drivefs_flush_expired(void);
+/* When drivefs_flush_expired has something to write, 0 if nothing is dirty */
+uint64_t drivefs_get_flush_deadline(void);
 
 #endif
@@ -1,3 +1,800 @@
 #include "fatfs.h"
+#include "../../../proc/vfs/icache.h"
+#include "../../../utils/macros.h"
+#include "../../../utils/alloc.h"
+#include "../../../utils/log.h"
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <mem.h>
 
-// PLACEHOLDER
+#define trace_fatfs(msg, ...) trace("FATF", msg, ##__VA_ARGS__)
+
+#define FATFS_SIG "FAT32"
+#define FATFS_BOOT_SIG 0xAA55
+#define FATFS_MIN_SECTOR_BYTES 512
+#define FATFS_MAX_SECTOR_BYTES 4096
+/* Cluster numbers are 28 bits, the top 4 are reserved */
+#define FATFS_CLUSTER_MASK 0x0FFFFFFF
+#define FATFS_FIRST_CLUSTER 2
+/* What a newly allocated cluster points to */
+#define FATFS_CLUSTER_END 0x0FFFFFFF
+/* Sizes are 32 bits */
+#define FATFS_MAX_FILE_SIZE 0xFFFFFFFF
+/* Free cluster count and next free cluster hint in the FSInfo sector */
+#define FATFS_FSINFO_COUNTS 488
+/* Read ahead of sequential transfers, stopping where the cluster chain stops being contiguous */
+#define FATFS_READ_AHEAD SIZE_nKB(64)
+
+/**
+ *  Extended flags bit 7: Only one FAT is active (and it's not mirrored).
+ *  Extended flags bits 0-3: Number of the active FAT.
+ */
+#define FATFS_EXT_NO_MIRRORING (1 << 7)
+#define FATFS_EXT_ACTIVE_FAT 0x0F
+
+#define FATFS_ATTR_READ_ONLY 0x01
+#define FATFS_ATTR_HIDDEN 0x02
+#define FATFS_ATTR_SYSTEM 0x04
+#define FATFS_ATTR_VOLUME_ID 0x08
+#define FATFS_ATTR_DIRECTORY 0x10
+#define FATFS_ATTR_ARCHIVE 0x20
+#define FATFS_ATTR_LFN (FATFS_ATTR_READ_ONLY | FATFS_ATTR_HIDDEN | FATFS_ATTR_SYSTEM | FATFS_ATTR_VOLUME_ID)
+
+/* First byte of a short name */
+#define FATFS_ENTRY_END 0x00
+#define FATFS_ENTRY_FREE 0xE5
+/* Stands for a leading 0xE5 that isn't a free marker */
+#define FATFS_ENTRY_KANJI 0x05
+
+/**
+ *  LFN sequence bit 6: Last (first stored) entry of a long name.
+ *  LFN sequence bits 0-4: Position of the entry in the name, from 1.
+ */
+#define FATFS_LFN_LAST (1 << 6)
+#define FATFS_LFN_SEQUENCE 0x1F
+#define FATFS_LFN_CHARS 13
+#define FATFS_LFN_MAX_ENTRIES 20
+
+struct fatfs_bpb
+{
+    uint8_t jump[3];
+    char oem_identifier[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t num_fats;
+    uint16_t root_entries; /* Always 0 on FAT32 */
+    uint16_t total_sectors_16;
+    uint8_t media;
+    uint16_t sectors_per_fat_16; /* Always 0 on FAT32 */
+    uint16_t sectors_per_track;
+    uint16_t num_heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors_32;
+    uint32_t sectors_per_fat_32;
+    uint16_t ext_flags;
+    uint16_t version;
+    uint32_t root_cluster;
+    uint16_t fsinfo_sector;
+    uint16_t backup_boot_sector;
+    uint8_t reserved0[12];
+    uint8_t drive_number;
+    uint8_t reserved1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    char volume_label[11];
+    char fs_type[8];
+    uint8_t boot_code[420];
+    uint16_t signature;
+} __attribute__((packed));
+typedef struct fatfs_bpb fatfs_bpb_t;
+
+struct fatfs_dirent
+{
+    char name[11]; /* 8.3, padded with spaces */
+    uint8_t attributes;
+    uint8_t reserved;
+    uint8_t creation_cents;
+    uint16_t creation_time;
+    uint16_t creation_date;
+    uint16_t access_date;
+    uint16_t cluster_high;
+    uint16_t modification_time;
+    uint16_t modification_date;
+    uint16_t cluster_low;
+    uint32_t size;
+} __attribute__((packed));
+typedef struct fatfs_dirent fatfs_dirent_t;
+
+/* Stored right before the short entry it names, last part first */
+struct fatfs_lfn
+{
+    uint8_t sequence;
+    uint16_t name1[5];
+    uint8_t attributes;
+    uint8_t type;
+    uint8_t checksum; /* Of the short name */
+    uint16_t name2[6];
+    uint16_t zero;
+    uint16_t name3[2];
+} __attribute__((packed));
+typedef struct fatfs_lfn fatfs_lfn_t;
+
+typedef struct
+{
+    drive_t* drive;
+    uint64_t lba_start;
+    uint64_t cluster_bytes;
+    /* Of cluster 2, in bytes from the start of the partition */
+    uint64_t data_position;
+    uint32_t root_cluster;
+    /* Clusters past the last one don't exist */
+    uint32_t num_clusters;
+    /* The active FAT, loaded whole so following a chain never touches the drive */
+    uint32_t* fat;
+    /* Copies of the FAT kept in sync, each fat_bytes long, in bytes from the start of the partition */
+    uint64_t fat_position;
+    uint64_t fat_bytes;
+    uint8_t num_fats;
+    /* The counts in it go stale with the first allocation, 0 if there's no FSInfo sector */
+    uint8_t fsinfo_stale;
+    uint64_t fsinfo_position;
+    /* Free clusters are looked for from here on */
+    uint32_t next_free;
+} fatfs_volume_t;
+
+typedef struct
+{
+    /* Keyed by (volume, position of the file's directory entry), the root by 0 (the boot sector) */
+    icache_inode_t cached;
+    fatfs_volume_t* volume;
+    uint8_t is_directory : 1;
+    uint8_t is_hidden : 1;
+    uint8_t reserved : 6;
+    uint32_t first_cluster;
+    uint64_t size;
+    /* Where the last transfer ended in the chain, sequential ones carry on from there */
+    uint64_t seek_index;
+    uint32_t seek_cluster;
+} fatfs_inode_t;
+
+static vnode_ops_t vnode_ops;
+
+/* Position is in bytes from the start of the partition */
+static int fatfs_read_bytes(fatfs_volume_t* volume, uint64_t position, uint64_t count, void* buffer)
+{
+    return drivefs_read_bytes(volume->drive, volume->lba_start * volume->drive->sector_bytes + position, count, buffer);
+}
+
+static int fatfs_write_bytes(fatfs_volume_t* volume, uint64_t position, uint64_t count, const void* data)
+{
+    uint64_t lba, skip;
+    uint8_t* buffer;
+    int exit_code;
+
+    lba = volume->lba_start + position / volume->drive->sector_bytes;
+    skip = position % volume->drive->sector_bytes;
+    if (skip == 0)
+        return -(drivefs_write(volume->drive, lba, count, data) < count);
+
+    /* The start of the first sector is written back as it was */
+    buffer = malloc(skip + count);
+    if (buffer == NULL)
+        return -1;
+    exit_code = -1;
+    if (drivefs_read(volume->drive, lba, skip, buffer) == skip)
+    {
+        memcpy(&buffer[skip], data, count);
+        exit_code = -(drivefs_write(volume->drive, lba, skip + count, buffer) < skip + count);
+    }
+    free(buffer);
+
+    return exit_code;
+}
+
+static uint8_t fatfs_is_cluster(fatfs_volume_t* volume, uint32_t cluster)
+{
+    return (cluster >= FATFS_FIRST_CLUSTER && cluster < volume->num_clusters);
+}
+
+/* Anything fatfs_is_cluster refuses ends the chain (free, bad and end of chain markers) */
+static uint32_t fatfs_next_cluster(fatfs_volume_t* volume, uint32_t cluster)
+{
+    return volume->fat[cluster] & FATFS_CLUSTER_MASK;
+}
+
+/* Both in memory and in every copy on the drive */
+static int fatfs_set_next_cluster(fatfs_volume_t* volume, uint32_t cluster, uint32_t next)
+{
+    uint64_t i;
+
+    volume->fat[cluster] = (volume->fat[cluster] & ~FATFS_CLUSTER_MASK) | (next & FATFS_CLUSTER_MASK);
+    for (i = 0; i < volume->num_fats; i++)
+    {
+        if (fatfs_write_bytes(volume, volume->fat_position + i * volume->fat_bytes + cluster * sizeof(uint32_t), sizeof(uint32_t), &volume->fat[cluster]))
+            return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t fatfs_cluster_position(fatfs_volume_t* volume, uint32_t cluster)
+{
+    return volume->data_position + ((uint64_t) (cluster - FATFS_FIRST_CLUSTER)) * volume->cluster_bytes;
+}
+
+/* How many clusters from the first one (up to max) follow each other on the drive */
+static uint64_t fatfs_run_length(fatfs_volume_t* volume, uint32_t cluster, uint64_t max)
+{
+    uint64_t length;
+
+    for (length = 1; length < max && fatfs_next_cluster(volume, cluster) == cluster + 1; length++, cluster++);
+    return length;
+}
+
+/* Cluster number index of the file, 0 if the chain is shorter */
+static uint32_t fatfs_find_cluster(fatfs_inode_t* inode, uint64_t index)
+{
+    uint32_t cluster;
+    uint64_t i;
+
+    if (fatfs_is_cluster(inode->volume, inode->seek_cluster) && inode->seek_index <= index)
+    {
+        i = inode->seek_index;
+        cluster = inode->seek_cluster;
+    }
+    else
+    {
+        i = 0;
+        cluster = inode->first_cluster;
+    }
+
+    for (; i < index && fatfs_is_cluster(inode->volume, cluster); i++)
+        cluster = fatfs_next_cluster(inode->volume, cluster);
+
+    return fatfs_is_cluster(inode->volume, cluster) ? cluster : 0;
+}
+
+/* A zeroed cluster linked after prev (if it's not 0), returns 0 if the volume is full */
+static uint32_t fatfs_allocate_cluster(fatfs_volume_t* volume, uint32_t prev)
+{
+    uint32_t unknown[2];
+    uint32_t start, cluster;
+    uint64_t i;
+    uint8_t* zeros;
+
+    /* Right after prev keeps the file in one run */
+    start = (prev != 0 && fatfs_is_cluster(volume, prev + 1)) ? prev + 1 : volume->next_free;
+    for (i = 0; i < volume->num_clusters - FATFS_FIRST_CLUSTER; i++)
+    {
+        cluster = FATFS_FIRST_CLUSTER + (uint32_t) ((start - FATFS_FIRST_CLUSTER + i) % (volume->num_clusters - FATFS_FIRST_CLUSTER));
+        if ((volume->fat[cluster] & FATFS_CLUSTER_MASK) == 0)
+            break;
+    }
+    if (i == volume->num_clusters - FATFS_FIRST_CLUSTER)
+    {
+        trace_fatfs("Volume is full");
+        return 0;
+    }
+
+    if (volume->fsinfo_position != 0 && !volume->fsinfo_stale)
+    {
+        /* Nobody keeps the counts up to date, mark them as unknown */
+        unknown[0] = 0xFFFFFFFF;
+        unknown[1] = 0xFFFFFFFF;
+        if (fatfs_write_bytes(volume, volume->fsinfo_position + FATFS_FSINFO_COUNTS, sizeof(unknown), unknown))
+            return 0;
+        volume->fsinfo_stale = 1;
+    }
+
+    /* Holes in a file read as zeros */
+    zeros = calloc(1, volume->cluster_bytes);
+    if (zeros == NULL)
+        return 0;
+    if
+    (
+        fatfs_write_bytes(volume, fatfs_cluster_position(volume, cluster), volume->cluster_bytes, zeros) ||
+        fatfs_set_next_cluster(volume, cluster, FATFS_CLUSTER_END) ||
+        (prev != 0 && fatfs_set_next_cluster(volume, prev, cluster))
+    )
+    {
+        free(zeros);
+        return 0;
+    }
+    free(zeros);
+
+    volume->next_free = fatfs_is_cluster(volume, cluster + 1) ? cluster + 1 : FATFS_FIRST_CLUSTER;
+    return cluster;
+}
+
+/* Make the file's chain at least clusters long */
+static int fatfs_extend(fatfs_inode_t* inode, uint64_t clusters)
+{
+    uint32_t cluster;
+    uint64_t i;
+
+    if (clusters == 0)
+        return 0;
+
+    if (inode->first_cluster == 0)
+    {
+        inode->first_cluster = fatfs_allocate_cluster(inode->volume, 0);
+        if (inode->first_cluster == 0)
+            return -1;
+    }
+
+    if (fatfs_is_cluster(inode->volume, inode->seek_cluster) && inode->seek_index < clusters)
+    {
+        i = inode->seek_index;
+        cluster = inode->seek_cluster;
+    }
+    else
+    {
+        i = 0;
+        cluster = inode->first_cluster;
+    }
+
+    for (; i + 1 < clusters && fatfs_is_cluster(inode->volume, fatfs_next_cluster(inode->volume, cluster)); i++)
+        cluster = fatfs_next_cluster(inode->volume, cluster);
+    for (; i + 1 < clusters; i++)
+    {
+        cluster = fatfs_allocate_cluster(inode->volume, cluster);
+        if (cluster == 0)
+            return -1;
+    }
+
+    inode->seek_index = i;
+    inode->seek_cluster = cluster;
+    return 0;
+}
+
+/* Write the file's size and first cluster back to its directory entry */
+static int fatfs_update_entry(fatfs_inode_t* inode)
+{
+    fatfs_dirent_t entry;
+
+    if (fatfs_read_bytes(inode->volume, inode->cached.number, sizeof(fatfs_dirent_t), &entry))
+        return -1;
+    entry.cluster_high = (uint16_t) (inode->first_cluster >> 16);
+    entry.cluster_low = (uint16_t) inode->first_cluster;
+    entry.size = (uint32_t) inode->size;
+    return fatfs_write_bytes(inode->volume, inode->cached.number, sizeof(fatfs_dirent_t), &entry);
+}
+
+static void fatfs_destroy_inode(icache_inode_t* inode)
+{
+    free(inode);
+}
+
+static void fatfs_get(vnode_t* node)
+{
+    icache_ref(&((fatfs_inode_t*) node->data)->cached);
+}
+
+static void fatfs_put(vnode_t* node)
+{
+    icache_put(&((fatfs_inode_t*) node->data)->cached);
+}
+
+static int fatfs_open(vnode_t* node)
+{
+    fatfs_inode_t* inode;
+    inode = node->data;
+    if (inode->is_directory)
+        return -1;
+    return 0;
+}
+
+/* Move data between buffer and the clusters already in the chain, returns how many bytes were moved */
+static uint64_t fatfs_transfer(fatfs_inode_t* inode, void* buffer, uint64_t count, uint64_t offset, uint8_t write)
+{
+    fatfs_volume_t* volume;
+    uint64_t done, index, within, run, size, position;
+    uint32_t cluster;
+
+    volume = inode->volume;
+    for (done = 0; done < count; done += size)
+    {
+        index = (offset + done) / volume->cluster_bytes;
+        within = (offset + done) % volume->cluster_bytes;
+        cluster = fatfs_find_cluster(inode, index);
+        if (cluster == 0)
+            break;
+
+        /* A run of back to back clusters is a single transfer, when reading the rest of it is loaded ahead */
+        position = fatfs_cluster_position(volume, cluster);
+        run = fatfs_run_length(volume, cluster, ceildivu(within + count - done + (write ? 0 : FATFS_READ_AHEAD), volume->cluster_bytes));
+        if (!write)
+            drivefs_read_ahead(volume->drive, volume->lba_start + position / volume->drive->sector_bytes, run * volume->cluster_bytes);
+        run = minu(run, ceildivu(within + count - done, volume->cluster_bytes));
+        size = minu(run * volume->cluster_bytes - within, count - done);
+        if
+        (
+            write ?
+            fatfs_write_bytes(volume, position + within, size, &((uint8_t*) buffer)[done]) :
+            fatfs_read_bytes(volume, position + within, size, &((uint8_t*) buffer)[done])
+        )
+            break;
+
+        inode->seek_index = index + (within + size - 1) / volume->cluster_bytes;
+        inode->seek_cluster = cluster + (uint32_t) ((within + size - 1) / volume->cluster_bytes);
+    }
+
+    return done;
+}
+
+static int64_t fatfs_read(vnode_t* node, void* buffer, uint64_t count, uint64_t offset)
+{
+    fatfs_inode_t* inode;
+    uint64_t done;
+
+    inode = node->data;
+    if (inode->is_directory)
+        return -1;
+    if (offset >= inode->size || count == 0)
+        return 0;
+
+    done = fatfs_transfer(inode, buffer, minu(count, inode->size - offset), offset, 0);
+    if (done == 0)
+        return -1;
+    return (int64_t) done;
+}
+
+static int64_t fatfs_write(vnode_t* node, const char* data, uint64_t count, uint64_t offset)
+{
+    fatfs_inode_t* inode;
+    uint64_t done, gap_end, size;
+    uint32_t first_cluster;
+    uint8_t* zeros;
+
+    inode = node->data;
+    if (inode->is_directory || offset >= FATFS_MAX_FILE_SIZE)
+        return -1;
+    if (count == 0)
+        return 0;
+    count = minu(count, FATFS_MAX_FILE_SIZE - offset);
+
+    first_cluster = inode->first_cluster;
+    size = inode->size;
+    if (fatfs_extend(inode, ceildivu(offset + count, inode->volume->cluster_bytes)))
+        return -1;
+
+    /* New clusters come zeroed, the old last one might have anything past the end of the file */
+    gap_end = minu(offset, alignu(inode->size, inode->volume->cluster_bytes));
+    if (gap_end > inode->size)
+    {
+        zeros = calloc(1, gap_end - inode->size);
+        if (zeros == NULL)
+            return -1;
+        done = fatfs_transfer(inode, zeros, gap_end - inode->size, inode->size, 1);
+        free(zeros);
+        if (done < gap_end - inode->size)
+            return -1;
+    }
+
+    done = fatfs_transfer(inode, (void*) data, count, offset, 1);
+    if (offset + done > inode->size)
+        inode->size = offset + done;
+    if
+    (
+        (inode->size != size || inode->first_cluster != first_cluster) &&
+        fatfs_update_entry(inode)
+    )
+        return -1;
+
+    if (done == 0)
+        return -1;
+    return (int64_t) done;
+}
+
+static int fatfs_get_attribs(vnode_t* node, vattribs_t* attr)
+{
+    fatfs_inode_t* inode;
+    inode = node->data;
+    attr->size = inode->size;
+    return 0;
+}
+
+static uint8_t fatfs_short_name_checksum(const char* name)
+{
+    uint8_t sum;
+    uint64_t i;
+
+    for (i = 0, sum = 0; i < sizeof(((fatfs_dirent_t*) NULL)->name); i++)
+        sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + (uint8_t) name[i]);
+    return sum;
+}
+
+/* "NAME.EXT" without the padding, returns its length */
+static uint64_t fatfs_short_name(const fatfs_dirent_t* entry, char* name)
+{
+    uint64_t base, extension, i;
+
+    for (base = 8; base > 0 && entry->name[base - 1] == ' '; base--);
+    for (extension = 3; extension > 0 && entry->name[8 + extension - 1] == ' '; extension--);
+
+    memcpy(name, entry->name, base);
+    if (base > 0 && ((uint8_t) name[0]) == FATFS_ENTRY_KANJI)
+        name[0] = (char) FATFS_ENTRY_FREE;
+    if (extension == 0)
+        return base;
+
+    name[base] = '.';
+    for (i = 0; i < extension; i++)
+        name[base + 1 + i] = entry->name[8 + i];
+    return base + 1 + extension;
+}
+
+/* Characters outside of ASCII can't be typed in a path here, they never match */
+static void fatfs_copy_lfn(const fatfs_lfn_t* lfn, char* name)
+{
+    uint16_t chars[FATFS_LFN_CHARS];
+    uint64_t i, base;
+
+    memcpy(&chars[0], lfn->name1, sizeof(lfn->name1));
+    memcpy(&chars[5], lfn->name2, sizeof(lfn->name2));
+    memcpy(&chars[11], lfn->name3, sizeof(lfn->name3));
+
+    base = ((lfn->sequence & FATFS_LFN_SEQUENCE) - 1) * FATFS_LFN_CHARS;
+    for (i = 0; i < FATFS_LFN_CHARS; i++)
+    {
+        /* The name ends with a 0 and is padded with 0xFFFF */
+        if (chars[i] == 0x0000 || chars[i] == 0xFFFF)
+            name[base + i] = '\0';
+        else
+            name[base + i] = (chars[i] < 0x80) ? (char) chars[i] : '\x7F';
+    }
+}
+
+static int fatfs_lookup(vnode_t* dir, const char* name, vnode_t* out)
+{
+    fatfs_inode_t* inode;
+    fatfs_volume_t* volume;
+    fatfs_inode_t template;
+    fatfs_dirent_t* entry;
+    fatfs_lfn_t* lfn;
+    uint8_t* data;
+    char short_name[13];
+    char long_name[FATFS_LFN_MAX_ENTRIES * FATFS_LFN_CHARS + 1];
+    uint64_t length, offset, hops;
+    uint32_t cluster;
+    uint8_t checksum;
+    /* LFN entries still expected before the short one, -1 if there's no usable long name */
+    int64_t lfn_expected;
+    int exit_code;
+
+    inode = dir->data;
+    volume = inode->volume;
+    if (!inode->is_directory)
+        return -1;
+
+    if (*name == '/')
+        ++name;
+    length = strcspn(name, "/");
+
+    data = malloc(volume->cluster_bytes);
+    if (data == NULL)
+        return -1;
+
+    exit_code = VNODE_LOOKUP_NOT_FOUND;
+    lfn_expected = -1;
+    checksum = 0;
+    long_name[FATFS_LFN_MAX_ENTRIES * FATFS_LFN_CHARS] = '\0';
+    for
+    (
+        cluster = inode->first_cluster, hops = 0;
+        fatfs_is_cluster(volume, cluster) && hops < volume->num_clusters;
+        cluster = fatfs_next_cluster(volume, cluster), hops++
+    )
+    {
+        if (fatfs_read_bytes(volume, fatfs_cluster_position(volume, cluster), volume->cluster_bytes, data))
+        {
+            exit_code = -1;
+            goto DONE;
+        }
+
+        for (offset = 0; offset < volume->cluster_bytes; offset += sizeof(fatfs_dirent_t))
+        {
+            entry = (fatfs_dirent_t*) &data[offset];
+            if (((uint8_t) entry->name[0]) == FATFS_ENTRY_END)
+                goto DONE;
+            if (((uint8_t) entry->name[0]) == FATFS_ENTRY_FREE)
+            {
+                lfn_expected = -1;
+                continue;
+            }
+
+            if (entry->attributes == FATFS_ATTR_LFN)
+            {
+                lfn = (fatfs_lfn_t*) entry;
+                if (lfn->sequence & FATFS_LFN_LAST)
+                {
+                    lfn_expected = lfn->sequence & FATFS_LFN_SEQUENCE;
+                    if (lfn_expected > FATFS_LFN_MAX_ENTRIES)
+                        lfn_expected = -1;
+                    checksum = lfn->checksum;
+                    memset(long_name, 0, sizeof(long_name) - 1);
+                }
+                if
+                (
+                    lfn_expected <= 0 ||
+                    (lfn->sequence & FATFS_LFN_SEQUENCE) != lfn_expected ||
+                    lfn->checksum != checksum
+                )
+                {
+                    lfn_expected = -1;
+                    continue;
+                }
+                fatfs_copy_lfn(lfn, long_name);
+                --lfn_expected;
+                continue;
+            }
+
+            if (entry->attributes & FATFS_ATTR_VOLUME_ID || entry->name[0] == '.')
+            {
+                lfn_expected = -1;
+                continue;
+            }
+
+            /* The long name is only good if it was complete and belongs to this entry */
+            if
+            (
+                !(
+                    lfn_expected == 0 &&
+                    checksum == fatfs_short_name_checksum(entry->name) &&
+                    strlen(long_name) == length &&
+                    vfs_names_equal_nocase(long_name, name, length)
+                ) &&
+                !(
+                    fatfs_short_name(entry, short_name) == length &&
+                    vfs_names_equal_nocase(short_name, name, length)
+                )
+            )
+            {
+                lfn_expected = -1;
+                continue;
+            }
+
+            memset(&template, 0, sizeof(fatfs_inode_t));
+            template.volume = volume;
+            template.is_directory = !!(entry->attributes & FATFS_ATTR_DIRECTORY);
+            template.is_hidden = !!(entry->attributes & FATFS_ATTR_HIDDEN);
+            template.first_cluster = (((uint32_t) entry->cluster_high) << 16) | entry->cluster_low;
+            template.size = template.is_directory ? 0 : entry->size;
+            template.cached.number = fatfs_cluster_position(volume, cluster) + offset;
+            template.cached.fs = volume;
+            template.cached.destroy = &fatfs_destroy_inode;
+            out->ops = &vnode_ops;
+            out->data = icache_share(&template.cached, sizeof(fatfs_inode_t));
+            exit_code = (out->data == NULL) ? -1 : 0;
+            goto DONE;
+        }
+    }
+
+DONE:
+    free(data);
+    return exit_code;
+}
+
+static int fatfs_check(const fatfs_bpb_t* bpb, const drive_t* drive)
+{
+    if
+    (
+        bpb->signature != FATFS_BOOT_SIG ||
+        bpb->bytes_per_sector < FATFS_MIN_SECTOR_BYTES ||
+        bpb->bytes_per_sector > FATFS_MAX_SECTOR_BYTES ||
+        (bpb->bytes_per_sector & (bpb->bytes_per_sector - 1)) != 0 ||
+        bpb->bytes_per_sector % drive->sector_bytes != 0 ||
+        bpb->sectors_per_cluster == 0 ||
+        (bpb->sectors_per_cluster & (bpb->sectors_per_cluster - 1)) != 0 ||
+        bpb->reserved_sectors == 0 ||
+        bpb->num_fats == 0 ||
+        /* FAT12 and FAT16 have a fixed root directory and a 16-bit FAT size */
+        bpb->root_entries != 0 ||
+        bpb->sectors_per_fat_16 != 0 ||
+        bpb->sectors_per_fat_32 == 0
+    )
+        return -1;
+    return 0;
+}
+
+int fatfs_create(drive_t* drive, uint64_t partition_index)
+{
+    fatfs_volume_t* volume;
+    fatfs_inode_t* inode;
+    fatfs_bpb_t bpb;
+    uint64_t total_sectors, data_sector, active_fat;
+
+    if
+    (
+        drivefs_read(drive, drive->partitions[partition_index].lba_start, sizeof(fatfs_bpb_t), &bpb) < sizeof(fatfs_bpb_t) ||
+        fatfs_check(&bpb, drive)
+    )
+        return -1;
+
+    total_sectors = (bpb.total_sectors_16 != 0) ? bpb.total_sectors_16 : bpb.total_sectors_32;
+    data_sector = bpb.reserved_sectors + ((uint64_t) bpb.num_fats) * bpb.sectors_per_fat_32;
+    if (total_sectors <= data_sector)
+        return -1;
+
+    volume = malloc(sizeof(fatfs_volume_t));
+    if (volume == NULL)
+        return -1;
+    volume->drive = drive;
+    volume->lba_start = drive->partitions[partition_index].lba_start;
+    volume->cluster_bytes = ((uint64_t) bpb.sectors_per_cluster) * bpb.bytes_per_sector;
+    volume->data_position = data_sector * bpb.bytes_per_sector;
+    volume->root_cluster = bpb.root_cluster;
+    /* The FAT might have room for more clusters than the volume has */
+    volume->num_clusters = (uint32_t) minu
+    (
+        (total_sectors - data_sector) / bpb.sectors_per_cluster + FATFS_FIRST_CLUSTER,
+        minu(((uint64_t) bpb.sectors_per_fat_32) * bpb.bytes_per_sector / sizeof(uint32_t), FATFS_CLUSTER_MASK)
+    );
+
+    volume->fat_position = ((uint64_t) bpb.reserved_sectors) * bpb.bytes_per_sector;
+    volume->fat_bytes = ((uint64_t) bpb.sectors_per_fat_32) * bpb.bytes_per_sector;
+    volume->num_fats = bpb.num_fats;
+    active_fat = 0;
+    if (bpb.ext_flags & FATFS_EXT_NO_MIRRORING)
+    {
+        /* Only the active copy is used and written */
+        active_fat = minu(bpb.ext_flags & FATFS_EXT_ACTIVE_FAT, bpb.num_fats - 1);
+        volume->fat_position += active_fat * volume->fat_bytes;
+        volume->num_fats = 1;
+    }
+    volume->fsinfo_stale = 0;
+    volume->fsinfo_position = 0;
+    if (bpb.fsinfo_sector != 0 && bpb.fsinfo_sector < bpb.reserved_sectors)
+        volume->fsinfo_position = ((uint64_t) bpb.fsinfo_sector) * bpb.bytes_per_sector;
+    volume->next_free = FATFS_FIRST_CLUSTER;
+    volume->fat = malloc(((uint64_t) volume->num_clusters) * sizeof(uint32_t));
+    if (volume->fat == NULL)
+    {
+        trace_fatfs("Could not allocate %u bytes for the FAT", ((uint64_t) volume->num_clusters) * sizeof(uint32_t));
+        free(volume);
+        return -1;
+    }
+
+    inode = malloc(sizeof(fatfs_inode_t));
+    if
+    (
+        inode == NULL ||
+        !fatfs_is_cluster(volume, volume->root_cluster) ||
+        fatfs_read_bytes(volume, volume->fat_position, ((uint64_t) volume->num_clusters) * sizeof(uint32_t), volume->fat)
+    )
+    {
+        if (inode != NULL)
+            free(inode);
+        free(volume->fat);
+        free(volume);
+        return -1;
+    }
+    memset(inode, 0, sizeof(fatfs_inode_t));
+    inode->volume = volume;
+    inode->is_directory = 1;
+    inode->first_cluster = volume->root_cluster;
+    /* No directory entry describes the root, it takes number 0 and is never evicted */
+    inode->cached.fs = volume;
+    inode->cached.number = 0;
+    inode->cached.destroy = &fatfs_destroy_inode;
+    icache_insert(&inode->cached);
+
+    drive->partitions[partition_index].vfs.root.ops = &vnode_ops;
+    drive->partitions[partition_index].vfs.root.data = inode;
+    strcpy(drive->partitions[partition_index].fs_sig, FATFS_SIG);
+
+    return 0;
+}
+
+void fatfs_init(void)
+{
+    vnode_ops.open = &fatfs_open;
+    vnode_ops.read = &fatfs_read;
+    vnode_ops.write = &fatfs_write;
+    vnode_ops.lookup = &fatfs_lookup;
+    vnode_ops.get_attribs = &fatfs_get_attribs;
+    vnode_ops.get = &fatfs_get;
+    vnode_ops.put = &fatfs_put;
+}
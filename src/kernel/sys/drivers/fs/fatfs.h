@@ -1,6 +1,9 @@
 #ifndef __FATFS_H__
 #define __FATFS_H__
 
-// PLACEHOLDER
+#include "drivefs.h"
+
+void fatfs_init(void);
+int fatfs_create(drive_t* drive, uint64_t partition_index);
 
 #endif
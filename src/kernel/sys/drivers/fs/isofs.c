@@ -1,8 +1,12 @@
 #include "isofs.h"
+#include "../../../proc/vfs/icache.h"
 #include "../../../utils/macros.h"
 #include "../../../utils/alloc.h"
+#include "../../../utils/log.h"
 #include <stddef.h>
 #include <string.h>
+#include <math.h>
+#include <mem.h>
 
 #define ISOFS_SIG "ISO9660"
 #define ISOFS_MAX_VDS 3
@@ -13,6 +17,26 @@
 #define ISOFS_VOLDESC_BOOT 0
 #define ISOFS_VOLDESC_PRIM 1
 #define ISOFS_VOLDESC_TERM 255
+/* How far past a read the rest of the file is loaded into the block cache */
+#define ISOFS_READ_AHEAD SIZE_nKB(64)
+/* Fixed part of a directory record, the name follows it */
+#define ISOFS_DIR_RECORD_MIN 33
+/* Directory indexes start with 1 << SHIFT buckets and keep at most 2 entries per bucket on average */
+#define ISOFS_INDEX_MIN_SHIFT 3
+#define ISOFS_INDEX_MAX_SHIFT 16
+/* SUSP entries are 4 bytes of header then data */
+#define ISOFS_SUSP_HEADER 4
+/* Continuation areas followed for a single record */
+#define ISOFS_SUSP_MAX_CONTINUATIONS 8
+
+/**
+ *  NM bit 1 (CURRENT): The name is ".".
+ *  NM bit 2 (PARENT): The name is "..".
+ */
+#define ISOFS_RR_NM_CURRENT (1 << 1)
+#define ISOFS_RR_NM_PARENT (1 << 2)
+
+#define trace_isofs(msg, ...) trace("ISOF", msg, ##__VA_ARGS__)
 
 #define isofs_block_offset(block, drive) (((block) * ISOFS_BLOCK_SIZE) / drive->sector_bytes)
 
@@ -137,32 +161,119 @@ struct isofs_primary_volume_descriptor
 } __attribute__((packed));
 typedef struct isofs_primary_volume_descriptor isofs_primary_volume_descriptor_t;
 
-typedef struct isofs_vfss_list_entry
+/* System Use Sharing Protocol entry, Rock Ridge keeps its data in these */
+struct isofs_susp_entry
 {
-    struct isofs_vfss_list_entry* next;
-    vnode_t root;
-} isofs_vfss_list_entry_t;
+    char sig[2];
+    uint8_t length;
+    uint8_t version;
+    uint8_t data[];
+} __attribute__((packed));
+typedef struct isofs_susp_entry isofs_susp_entry_t;
+
+struct isofs_path_table_record
+{
+    uint8_t name_length;
+    uint8_t extended_attribute_record_length;
+    uint32_t block;
+    /* Number of the parent directory, directories are numbered from 1 in table order */
+    uint16_t parent;
+    char name[1];
+} __attribute__((packed));
+typedef struct isofs_path_table_record isofs_path_table_record_t;
+
+typedef struct
+{
+    uint64_t hash;
+    uint32_t data_block;
+    uint16_t parent;
+    /* Next directory in the same bucket, 0 ends the chain */
+    uint16_t next;
+    uint8_t name_length;
+    /* On Rock Ridge volumes only entries renamed after their parent's index are trusted */
+    uint8_t rr_named : 1;
+    /* The Rock Ridge name is matched as it is */
+    uint8_t exact_name : 1;
+    uint8_t reserved : 6;
+    /* Points into the loaded path table, or to a copy of the Rock Ridge name */
+    const char* name;
+} isofs_path_entry_t;
 
 typedef struct
 {
     drive_t* drive;
+    uint8_t* path_table;
+    /* Directory N is dirs[N - 1], none if the path table couldn't be loaded */
+    isofs_path_entry_t* dirs;
+    uint64_t num_dirs;
+    /* Hashed by (parent, name) */
+    uint64_t shift;
+    uint16_t* buckets;
+    /* Records carry Rock Ridge entries after susp_skip bytes of their system use area */
+    uint8_t rock_ridge;
+    uint8_t susp_skip;
+} isofs_volume_t;
+
+typedef struct
+{
+    /* From the NM entries, empty if there were none */
+    char name[VFS_NAME_MAX + 1];
+    uint64_t name_length;
+    /* CL, the directory was moved here to keep the tree shallow */
+    uint32_t child_block;
+    uint8_t has_child : 1;
+    /* RE, this is the moved directory, its CL record stands in for it */
+    uint8_t relocated : 1;
+    uint8_t reserved : 6;
+} isofs_rock_ridge_t;
+
+typedef struct isofs_index_entry
+{
+    struct isofs_index_entry* next;
+    uint64_t hash;
+    /* Of the file's first directory record */
+    uint64_t position;
+    uint64_t data_block;
+    uint64_t data_size;
+    uint8_t is_directory : 1;
+    uint8_t is_hidden : 1;
+    /* More extents of the same file follow */
+    uint8_t not_final : 1;
+    /* Rock Ridge names are matched as they are, ISO9660 ones regardless of case */
+    uint8_t exact_name : 1;
+    uint8_t reserved : 4;
+    uint8_t name_length;
+    char name[];
+} isofs_index_entry_t;
+
+/* Every entry of a directory hashed by name, built the first time the directory is searched */
+typedef struct
+{
+    uint64_t shift;
+    isofs_index_entry_t** buckets;
+} isofs_index_t;
+
+typedef struct
+{
+    /**
+     * Keyed by (volume, position of the file's directory record),
+     * directories by the position of their own "." record, the first one in their extent
+     */
+    icache_inode_t cached;
+    isofs_volume_t* volume;
     uint8_t is_directory : 1;
     uint8_t is_hidden : 1;
     uint8_t exists : 1;
     uint8_t reserved : 5;
     uint64_t data_block;
+    /* Directories found through the path table don't know it until they're first read */
     uint64_t data_size;
+    /* In the path table, 0 if it isn't in there */
+    uint16_t dir_number;
+    /* NULL until the first lookup in the directory */
+    isofs_index_t* index;
 } isofs_inode_t;
 
-typedef struct
-{
-    isofs_vfss_list_entry_t* head;
-    isofs_vfss_list_entry_t* tail;
-} isofs_vfss_list_t;
-
-static uint64_t index;
-static isofs_vfss_list_t vfss_list;
-static vfs_ops_t vfs_ops;
 static vnode_ops_t vnode_ops;
 
 int isofs_load_volume_descriptor(drive_t* drive, isofs_volume_descriptor_t* desc, uint8_t type)
@@ -190,29 +301,39 @@ int isofs_check(drive_t* drive)
     return -1;
 }
 
-static isofs_vfss_list_entry_t* isofs_get_entry(uint64_t index)
+static void isofs_free_index(isofs_index_t* index)
 {
-    isofs_vfss_list_entry_t* entry;
-    for 
-    (
-        entry = vfss_list.head; 
-        index > 0 && entry != NULL; 
-        index--, entry = entry->next
-    );
-    if (index > 0)
-        return NULL;
-    return entry;
+    isofs_index_entry_t* entry;
+    isofs_index_entry_t* next;
+    uint64_t i;
+
+    for (i = 0; i < (1ULL << index->shift); i++)
+    {
+        for (entry = index->buckets[i]; entry != NULL; entry = next)
+        {
+            next = entry->next;
+            free(entry);
+        }
+    }
+    free(index->buckets);
+    free(index);
 }
 
-static int isofs_root(vfs_t* vfs, vnode_t* out)
+static void isofs_destroy_inode(icache_inode_t* inode)
 {
-    isofs_vfss_list_entry_t* entry;
-    entry = isofs_get_entry(vfs->index);
-    if (entry == NULL)
-        return -1;
-    out->ops = entry->root.ops;
-    out->data = entry->root.data;
-    return 0;
+    if (((isofs_inode_t*) inode)->index != NULL)
+        isofs_free_index(((isofs_inode_t*) inode)->index);
+    free(inode);
+}
+
+static void isofs_get(vnode_t* node)
+{
+    icache_ref(&((isofs_inode_t*) node->data)->cached);
+}
+
+static void isofs_put(vnode_t* node)
+{
+    icache_put(&((isofs_inode_t*) node->data)->cached);
 }
 
 static int isofs_open(vnode_t* node)
@@ -224,87 +345,589 @@ static int isofs_open(vnode_t* node)
     return 0;
 }
 
-static int isofs_read(vnode_t* node, void* buffer, uint64_t count)
+static int64_t isofs_read(vnode_t* node, void* buffer, uint64_t count, uint64_t offset)
 {
     isofs_inode_t* inode;
+    uint64_t start, skip;
+
     inode = node->data;
     if (inode->is_directory || !inode->exists)
         return -1;
-    if (drivefs_read(inode->drive, isofs_block_offset(inode->data_block, inode->drive), count, buffer) < count)
+    if (offset >= inode->data_size)
+        return 0;
+    count = minu(count, inode->data_size - offset);
+
+    start = inode->data_block * ISOFS_BLOCK_SIZE + offset;
+    skip = start % inode->volume->drive->sector_bytes;
+    /* Files are contiguous, sequential readers find their next chunk cached */
+    drivefs_read_ahead(inode->volume->drive, start / inode->volume->drive->sector_bytes, skip + minu(count + ISOFS_READ_AHEAD, inode->data_size - offset));
+    if (drivefs_read_bytes(inode->volume->drive, start, count, buffer))
         return -1;
-    return 0;
+
+    return (int64_t) count;
 }
 
-static int isofs_write(vnode_t* node, const char* data, uint64_t count)
+static int64_t isofs_write(vnode_t* node, const char* data, uint64_t count, uint64_t offset)
 {
     UNUSED(node);
+    UNUSED(offset);
     UNUSED(data);
     UNUSED(count);
     return -1;
 }
 
+static int isofs_load_directory_size(isofs_inode_t* inode)
+{
+    isofs_directory_entry_t record;
+
+    /* A directory's size is in its "." record, which comes first */
+    if (drivefs_read(inode->volume->drive, isofs_block_offset(inode->data_block, inode->volume->drive), sizeof(isofs_directory_entry_t), &record) < sizeof(isofs_directory_entry_t))
+        return -1;
+    inode->data_size = record.bytes_lsb;
+    return 0;
+}
+
 static int isofs_get_attribs(vnode_t* node, vattribs_t* attr)
 {
     isofs_inode_t* inode;
     inode = node->data;
+    if (inode->is_directory && inode->data_size == 0 && isofs_load_directory_size(inode))
+        return -1;
     attr->size = inode->data_size;
     return 0;
 }
 
-static int isofs_lookup(vnode_t* dir, const char* path, vnode_t* out)
+static uint64_t isofs_hash_name(const char* name, uint64_t length)
 {
-    isofs_directory_entry_t* iso_dir;
-    isofs_inode_t* inode;
-    uint8_t sector[ISOFS_BLOCK_SIZE];
-    uint64_t path_offset, bytes_offset;
+    uint64_t hash;
 
-    inode = dir->data;
-    if (!inode->is_directory)
-        return -1;
+    /* FNV-1a over the folded name, names are stored in upper case (d-characters) but matched regardless of case */
+    for (hash = 0xCBF29CE484222325; length > 0; length--)
+    {
+        hash ^= (uint8_t) vfs_fold_case(*name++);
+        hash *= 0x100000001B3;
+    }
 
-    if (*path == '/')
-        ++path;
-    for (path_offset = 0; path[path_offset] != '\0' && path[path_offset] != '/'; path_offset++);
+    return hash;
+}
 
-    if (drivefs_read(inode->drive, isofs_block_offset(inode->data_block, inode->drive), inode->data_size, sector) < ISOFS_BLOCK_SIZE)
-        return -1;
+static isofs_index_entry_t** isofs_index_bucket(isofs_index_t* index, uint64_t hash)
+{
+    return &index->buckets[(hash * 0x9E3779B97F4A7C15) >> (64 - index->shift)];
+}
+
+static uint8_t isofs_record_name_length(const isofs_directory_entry_t* record)
+{
+    uint8_t length;
+
+    /* Drop the version (";1") and the dot left behind by names without an extension */
+    for (length = 0; length < record->file_name_length && record->file_name[length] != ';'; length++);
+    if (length > 1 && record->file_name[length - 1] == '.')
+        --length;
+    return length;
+}
+
+static uint32_t isofs_read_le32(const uint8_t* data)
+{
+    return ((uint32_t) data[0]) | (((uint32_t) data[1]) << 8) | (((uint32_t) data[2]) << 16) | (((uint32_t) data[3]) << 24);
+}
+
+/* Offset of a record's system use area, it follows the name and the byte padding it to an even length */
+static uint64_t isofs_system_use_offset(const isofs_directory_entry_t* record)
+{
+    return ISOFS_DIR_RECORD_MIN + record->file_name_length + !(record->file_name_length & 1);
+}
+
+static void isofs_parse_rock_ridge(isofs_volume_t* volume, const isofs_directory_entry_t* record, isofs_rock_ridge_t* rr)
+{
+    isofs_susp_entry_t* entry;
+    const uint8_t* area;
+    uint8_t continuation[ISOFS_BLOCK_SIZE];
+    uint64_t offset, end, hops, length, next_block, next_offset, next_size;
+
+    memset(rr, 0, sizeof(isofs_rock_ridge_t));
+    area = (const uint8_t*) record;
+    offset = isofs_system_use_offset(record) + volume->susp_skip;
+    end = record->entry_length;
+
+    for (hops = 0; ; hops++)
+    {
+        for (next_size = 0; offset + ISOFS_SUSP_HEADER <= end; offset += entry->length)
+        {
+            entry = (isofs_susp_entry_t*) &area[offset];
+            if (entry->length < ISOFS_SUSP_HEADER || offset + entry->length > end)
+                break;
+
+            if (strncmp(entry->sig, "ST", 2) == 0)
+                break;
+            else if (strncmp(entry->sig, "CE", 2) == 0 && entry->length >= ISOFS_SUSP_HEADER + 24)
+            {
+                /* Both-endian fields, only the little endian halves are read */
+                next_block = isofs_read_le32(&entry->data[0]);
+                next_offset = isofs_read_le32(&entry->data[8]);
+                next_size = isofs_read_le32(&entry->data[16]);
+            }
+            else if (strncmp(entry->sig, "NM", 2) == 0 && entry->length > ISOFS_SUSP_HEADER + 1)
+            {
+                if (entry->data[0] & (ISOFS_RR_NM_CURRENT | ISOFS_RR_NM_PARENT))
+                    continue;
+                /* Names longer than one entry are split across several */
+                length = minu(entry->length - ISOFS_SUSP_HEADER - 1, VFS_NAME_MAX - rr->name_length);
+                memcpy(&rr->name[rr->name_length], &entry->data[1], length);
+                rr->name_length += length;
+            }
+            else if (strncmp(entry->sig, "CL", 2) == 0 && entry->length >= ISOFS_SUSP_HEADER + 8)
+            {
+                rr->child_block = isofs_read_le32(&entry->data[0]);
+                rr->has_child = 1;
+            }
+            else if (strncmp(entry->sig, "RE", 2) == 0)
+                rr->relocated = 1;
+        }
+
+        /* The rest of the entries are in a continuation area elsewhere */
+        if
+        (
+            next_size == 0 ||
+            hops == ISOFS_SUSP_MAX_CONTINUATIONS ||
+            next_offset + next_size > ISOFS_BLOCK_SIZE ||
+            drivefs_read(volume->drive, isofs_block_offset(next_block, volume->drive), ISOFS_BLOCK_SIZE, continuation) < ISOFS_BLOCK_SIZE
+        )
+            break;
+        area = continuation;
+        offset = next_offset;
+        end = next_offset + next_size;
+    }
+}
 
-    for 
+/* Read the SUSP indicator from the root's "." record, only volumes with Rock Ridge have it */
+static void isofs_detect_rock_ridge(isofs_volume_t* volume, uint64_t root_block)
+{
+    isofs_directory_entry_t* record;
+    isofs_susp_entry_t* entry;
+    uint8_t block[ISOFS_BLOCK_SIZE];
+
+    if (drivefs_read(volume->drive, isofs_block_offset(root_block, volume->drive), ISOFS_BLOCK_SIZE, block) < ISOFS_BLOCK_SIZE)
+        return;
+    record = (isofs_directory_entry_t*) block;
+    if (isofs_system_use_offset(record) + ISOFS_SUSP_HEADER + 3 > record->entry_length)
+        return;
+
+    entry = (isofs_susp_entry_t*) &block[isofs_system_use_offset(record)];
+    if
     (
-        bytes_offset = 0, iso_dir = (isofs_directory_entry_t*) sector; 
-        bytes_offset < inode->data_size && bytes_offset < ISOFS_BLOCK_SIZE && iso_dir->entry_length != 0;
-        bytes_offset += iso_dir->entry_length
-    ) 
+        strncmp(entry->sig, "SP", 2) == 0 &&
+        entry->length >= ISOFS_SUSP_HEADER + 3 &&
+        entry->data[0] == 0xBE &&
+        entry->data[1] == 0xEF
+    )
+    {
+        volume->rock_ridge = 1;
+        volume->susp_skip = entry->data[2];
+    }
+}
+
+/* Add a record to the list of entries, or extend the file it continues, rr is NULL without Rock Ridge */
+static int isofs_index_record(isofs_index_entry_t** list, uint64_t* count, const isofs_directory_entry_t* record, uint64_t position, const isofs_rock_ridge_t* rr)
+{
+    isofs_index_entry_t* entry;
+    const char* name;
+    uint64_t length;
+
+    if (rr != NULL && rr->name_length > 0)
+    {
+        name = rr->name;
+        length = rr->name_length;
+    }
+    else
+    {
+        name = (const char*) record->file_name;
+        length = isofs_record_name_length(record);
+    }
+
+    entry = *list;
+    if
+    (
+        entry != NULL &&
+        entry->not_final &&
+        entry->name_length == length &&
+        strncmp(entry->name, name, length) == 0
+    )
+    {
+        /* A file's extents are read as one, only those laid out back to back can be */
+        if (entry->data_block * ISOFS_BLOCK_SIZE + entry->data_size == ((uint64_t) record->block_lsb) * ISOFS_BLOCK_SIZE)
+        {
+            entry->data_size += record->bytes_lsb;
+            entry->not_final = record->file_flags.not_final_record;
+        }
+        else
+            entry->not_final = 0;
+        return 0;
+    }
+
+    entry = malloc(sizeof(isofs_index_entry_t) + length);
+    if (entry == NULL)
+        return -1;
+    entry->hash = isofs_hash_name(name, length);
+    entry->position = position;
+    entry->data_block = record->block_lsb;
+    entry->data_size = record->bytes_lsb;
+    entry->is_directory = record->file_flags.is_directory;
+    entry->is_hidden = record->file_flags.hidden;
+    entry->not_final = record->file_flags.not_final_record;
+    entry->exact_name = (name != (const char*) record->file_name);
+    entry->name_length = (uint8_t) length;
+    memcpy(entry->name, name, length);
+    if (rr != NULL && rr->has_child)
     {
-        iso_dir = (isofs_directory_entry_t*) (sector + bytes_offset);
-        if 
+        /* Its size is in the "." record at the new location */
+        entry->is_directory = 1;
+        entry->data_block = rr->child_block;
+        entry->data_size = 0;
+    }
+    entry->next = *list;
+    *list = entry;
+    ++(*count);
+
+    return 0;
+}
+
+static isofs_index_t* isofs_build_index(isofs_inode_t* inode)
+{
+    isofs_directory_entry_t* record;
+    isofs_index_entry_t* list;
+    isofs_index_entry_t* entry;
+    isofs_index_t* index;
+    isofs_rock_ridge_t rock_ridge;
+    isofs_rock_ridge_t* rr;
+    uint8_t block[ISOFS_BLOCK_SIZE];
+    uint64_t i, blocks, offset, count;
+
+    if (inode->data_size == 0 && isofs_load_directory_size(inode))
+        return NULL;
+
+    /* The whole directory is scanned anyway, have it loaded in one go */
+    blocks = ceildivu(inode->data_size, ISOFS_BLOCK_SIZE);
+    drivefs_read_ahead(inode->volume->drive, isofs_block_offset(inode->data_block, inode->volume->drive), blocks * ISOFS_BLOCK_SIZE);
+
+    for (i = 0, list = NULL, count = 0; i < blocks; i++)
+    {
+        if (drivefs_read(inode->volume->drive, isofs_block_offset(inode->data_block + i, inode->volume->drive), ISOFS_BLOCK_SIZE, block) < ISOFS_BLOCK_SIZE)
+            goto FAIL;
+
+        /* Records never cross a block, the rest of a block is zeroed once they run out */
+        for
         (
-            iso_dir->file_name_length >= path_offset &&
-            strncmp(path, (const char*) iso_dir->file_name, path_offset) == 0
+            offset = 0;
+            offset + ISOFS_DIR_RECORD_MIN <= ISOFS_BLOCK_SIZE && block[offset] != 0;
+            offset += record->entry_length
         )
-            goto SUCCESS;
+        {
+            record = (isofs_directory_entry_t*) &block[offset];
+            if
+            (
+                record->entry_length < ISOFS_DIR_RECORD_MIN ||
+                offset + record->entry_length > ISOFS_BLOCK_SIZE ||
+                ISOFS_DIR_RECORD_MIN + record->file_name_length > record->entry_length
+            )
+                break;
+            /* "." and ".." are single bytes 0 and 1 */
+            if (record->file_name_length == 1 && record->file_name[0] <= 1)
+                continue;
+            if (!inode->volume->rock_ridge)
+                rr = NULL;
+            else
+            {
+                rr = &rock_ridge;
+                isofs_parse_rock_ridge(inode->volume, record, rr);
+                if (rr->relocated)
+                    continue;
+            }
+            if (isofs_index_record(&list, &count, record, (inode->data_block + i) * ISOFS_BLOCK_SIZE + offset, rr))
+                goto FAIL;
+        }
+    }
+
+    index = malloc(sizeof(isofs_index_t));
+    if (index == NULL)
+        goto FAIL;
+    for (index->shift = ISOFS_INDEX_MIN_SHIFT; index->shift < ISOFS_INDEX_MAX_SHIFT && (2ULL << index->shift) < count; index->shift++);
+    index->buckets = calloc(1ULL << index->shift, sizeof(isofs_index_entry_t*));
+    if (index->buckets == NULL)
+    {
+        free(index);
+        goto FAIL;
+    }
+
+    while (list != NULL)
+    {
+        entry = list;
+        list = list->next;
+        entry->next = *isofs_index_bucket(index, entry->hash);
+        *isofs_index_bucket(index, entry->hash) = entry;
     }
 
+    return index;
+
+FAIL:
+    while (list != NULL)
+    {
+        entry = list;
+        list = list->next;
+        free(entry);
+    }
+    return NULL;
+}
+
+static uint16_t* isofs_path_bucket(isofs_volume_t* volume, uint16_t parent, uint64_t hash)
+{
+    return &volume->buckets[((hash ^ parent) * 0x9E3779B97F4A7C15) >> (64 - volume->shift)];
+}
+
+/* Number of the directory called name in parent, or 0 */
+static uint16_t isofs_find_directory(isofs_volume_t* volume, uint16_t parent, const char* name, uint64_t length)
+{
+    isofs_path_entry_t* dir;
+    uint64_t hash;
+    uint16_t number;
+
+    if (parent == 0)
+        return 0;
+
+    hash = isofs_hash_name(name, length);
+    for (number = *isofs_path_bucket(volume, parent, hash); number != 0; number = dir->next)
+    {
+        dir = &volume->dirs[number - 1];
+        if
+        (
+            dir->hash != hash ||
+            dir->parent != parent ||
+            dir->name_length != length ||
+            (volume->rock_ridge && !dir->rr_named)
+        )
+            continue;
+        if (dir->exact_name ? (strncmp(dir->name, name, length) == 0) : vfs_names_equal_nocase(dir->name, name, length))
+            return number;
+    }
+
+    return 0;
+}
+
+static void isofs_rename_directory(isofs_volume_t* volume, uint16_t number, const isofs_index_entry_t* entry)
+{
+    isofs_path_entry_t* dir;
+    uint16_t* link;
+    char* name;
+
+    dir = &volume->dirs[number - 1];
+    dir->rr_named = 1;
+    /* Without an NM entry the path table already has the name */
+    if (!entry->exact_name)
+        return;
+
+    name = malloc(entry->name_length);
+    if (name == NULL)
+    {
+        dir->rr_named = 0;
+        return;
+    }
+    memcpy(name, entry->name, entry->name_length);
+
+    for (link = isofs_path_bucket(volume, dir->parent, dir->hash); *link != number; link = &volume->dirs[*link - 1].next);
+    *link = dir->next;
+
+    dir->name = name;
+    dir->name_length = entry->name_length;
+    dir->hash = entry->hash;
+    dir->exact_name = 1;
+
+    link = isofs_path_bucket(volume, dir->parent, dir->hash);
+    dir->next = *link;
+    *link = number;
+}
+
+/**
+ * The path table only has ISO9660 names, give the subdirectories of a Rock Ridge
+ * directory the names its index found for them. Moved directories (CL) are left
+ * alone, they're listed under the directory they were moved to
+ */
+static void isofs_name_subdirectories(isofs_inode_t* inode)
+{
+    isofs_volume_t* volume;
+    isofs_index_entry_t* entry;
+    uint64_t i, first, last, number;
+
+    volume = inode->volume;
+    if (inode->dir_number == 0)
+        return;
+
+    /* Directories come after their parent and are grouped by it */
+    for (first = inode->dir_number + 1; first <= volume->num_dirs && volume->dirs[first - 1].parent != inode->dir_number; first++);
+    for (last = first; last <= volume->num_dirs && volume->dirs[last - 1].parent == inode->dir_number; last++);
+    if (first == last)
+        return;
+
+    for (i = 0; i < (1ULL << inode->index->shift); i++)
+    {
+        for (entry = inode->index->buckets[i]; entry != NULL; entry = entry->next)
+        {
+            if (!entry->is_directory)
+                continue;
+            for (number = first; number < last; number++)
+            {
+                if (!volume->dirs[number - 1].rr_named && volume->dirs[number - 1].data_block == entry->data_block)
+                {
+                    isofs_rename_directory(volume, (uint16_t) number, entry);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static int isofs_load_path_table(isofs_volume_t* volume, const isofs_primary_volume_descriptor_t* pvd)
+{
+    isofs_path_table_record_t* record;
+    isofs_path_entry_t* dir;
+    uint64_t size, offset, count;
+    uint16_t* bucket;
+
+    size = pvd->path_table_size_lsb;
+    if (size < sizeof(isofs_path_table_record_t))
+        return -1;
+    volume->path_table = malloc(size);
+    if (volume->path_table == NULL)
+        return -1;
+    if (drivefs_read(volume->drive, isofs_block_offset(pvd->path_table_lba_lsb, volume->drive), size, volume->path_table) < size)
+        goto FAIL;
+
+    /* Records are padded to an even length, there can be no more directories than a parent number holds */
+    for
+    (
+        offset = 0, count = 0;
+        offset + sizeof(isofs_path_table_record_t) <= size && count < 0xFFFF;
+        offset += alignu(sizeof(isofs_path_table_record_t) - 1 + record->name_length, 2), count++
+    )
+    {
+        record = (isofs_path_table_record_t*) &volume->path_table[offset];
+        if (record->name_length == 0 || offset + sizeof(isofs_path_table_record_t) - 1 + record->name_length > size)
+            break;
+    }
+    if (count == 0)
+        goto FAIL;
+
+    volume->dirs = malloc(count * sizeof(isofs_path_entry_t));
+    if (volume->dirs == NULL)
+        goto FAIL;
+    for (volume->shift = ISOFS_INDEX_MIN_SHIFT; volume->shift < ISOFS_INDEX_MAX_SHIFT && (2ULL << volume->shift) < count; volume->shift++);
+    volume->buckets = calloc(1ULL << volume->shift, sizeof(uint16_t));
+    if (volume->buckets == NULL)
+    {
+        free(volume->dirs);
+        volume->dirs = NULL;
+        goto FAIL;
+    }
+
+    for (offset = 0, volume->num_dirs = 0; volume->num_dirs < count; offset += alignu(sizeof(isofs_path_table_record_t) - 1 + record->name_length, 2))
+    {
+        record = (isofs_path_table_record_t*) &volume->path_table[offset];
+        dir = &volume->dirs[volume->num_dirs++];
+        dir->hash = isofs_hash_name(record->name, record->name_length);
+        dir->data_block = record->block;
+        dir->parent = record->parent;
+        dir->name_length = record->name_length;
+        dir->name = record->name;
+        dir->rr_named = 0;
+        dir->exact_name = 0;
+        dir->next = 0;
+        /* The root is its own parent, everything else comes after its parent */
+        if (volume->num_dirs == 1 || record->parent == 0 || record->parent >= volume->num_dirs)
+            continue;
+        bucket = isofs_path_bucket(volume, dir->parent, dir->hash);
+        dir->next = *bucket;
+        *bucket = (uint16_t) volume->num_dirs;
+    }
+
+    return 0;
+
+FAIL:
+    free(volume->path_table);
+    volume->path_table = NULL;
     return -1;
+}
+
+static int isofs_lookup(vnode_t* dir, const char* name, vnode_t* out)
+{
+    isofs_index_entry_t* entry;
+    isofs_inode_t* inode;
+    isofs_inode_t template;
+    uint64_t length, hash;
+    uint16_t number;
+
+    inode = dir->data;
+    if (!inode->is_directory)
+        return -1;
+
+    if (*name == '/')
+        ++name;
+    length = strcspn(name, "/");
 
-SUCCESS:
+    memset(&template, 0, sizeof(isofs_inode_t));
+    template.volume = inode->volume;
+    template.exists = 1;
+    template.cached.fs = inode->volume;
+    template.cached.destroy = &isofs_destroy_inode;
     out->ops = &vnode_ops;
-    out->data = malloc(sizeof(isofs_inode_t));
-    ((isofs_inode_t*) out->data)->drive = inode->drive;
-    inode = out->data;
-    inode->is_directory = iso_dir->file_flags.is_directory;
-    inode->is_hidden = iso_dir->file_flags.hidden;
-    inode->exists = 1;
-    inode->data_block = iso_dir->block_lsb;
-    inode->data_size = iso_dir->bytes_lsb;
 
-    return 0;
+    /* Subdirectories are in the path table, there's no need to read this directory for them */
+    number = isofs_find_directory(inode->volume, inode->dir_number, name, length);
+    if (number == 0 && inode->index == NULL)
+    {
+        inode->index = isofs_build_index(inode);
+        if (inode->index == NULL)
+            return -1;
+        /* Rock Ridge names are only known to the path table once the directory was read */
+        if (inode->volume->rock_ridge)
+        {
+            isofs_name_subdirectories(inode);
+            number = isofs_find_directory(inode->volume, inode->dir_number, name, length);
+        }
+    }
+    if (number != 0)
+    {
+        template.is_directory = 1;
+        template.data_block = inode->volume->dirs[number - 1].data_block;
+        template.dir_number = number;
+        template.cached.number = template.data_block * ISOFS_BLOCK_SIZE;
+        out->data = icache_share(&template.cached, sizeof(isofs_inode_t));
+        return (out->data == NULL) ? -1 : 0;
+    }
+
+    hash = isofs_hash_name(name, length);
+    for (entry = *isofs_index_bucket(inode->index, hash); entry != NULL; entry = entry->next)
+    {
+        if (entry->hash != hash || entry->name_length != length)
+            continue;
+        if (entry->exact_name ? (strncmp(entry->name, name, length) == 0) : vfs_names_equal_nocase(entry->name, name, length))
+            break;
+    }
+    if (entry == NULL)
+        return VNODE_LOOKUP_NOT_FOUND;
+
+    template.is_directory = entry->is_directory;
+    template.is_hidden = entry->is_hidden;
+    template.data_block = entry->data_block;
+    template.data_size = entry->data_size;
+    template.cached.number = entry->is_directory ? entry->data_block * ISOFS_BLOCK_SIZE : entry->position;
+    out->data = icache_share(&template.cached, sizeof(isofs_inode_t));
+
+    return (out->data == NULL) ? -1 : 0;
 }
 
 int isofs_create(drive_t* drive, uint64_t partition_index)
 {
+    isofs_volume_t* volume;
     isofs_inode_t* inode;
-    isofs_vfss_list_entry_t* entry;
     isofs_primary_volume_descriptor_t pvd;
     
     if 
@@ -314,33 +937,46 @@ int isofs_create(drive_t* drive, uint64_t partition_index)
     )
         return -1;
 
-    entry = malloc(sizeof(isofs_vfss_list_entry_t));
-    if (entry == NULL)
+    volume = calloc(1, sizeof(isofs_volume_t));
+    if (volume == NULL)
         return -1;
-    
-    entry->root.ops = &vnode_ops;
+    volume->drive = drive;
+    /**
+     * Lookups still work without the path table, they just read every directory on the way.
+     * With Rock Ridge its entries are renamed as their parents are read
+     */
+    isofs_detect_rock_ridge(volume, pvd.root.block_lsb);
+    if (isofs_load_path_table(volume, &pvd))
+        trace_isofs("Could not load the path table");
+
     inode = malloc(sizeof(isofs_inode_t));
     if (inode == NULL)
     {
-        free(entry);
+        if (volume->path_table != NULL)
+        {
+            free(volume->path_table);
+            free(volume->dirs);
+            free(volume->buckets);
+        }
+        free(volume);
         return -1;
     }
-    inode->drive = drive;
+    inode->volume = volume;
     inode->is_hidden = pvd.root.file_flags.hidden;
     inode->is_directory = pvd.root.file_flags.is_directory;
+    inode->exists = 1;
     inode->data_block = pvd.root.block_lsb;
     inode->data_size = pvd.root.bytes_lsb;
-    entry->root.data = inode;
-
-    entry->next = NULL;
-    if (vfss_list.tail == NULL)
-        vfss_list.head = entry;
-    else
-        vfss_list.tail->next = entry;
-    vfss_list.tail = entry;
-
-    drive->partitions[partition_index].vfs.index = index++;
-    drive->partitions[partition_index].vfs.ops = &vfs_ops;
+    inode->dir_number = (volume->num_dirs > 0) ? 1 : 0;
+    inode->index = NULL;
+    /* The instance keeps this reference */
+    inode->cached.fs = volume;
+    inode->cached.number = inode->data_block * ISOFS_BLOCK_SIZE;
+    inode->cached.destroy = &isofs_destroy_inode;
+    icache_insert(&inode->cached);
+
+    drive->partitions[partition_index].vfs.root.ops = &vnode_ops;
+    drive->partitions[partition_index].vfs.root.data = inode;
     strcpy(drive->partitions[partition_index].fs_sig, ISOFS_SIG);
 
     return 0;
@@ -348,13 +984,11 @@ int isofs_create(drive_t* drive, uint64_t partition_index)
 
 void isofs_init(void)
 {
-    index = 0;
-    vfss_list.head = NULL;
-    vfss_list.tail = NULL;
     vnode_ops.open = &isofs_open;
     vnode_ops.read = &isofs_read;
     vnode_ops.write = &isofs_write;
     vnode_ops.lookup = &isofs_lookup;
     vnode_ops.get_attribs = &isofs_get_attribs;
-    vfs_ops.root = &isofs_root;
+    vnode_ops.get = &isofs_get;
+    vnode_ops.put = &isofs_put;
 }
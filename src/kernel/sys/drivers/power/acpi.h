@@ -35,7 +35,75 @@ struct mcfg
 } __attribute__((packed));
 typedef struct mcfg mcfg_t;
 
+typedef enum
+{
+    MADT_ENTRY_LAPIC = 0,
+    MADT_ENTRY_IOAPIC = 1,
+    MADT_ENTRY_INTERRUPT_SOURCE_OVERRIDE = 2,
+    MADT_ENTRY_LAPIC_NMI = 4,
+    MADT_ENTRY_LAPIC_ADDRESS_OVERRIDE = 5
+} madt_entry_type_t;
+
+struct madt_entry_header
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+typedef struct madt_entry_header madt_entry_header_t;
+
+struct madt_entry_lapic
+{
+    madt_entry_header_t header;
+    uint8_t acpi_processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+typedef struct madt_entry_lapic madt_entry_lapic_t;
+
+struct madt_entry_ioapic
+{
+    madt_entry_header_t header;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t ioapic_address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+typedef struct madt_entry_ioapic madt_entry_ioapic_t;
+
+struct madt_entry_interrupt_source_override
+{
+    madt_entry_header_t header;
+    uint8_t bus_source;
+    uint8_t irq_source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+typedef struct madt_entry_interrupt_source_override madt_entry_interrupt_source_override_t;
+
+struct madt
+{
+    sdt_header_t sdt_header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed));
+typedef struct madt madt_t;
+
+#define MADT_LAPIC_ENABLED (1 << 0)
+#define MADT_LAPIC_ONLINE_CAPABLE (1 << 1)
+
+/**
+ *  Interrupt source override flags.
+ *  Bit 0-1: Polarity (00 = Bus default, 01 = Active high, 11 = Active low).
+ *  Bit 2-3: Trigger mode (00 = Bus default, 01 = Edge, 11 = Level).
+ */
+#define MADT_ISO_POLARITY_MASK 0b0011
+#define MADT_ISO_POLARITY_LOW 0b0011
+#define MADT_ISO_TRIGGER_MASK 0b1100
+#define MADT_ISO_TRIGGER_LEVEL 0b1100
+
 #define MCFG_SIG "MCFG"
+#define MADT_SIG "APIC"
 #define RSDT_SIG "RSDT"
 #define XSDT_SIG "XSDT"
 
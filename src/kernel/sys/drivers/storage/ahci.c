@@ -423,7 +423,7 @@ static int ahci_identify_port(ahci_port_descriptor_t* desc)
     return 0;
 }
 
-static uint64_t ahci_read_capped(drive_t* drive, uint64_t lba, uint64_t bytes, uint64_t buffer)
+static uint64_t ahci_transfer_capped(drive_t* drive, uint64_t lba, uint64_t bytes, uint64_t buffer, uint8_t write)
 {
     ahci_port_descriptor_t* desc;
     hba_cmd_header_t* cmd_header;
@@ -445,8 +445,8 @@ static uint64_t ahci_read_capped(drive_t* drive, uint64_t lba, uint64_t bytes, u
     cmd_header = (hba_cmd_header_t*) desc->clb_vaddr;
     cmd_header += slot;
     cmd_header->cmd_fis_length = (uint8_t) (sizeof(fis_reg_h2d_t) / sizeof(uint32_t));
-    cmd_header->write = 0;
-    cmd_header->prdt_length = (uint16_t) ceil((double) bytes / SIZE_nMB(4));
+    cmd_header->write = write;
+    cmd_header->prdt_length = (uint16_t) ceildivu(bytes, SIZE_nMB(4));
     
     cmd_tbl = (hba_cmd_tbl_t*) desc->ctb_vaddr;
     cmd_tbl += slot;
@@ -469,7 +469,7 @@ static uint64_t ahci_read_capped(drive_t* drive, uint64_t lba, uint64_t bytes, u
     memset(cmd_fis, 0, sizeof(fis_reg_h2d_t));
     cmd_fis->fis_type = FIS_TYPE_REG_H2D;
     cmd_fis->c_bit = 1;
-    cmd_fis->command = AHCI_ATA_CMD_READ_DMA_EX;
+    cmd_fis->command = write ? AHCI_ATA_CMD_WRITE_DMA_EX : AHCI_ATA_CMD_READ_DMA_EX;
     
     cmd_fis->lba0 = (uint8_t) (lba >> 0x00);
     cmd_fis->lba1 = (uint8_t) (lba >> 0x08);
@@ -479,7 +479,7 @@ static uint64_t ahci_read_capped(drive_t* drive, uint64_t lba, uint64_t bytes, u
     cmd_fis->lba5 = (uint8_t) (lba >> 0x28);
 
     cmd_fis->device = AHCI_ATA_DEV_MODE_LBA;
-    cmd_fis->count = (uint16_t) ceil((double) bytes / drive->sector_bytes);
+    cmd_fis->count = (uint16_t) ceildivu(bytes, drive->sector_bytes);
 
     for 
     (
@@ -499,7 +499,7 @@ static uint64_t ahci_read_capped(drive_t* drive, uint64_t lba, uint64_t bytes, u
     {
         if (desc->port->is & AHCI_HBA_PxIS_TFES)
         {
-            trace_ahci("Disk read error (port %u)", desc->index);
+            trace_ahci("Disk %s error (port %u)", write ? "write" : "read", desc->index);
             return 0;
         }
         else if (!(desc->port->ci & (1 << slot)))
@@ -525,7 +525,7 @@ static uint64_t ahci_read(drive_t* drive, uint64_t lba, uint64_t bytes, void* bu
 
     while (bytes_to_read > 0)
     {
-        bytes_read_now = ahci_read_capped(drive, lba, bytes_to_read, buffer_addr);
+        bytes_read_now = ahci_transfer_capped(drive, lba, bytes_to_read, buffer_addr, 0);
         if (bytes_read_now == 0)
             return bytes_read;
         buffer_addr += bytes_read_now;
@@ -539,6 +539,47 @@ static uint64_t ahci_read(drive_t* drive, uint64_t lba, uint64_t bytes, void* bu
     return bytes_read;
 }
 
+static uint64_t ahci_write(drive_t* drive, uint64_t lba, uint64_t bytes, const void* buffer)
+{
+    uint64_t bytes_written, bytes_written_now, bytes_to_write, buffer_addr;
+    uint8_t* raw_buffer_ptr;
+
+    if (drive == NULL || drive->interface == NULL)
+        return 0;
+
+    bytes_to_write = alignu(bytes, drive->sector_bytes);
+    raw_buffer_ptr = aligned_alloc(0x10, bytes_to_write);
+    if (raw_buffer_ptr == NULL)
+        return 0;
+    /* Whatever follows the data in its last sector is written back as it was */
+    if
+    (
+        bytes_to_write != bytes &&
+        ahci_transfer_capped(drive, lba + bytes / drive->sector_bytes, drive->sector_bytes, (uint64_t) &raw_buffer_ptr[bytes_to_write - drive->sector_bytes], 0) == 0
+    )
+    {
+        free(raw_buffer_ptr);
+        return 0;
+    }
+    memcpy(raw_buffer_ptr, buffer, bytes);
+    bytes_written = 0;
+    buffer_addr = (uint64_t) raw_buffer_ptr;
+
+    while (bytes_to_write > 0)
+    {
+        bytes_written_now = ahci_transfer_capped(drive, lba, bytes_to_write, buffer_addr, 1);
+        if (bytes_written_now == 0)
+            break;
+        buffer_addr += bytes_written_now;
+        bytes_written += bytes_written_now;
+        lba += (bytes_written_now / drive->sector_bytes);
+        bytes_to_write -= bytes_written_now;
+    }
+
+    free(raw_buffer_ptr);
+    return minu(bytes_written, bytes);
+}
+
 static pci_header_common_t* ahci_map_pci_header(uint64_t header_paddr)
 {
     uint64_t vaddr;
@@ -673,7 +714,7 @@ static void ahci_init_controller_ports(hba_mem_t* abar, pci_header_0x0_t* pci_he
     if (kernel_get_next_vaddr(controller_mem_size, &entry->base_vaddr) < controller_mem_size)
         return;
 
-    entry->pages = ceil((double) controller_mem_size / SIZE_4KB);
+    entry->pages = ceildivu(controller_mem_size, SIZE_4KB);
     entry->base_paddr = pfa_request_pages(entry->pages);
     if (entry->base_paddr == 0)
         return;
@@ -789,6 +830,8 @@ static uint64_t ahci_init_controller(pci_header_0x0_t* pci_header)
         return 0;
     }
 
+    entry->ports = NULL;
+    entry->max_ports = 0;
     ahci_init_controller_ports(abar, pci_header, entry);
 
     entry->next = NULL;
@@ -812,6 +855,7 @@ int ahci_init(void)
 
     memset(&ahci_controllers, 0, sizeof(ahci_controllers_list_t));
     ahci_ops.read = &ahci_read;
+    ahci_ops.write = &ahci_write;
 
     controllers = pci_find_devices(0x1, 0x6, -1);
     controller = controllers->head;
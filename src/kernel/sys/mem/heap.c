@@ -49,7 +49,7 @@ static uint64_t heap_expand(uint64_t size)
     if (kernel_heap.end_vaddr + new_size > kernel_heap.ceil_vaddr)
         return 0;
     
-    pages_count = ceil((double) new_size / SIZE_4KB);
+    pages_count = ceildivu(new_size, SIZE_4KB);
     pages_paddr = pfa_request_pages(pages_count);
     if (pages_paddr == 0)
         return 0;
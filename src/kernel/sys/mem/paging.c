@@ -1,12 +1,14 @@
 #include "paging.h"
 #include "../../kernel.h"
 #include "../../proc/scheduler.h"
+#include "../../utils/spinlock.h"
 #include <mem.h>
 
 static page_table_t kernel_pml4;
 static page_table_t kernel_tmp_pt;
 static uint64_t kernel_tmp_index;
 static uint64_t kernel_pml4_paddr;
+static spinlock_t kernel_tmp_lock = SPINLOCK_INIT;
 
 uint64_t kernel_get_pml4_paddr(void)
 {
@@ -74,8 +76,12 @@ static void pte_create(page_table_t table, uint64_t index, uint64_t paddr, page_
 uint64_t paging_map_temporary_page(uint64_t paddr, page_access_type_t access, privilege_level_t privilege_level)
 {
     uint64_t index;
+    spinlock_acquire(&kernel_tmp_lock);
     index = paging_get_next_tmp_index();
     pte_create(kernel_tmp_pt, index, paddr, access, privilege_level);
+    spinlock_release(&kernel_tmp_lock);
+    /* The slot may still be cached from its last user */
+    pte_invalidate(VADDR_GET_TEMPORARY(index));
     return VADDR_GET_TEMPORARY(index);
 }
 
@@ -85,9 +91,11 @@ void paging_unmap_temporary_page(uint64_t vaddr)
     if (!VADDR_IS_TEMPORARY(vaddr))
         return;
     index = VADDR_TO_PT_IDX(vaddr);
+    spinlock_acquire(&kernel_tmp_lock);
     if (kernel_tmp_index > index)
         kernel_tmp_index = index;
     PTE_CLEAR(&kernel_tmp_pt[index]);
+    spinlock_release(&kernel_tmp_lock);
     pte_invalidate(vaddr);
 }
 
@@ -1,6 +1,7 @@
 #include "pfa.h"
 #include "mmap.h"
 #include "paging.h"
+#include "../../utils/spinlock.h"
 #include <math.h>
 #include <mem.h>
 
@@ -10,19 +11,67 @@ static bitmap_t page_bitmap;
 static uint64_t last_page_index;
 static uint64_t free_memory, used_memory;
 
+static spinlock_t pfa_lock = SPINLOCK_INIT;
+
+static void pfa_lock_page_unlocked(uint64_t page_addr)
+{
+    uint64_t index;
+    index = PFA_GET_PAGE_IDX(page_addr);
+    if (!bitmap_get(&page_bitmap, index))
+    {
+        bitmap_set(&page_bitmap, index, 1);
+        used_memory += SIZE_4KB;
+        free_memory -= SIZE_4KB;
+    }
+}
+
+static void pfa_free_page_unlocked(uint64_t page_addr)
+{
+    uint64_t index;
+    index = PFA_GET_PAGE_IDX(page_addr);
+    if (bitmap_get(&page_bitmap, index))
+    {
+        bitmap_set(&page_bitmap, index, 0);
+        free_memory += SIZE_4KB;
+        used_memory -= SIZE_4KB;
+    }
+    if (last_page_index > index)
+            last_page_index = index;
+}
+
 uint64_t pfa_request_page(void)
 {
     uint64_t address;
-    for (; last_page_index < page_bitmap.size * 8; last_page_index++)
+    spinlock_acquire(&pfa_lock);
+    for (address = 0; last_page_index < page_bitmap.size * 8; last_page_index++)
     {
         if (!bitmap_get(&page_bitmap, last_page_index))
         {
             address = (last_page_index * SIZE_4KB);
-            pfa_lock_page(address);
-            return address;
+            pfa_lock_page_unlocked(address);
+            break;
+        }
+    }
+    spinlock_release(&pfa_lock);
+    return address;
+}
+
+uint64_t pfa_request_page_below(uint64_t ceil)
+{
+    uint64_t index, address;
+    spinlock_acquire(&pfa_lock);
+    /* Page 0 doubles as the failure value, never hand it out */
+    for (index = 1, address = 0; index < PFA_GET_PAGE_IDX(ceil) && index < page_bitmap.size * 8; index++)
+    {
+        if (!bitmap_get(&page_bitmap, index))
+        {
+            address = (index * SIZE_4KB);
+            pfa_lock_page_unlocked(address);
+            break;
         }
     }
-    return 0;
+    spinlock_release(&pfa_lock);
+    return address;
 }
 
 uint64_t pfa_request_pages(uint64_t num)
@@ -30,6 +79,7 @@ uint64_t pfa_request_pages(uint64_t num)
     uint64_t found;
     uint64_t address;
     
+    spinlock_acquire(&pfa_lock);
     for (found = 0, address = 0; last_page_index < page_bitmap.size * 8 && found < num; last_page_index++)
     {
         if (!bitmap_get(&page_bitmap, last_page_index))
@@ -46,47 +96,43 @@ uint64_t pfa_request_pages(uint64_t num)
     }
 
     if (found == num)
-        pfa_lock_pages(address, num);
+    {
+        for (found = 0; found < num; found++)
+            pfa_lock_page_unlocked(address + found * SIZE_4KB);
+    }
+    spinlock_release(&pfa_lock);
     
     return address;
 }
 
 void pfa_lock_page(uint64_t page_addr)
 {
-    uint64_t index;
-    index = PFA_GET_PAGE_IDX(page_addr);
-    if (!bitmap_get(&page_bitmap, index))
-    {
-        bitmap_set(&page_bitmap, PFA_GET_PAGE_IDX(page_addr), 1);
-        used_memory += SIZE_4KB;
-        free_memory -= SIZE_4KB;
-    }
+    spinlock_acquire(&pfa_lock);
+    pfa_lock_page_unlocked(page_addr);
+    spinlock_release(&pfa_lock);
 }
 
 void pfa_free_page(uint64_t page_addr)
 {
-    uint64_t index;
-    index = PFA_GET_PAGE_IDX(page_addr);
-    if (bitmap_get(&page_bitmap, index))
-    {
-        bitmap_set(&page_bitmap, index, 0);
-        free_memory += SIZE_4KB;
-        used_memory -= SIZE_4KB;
-    }
-    if (last_page_index > index)
-            last_page_index = index;
+    spinlock_acquire(&pfa_lock);
+    pfa_free_page_unlocked(page_addr);
+    spinlock_release(&pfa_lock);
 }
 
 void pfa_lock_pages(uint64_t page_addr, uint64_t num)
 {
+    spinlock_acquire(&pfa_lock);
     for (; num > 0; num--, page_addr += SIZE_4KB)
-        pfa_lock_page(page_addr);
+        pfa_lock_page_unlocked(page_addr);
+    spinlock_release(&pfa_lock);
 }
 
 void pfa_free_pages(uint64_t page_addr, uint64_t num)
 {
+    spinlock_acquire(&pfa_lock);
     for (; num > 0; num--, page_addr += SIZE_4KB)
-        pfa_free_page(page_addr);
+        pfa_free_page_unlocked(page_addr);
+    spinlock_release(&pfa_lock);
 }
 
 void pfa_init(void)
@@ -97,14 +143,14 @@ void pfa_init(void)
     free_memory = total_memory - used_memory;
 
     /* Initialize new bitmap */
-    bitmap_size = ceil(((double) total_memory) / SIZE_4KB / 8.0);
-    bitmap_paddr = pfa_request_pages(ceil((double) bitmap_size / SIZE_4KB));
+    bitmap_size = ceildivu(total_memory, SIZE_4KB * 8);
+    bitmap_paddr = pfa_request_pages(ceildivu(bitmap_size, SIZE_4KB));
     kernel_get_next_vaddr(bitmap_size, &bitmap_vaddr);
     paging_map_memory(bitmap_paddr, bitmap_vaddr, bitmap_size, PAGE_ACCESS_RW, PL0);
     memset((void*) bitmap_vaddr, 0, bitmap_size);
 
     /* Copy the old bitmap over */
-    pfa_free_pages(alignd((uint64_t) page_bitmap.buffer, SIZE_4KB), ceil((double) page_bitmap.size / SIZE_4KB));
+    pfa_free_pages(alignd((uint64_t) page_bitmap.buffer, SIZE_4KB), ceildivu(page_bitmap.size, SIZE_4KB));
     memcpy((void*) bitmap_vaddr, page_bitmap.buffer, page_bitmap.size);
 
     /* Set new bitmap */
@@ -4,6 +4,7 @@
 #include "../../utils/bitmap.h"
 
 uint64_t pfa_request_page(void);
+uint64_t pfa_request_page_below(uint64_t ceil);
 uint64_t pfa_request_pages(uint64_t num);
 void pfa_lock_page(uint64_t page_addr);
 void pfa_free_page(uint64_t page_addr);
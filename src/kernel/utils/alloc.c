@@ -1,12 +1,17 @@
 #include "alloc.h"
 #include "../sys/mem/heap.h"
+#include "spinlock.h"
 #include <mem.h>
 #include <stddef.h>
 
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
 void* malloc(uint64_t size)
 {
     heap_segment_header_t* seg;
+    spinlock_acquire(&heap_lock);
     seg = heap_allocate_memory(size);
+    spinlock_release(&heap_lock);
     if (seg == NULL)
         return NULL;
     return ((void*) (seg + 1));
@@ -15,7 +20,9 @@ void* malloc(uint64_t size)
 void* aligned_alloc(uint64_t align, uint64_t size)
 {
     heap_segment_header_t* seg;
+    spinlock_acquire(&heap_lock);
     seg = heap_allocate_aligned_memory(align, size);
+    spinlock_release(&heap_lock);
     if (seg == NULL)
         return NULL;
     return ((void*) (seg + 1));
@@ -47,5 +54,7 @@ void free(void* ptr)
 {
     heap_segment_header_t* seg;
     seg = ((heap_segment_header_t*) ptr) - 1;
+    spinlock_acquire(&heap_lock);
     heap_free_memory(seg);
+    spinlock_release(&heap_lock);
 }
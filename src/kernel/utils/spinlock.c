@@ -0,0 +1,26 @@
+#include "spinlock.h"
+
+void spinlock_init(spinlock_t* lock)
+{
+    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
+
+void spinlock_acquire(spinlock_t* lock)
+{
+    while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE))
+    {
+        /* Spin on a plain read so the cache line isn't bounced around */
+        while (lock->locked)
+            __asm__ volatile ("pause");
+    }
+}
+
+int spinlock_try_acquire(spinlock_t* lock)
+{
+    return !__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE);
+}
+
+void spinlock_release(spinlock_t* lock)
+{
+    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
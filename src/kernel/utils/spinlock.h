@@ -0,0 +1,22 @@
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#include <stdint.h>
+
+/**
+ * The kernel runs with interrupts disabled, so a lock is never
+ * taken again by an interrupt handler on the CPU that holds it
+ */
+typedef struct
+{
+    volatile uint8_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+void spinlock_init(spinlock_t* lock);
+void spinlock_acquire(spinlock_t* lock);
+int spinlock_try_acquire(spinlock_t* lock);
+void spinlock_release(spinlock_t* lock);
+
+#endif
@@ -2,6 +2,7 @@
 #include "multiboot2-utils.h"
 #include "macros.h"
 #include "log.h"
+#include "spinlock.h"
 #include "../headers/psf.h"
 #include "../sys/drivers/video/framebuffer.h"
 #include <stddef.h>
@@ -16,6 +17,7 @@ static uint32_t offset_x, offset_y;
 static uint32_t fg_color, bg_color;
 static vnode_ops_t vnode_ops;
 static framebuffer_info_t* fb;
+static spinlock_t tty_lock;
 
 #define font_header _binary_font_psf_start.header
 #define font_glyphs _binary_font_psf_start.glyphs
@@ -165,7 +167,9 @@ void tty_printf(const char* str, ...)
 {
     va_list ap;
     va_start(ap, str);
+    spinlock_acquire(&tty_lock);
     tty_printva(str, ap);
+    spinlock_release(&tty_lock);
     va_end(ap);
 }
 
@@ -195,20 +199,29 @@ static int tty_lookup(vnode_t* vnode, const char* path, vnode_t* out)
     return -1;
 }
 
-static int tty_read(vnode_t* vnode, void* buffer, uint64_t count)
+static int64_t tty_read(vnode_t* vnode, void* buffer, uint64_t count, uint64_t offset)
 {
     UNUSED(vnode);
+    UNUSED(offset);
     UNUSED(buffer);
     UNUSED(count);
     return -1;
 }
 
-static int tty_write(vnode_t* vnode, const char* data, uint64_t count)
+static int64_t tty_write(vnode_t* vnode, const char* data, uint64_t count, uint64_t offset)
 {
+    uint64_t i;
+
     UNUSED(vnode);
-    UNUSED(count);
-    tty_puts(data);
-    return 0;
+    /* A stream, there's nowhere to seek to */
+    UNUSED(offset);
+
+    /* Written as is, data isn't NUL-terminated and color escapes are for the kernel */
+    spinlock_acquire(&tty_lock);
+    for (i = 0; i < count; i++)
+        tty_putc(data[i]);
+    spinlock_release(&tty_lock);
+    return (int64_t) count;
 }
 
 static int tty_get_attribs(vnode_t* vnode, vattribs_t* attr)
@@ -221,6 +234,7 @@ static int tty_get_attribs(vnode_t* vnode, vattribs_t* attr)
 int tty_init(void)
 {
     fb = framebuffer_get();
+    spinlock_init(&tty_lock);
 
     cursor_x = 0;
     cursor_y = 0;